@@ -0,0 +1,913 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "jbod.h"
+#include "mdadm.h"
+#include "net.h"
+#include "util.h"
+
+// Micro-benchmarks for the client stack. Each mode prints one table to stdout.
+
+#define BENCH_ARGUMENTS "hg:u:W:"
+#define USAGE                                                                      \
+  "USAGE: bench [-h] [-g disks:blocks] [-u stripe_blocks] [-W window] <mode>\n"    \
+  "\n"                                                                             \
+  "where:\n"                                                                       \
+  "    -h - help mode (display this message)\n"                                    \
+  "    -g - array geometry, number of disks and blocks per disk (default 16:256)\n" \
+  "    -u - stripe unit in blocks for the striped layout (default 4)\n"            \
+  "    -W - bytes in flight for the layout analysis (default 65536)\n"             \
+  "\n"                                                                             \
+  "modes:\n"                                                                       \
+  "    layout - linear vs. striped layout for a sequential stream (needs a server)\n" \
+  "    cache  - cache lookup, insert and resize cost at 256, 1024 and 4096 entries\n" \
+  "    log    - cost of a debug_log call to the caller, against formatting it in place\n" \
+  "    dump   - mdadm_dump/mdadm_restore against reading and writing block by block (needs a server)\n" \
+  "    vector - mdadm_readv/mdadm_writev against a loop of mdadm_read/mdadm_write over\n" \
+  "             scattered small extents (needs a server)\n" \
+  "    coherence - stale reads of clients sharing blocks, with private caches without and with\n" \
+  "             leases, and uncached (needs a server that serves clients concurrently)\n" \
+  "    snapshot - cost of taking a snapshot against copying the array, and of writes to blocks\n" \
+  "             shared with one against unshared blocks (needs a server)\n" \
+  "    merkle - signing every block one request at a time against mdadm_verify after a few\n" \
+  "             writes (needs a server)\n" \
+  "\n"
+
+#define IO_SIZE 1024
+
+static uint32_t stripe_blocks = 4;
+static uint32_t window = 65536;
+
+/* Returns the current time in seconds */
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* For a sequential stream over the whole array, kept |window| bytes deep,
+ * reports how many disks each window spreads over and how many blocks land on
+ * the busiest disk, which bounds the window's time if disks work in parallel. */
+static void layout_spread(double *avg_disks, double *avg_busiest)
+{
+  const mdadm_geometry_t *geo = mdadm_get_geometry();
+  uint32_t *per_disk = calloc(geo->num_disks, sizeof(uint32_t));
+  uint64_t windows = 0, disks_total = 0, busiest_total = 0;
+
+  for (uint64_t start = 0; start + window <= geo->capacity; start += window)
+  {
+    memset(per_disk, 0, geo->num_disks * sizeof(uint32_t));
+    for (uint64_t addr = start; addr < start + window; addr += JBOD_BLOCK_SIZE)
+    {
+      uint32_t disk, block, offset;
+      mdadm_map(addr, &disk, &block, &offset);
+      per_disk[disk]++;
+    }
+
+    uint32_t busiest = 0;
+    for (uint32_t d = 0; d < geo->num_disks; d++)
+    {
+      disks_total += per_disk[d] > 0;
+      busiest = per_disk[d] > busiest ? per_disk[d] : busiest;
+    }
+    busiest_total += busiest;
+    windows++;
+  }
+
+  *avg_disks = windows ? (double)disks_total / windows : 0;
+  *avg_busiest = windows ? (double)busiest_total / windows : 0;
+  free(per_disk);
+}
+
+/* Writes and then reads back the whole array sequentially, returning the
+ * achieved MB/s for each pass */
+static void layout_stream(double *write_mbs, double *read_mbs)
+{
+  const mdadm_geometry_t *geo = mdadm_get_geometry();
+  uint8_t buf[IO_SIZE];
+  double t;
+
+  memset(buf, 0x5a, sizeof(buf));
+  t = now();
+  for (uint64_t addr = 0; addr + IO_SIZE <= geo->capacity; addr += IO_SIZE)
+  {
+    if (mdadm_write(addr, IO_SIZE, buf) != IO_SIZE)
+      errx(1, "write at %lu failed", (unsigned long)addr);
+  }
+  *write_mbs = geo->capacity / (now() - t) / 1e6;
+
+  t = now();
+  for (uint64_t addr = 0; addr + IO_SIZE <= geo->capacity; addr += IO_SIZE)
+  {
+    if (mdadm_read(addr, IO_SIZE, buf) != IO_SIZE)
+      errx(1, "read at %lu failed", (unsigned long)addr);
+  }
+  *read_mbs = geo->capacity / (now() - t) / 1e6;
+}
+
+static int bench_layout(void)
+{
+  const mdadm_geometry_t *geo = mdadm_get_geometry();
+  uint32_t window_blocks = window / JBOD_BLOCK_SIZE;
+
+  printf("%-12s %12s %14s %12s %10s %10s\n", "layout", "disks/window", "busiest disk", "ideal xfer", "write MB/s", "read MB/s");
+
+  for (int striped = 0; striped <= 1; striped++)
+  {
+    if (striped ? mdadm_set_layout(MDADM_LAYOUT_STRIPED, stripe_blocks) != 1 : mdadm_set_layout(MDADM_LAYOUT_LINEAR, 1) != 1)
+      errx(1, "stripe unit %u does not divide %u blocks per disk", stripe_blocks, geo->blocks_per_disk);
+
+    double disks, busiest, write_mbs, read_mbs;
+    layout_spread(&disks, &busiest);
+
+    if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
+      errx(1, "cannot connect to the server");
+    if (mdadm_mount() != 1 || mdadm_write_permission() != 0)
+      errx(1, "cannot mount the array");
+    layout_stream(&write_mbs, &read_mbs);
+    mdadm_revoke_write_permission();
+    mdadm_unmount();
+    jbod_disconnect();
+
+    char name[32];
+    snprintf(name, sizeof(name), striped ? "striped:%u" : "linear", stripe_blocks);
+    // ideal xfer: speedup of a window over one disk when its disks work in parallel
+    printf("%-12s %12.1f %14.1f %11.1fx %10.2f %10.2f\n", name, disks, busiest,
+           busiest > 0 ? window_blocks / busiest : 0, write_mbs, read_mbs);
+  }
+
+  return 0;
+}
+
+/* Times cache lookups that hit, lookups that miss, and inserts that have to
+ * evict, on a full cache of each size, in nanoseconds per call. Also times
+ * resizing the full cache to half its size and back, in microseconds. */
+static int bench_cache(void)
+{
+  static const int sizes[] = {256, 1024, 4096};
+  const int calls = 200000;
+  uint8_t buf[JBOD_BLOCK_SIZE];
+
+  // Misses need blocks that are not cached: make room for twice the largest cache
+  const mdadm_geometry_t *geo = mdadm_get_geometry();
+  if ((uint64_t)geo->num_disks * geo->blocks_per_disk < 2 * 4096 && mdadm_set_geometry(32, 256) != 1)
+    errx(1, "cannot set a geometry large enough for the cache benchmark");
+  uint32_t bpd = geo->blocks_per_disk;
+
+  printf("tag match: %s\n", cache_tag_match());
+  printf("%-8s %10s %10s %10s %10s\n", "entries", "hit ns", "miss ns", "insert ns", "resize us");
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+  {
+    int n = sizes[s];
+    if (cache_create(n) != 1)
+      errx(1, "cannot create a cache of %d entries", n);
+
+    memset(buf, 0, sizeof(buf));
+    for (int i = 0; i < n; i++)
+    {
+      buf[0] = i;
+      cache_insert(i / bpd, i % bpd, buf);
+    }
+
+    // A fixed pseudo-random order, so every size sees the same access pattern
+    uint32_t x = 12345;
+    double t = now();
+    for (int i = 0; i < calls; i++)
+    {
+      x = x * 1103515245 + 12345;
+      int b = (x >> 8) % n;
+      cache_lookup(b / bpd, b % bpd, buf);
+    }
+    double hit = (now() - t) / calls * 1e9;
+
+    t = now();
+    for (int i = 0; i < calls; i++)
+    {
+      x = x * 1103515245 + 12345;
+      int b = n + (x >> 8) % n;
+      cache_lookup(b / bpd, b % bpd, buf);
+    }
+    double miss = (now() - t) / calls * 1e9;
+
+    // Every insert of a new block into the full cache evicts one
+    int inserts = calls / 10;
+    t = now();
+    for (int i = 0; i < inserts; i++)
+    {
+      int b = n + i % n;
+      cache_insert(b / bpd, b % bpd, buf);
+    }
+    double insert = (now() - t) / inserts * 1e9;
+
+    // Halve the cache and grow it back, refilling it in between
+    const int resizes = 20;
+    double resize = 0;
+    for (int r = 0; r < resizes; r++)
+    {
+      t = now();
+      cache_resize(n / 2);
+      cache_resize(n);
+      resize += now() - t;
+      for (int i = 0; i < n; i++)
+      {
+        int b = (i + r * 7) % (2 * n);
+        cache_insert(b / bpd, b % bpd, buf);
+      }
+    }
+    resize = resize / (2 * resizes) * 1e6;
+
+    cache_destroy();
+    printf("%-8d %10.1f %10.1f %10.1f %10.1f\n", n, hit, miss, insert, resize);
+  }
+
+  return 0;
+}
+
+/* What debug_log used to do: format and write every message in place */
+static void sync_log(int fd, const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  vdprintf(fd, fmt, args);
+  va_end(args);
+  dprintf(fd, "\n");
+}
+
+/* Times debug_log calls as the caller sees them, in nanoseconds per call, to
+ * /dev/null. Calls come in bursts of half a ring, with time for the drainer
+ * to catch up in between, so none are dropped. */
+static int bench_log(void)
+{
+  const int bursts = 200, burst = 2048;
+  const struct timespec drain = {0, 5000000};
+  int fd = open("/dev/null", O_WRONLY);
+  double t, total;
+
+  printf("%-10s %10s\n", "log", "ns/call");
+
+  total = 0;
+  for (int b = 0; b < bursts; b++)
+  {
+    t = now();
+    for (int i = 0; i < burst; i++)
+      debug_log("op 0x%08x info 0x%02x rc %d", i, 2, 0);
+    total += now() - t;
+  }
+  printf("%-10s %10.1f\n", "disabled", total / (bursts * burst) * 1e9);
+
+  total = 0;
+  for (int b = 0; b < bursts; b++)
+  {
+    t = now();
+    for (int i = 0; i < burst; i++)
+      sync_log(fd, "op 0x%08x info 0x%02x rc %d", i, 2, 0);
+    total += now() - t;
+  }
+  printf("%-10s %10.1f\n", "sync", total / (bursts * burst) * 1e9);
+
+  for (int binary = 0; binary <= 1; binary++)
+  {
+    set_debug_logfile("/dev/null");
+    if (binary)
+      set_debug_log_binary();
+    enable_debug_log();
+    debug_log("warm up"); // starts the drainer and creates this thread's ring
+
+    total = 0;
+    for (int b = 0; b < bursts; b++)
+    {
+      nanosleep(&drain, NULL);
+      t = now();
+      for (int i = 0; i < burst; i++)
+        debug_log("op 0x%08x info 0x%02x rc %d", i, 2, 0);
+      total += now() - t;
+    }
+    printf("%-10s %10.1f\n", binary ? "async bin" : "async text", total / (bursts * burst) * 1e9);
+  }
+
+  close(fd);
+  return 0;
+}
+
+/* Returns the bytes in |fd|, rewound for reading */
+static off_t rewind_file(int fd)
+{
+  off_t size = lseek(fd, 0, SEEK_END);
+  lseek(fd, 0, SEEK_SET);
+  return size;
+}
+
+/* Writes |buf| straight to |block| of |disk|, behind mdadm's back */
+static void write_member(uint32_t disk, uint32_t block, uint8_t *buf)
+{
+  if (jbod_client_operation(jbod_encode_op(JBOD_SEEK_TO_DISK, disk, 0), NULL) != 0 ||
+      jbod_client_operation(jbod_encode_op(JBOD_SEEK_TO_BLOCK, 0, block), NULL) != 0 ||
+      jbod_client_operation(jbod_encode_op(JBOD_WRITE_BLOCK, 0, 0), buf) != 0)
+    errx(1, "cannot write block %u of disk %u", block, disk);
+}
+
+/* Dumps a mirrored array with a cache in front, lets the second member of
+ * every pair drift from its primary in one block, and restores the dump
+ * skipping unchanged blocks, so only those blocks are written. Reads must
+ * see the dump's blocks, mdadm_verify must sign both members of each
+ * restored block and no others, and its root must match a full one. */
+static void dump_check_mirrored(void)
+{
+  const mdadm_geometry_t *geo = mdadm_get_geometry();
+  uint64_t num_blocks = (uint64_t)geo->num_disks * geo->blocks_per_disk;
+  uint8_t buf[JBOD_BLOCK_SIZE], want[JBOD_BLOCK_SIZE];
+  uint8_t root[MERKLE_DIGEST_LEN], full[MERKLE_DIGEST_LEN];
+  char path[] = "/tmp/bench-dump-XXXXXX";
+
+  if (mdadm_set_layout(MDADM_LAYOUT_MIRRORED, 1) != 1 || cache_create(CACHE_MAX_BLOCKS) != 1)
+    errx(1, "cannot set up a cached mirrored array");
+  if (mdadm_mount() != 1 || mdadm_write_permission() != 0)
+    errx(1, "cannot mount the array");
+  for (uint64_t addr = 0; addr < geo->capacity; addr += JBOD_BLOCK_SIZE)
+  {
+    memset(buf, addr / JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE);
+    if (mdadm_write(addr, JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE)
+      errx(1, "write at %lu failed", (unsigned long)addr);
+  }
+
+  int fd = mkstemp(path);
+  if (fd < 0)
+    err(1, "cannot create a dump file");
+  unlink(path);
+  if (mdadm_dump(fd, 0) != 1)
+    errx(1, "dump failed");
+
+  // The last disk's pair too, whose second member has no disk after it
+  memset(buf, 0xee, JBOD_BLOCK_SIZE);
+  for (uint32_t d = 1; d < geo->num_disks; d += 2)
+    write_member(d, d % geo->blocks_per_disk, buf);
+  merkle_mark_all_dirty();
+  if (mdadm_verify(root) < 0)
+    errx(1, "verify failed");
+
+  rewind_file(fd);
+  if (mdadm_restore(fd, MDADM_STREAM_SKIP_UNCHANGED) != 1)
+    errx(1, "restore failed");
+  close(fd);
+
+  for (uint64_t addr = 0; addr < geo->capacity; addr += JBOD_BLOCK_SIZE)
+  {
+    memset(want, addr / JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE);
+    if (mdadm_read(addr, JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE || memcmp(buf, want, JBOD_BLOCK_SIZE) != 0)
+      errx(1, "block %lu reads back wrong after a mirrored restore", (unsigned long)(addr / JBOD_BLOCK_SIZE));
+  }
+  if (mdadm_verify(root) != (int)geo->num_disks)
+    errx(1, "the incremental verify signs other blocks than a mirrored restore wrote");
+  merkle_mark_all_dirty();
+  if (mdadm_verify(full) != (int)num_blocks || memcmp(root, full, MERKLE_DIGEST_LEN) != 0)
+    errx(1, "the incremental root misses blocks of a mirrored restore");
+  printf("%-22s %10s\n", "mirrored restore", "ok");
+
+  cache_destroy();
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+}
+
+/* Times copying the array in and out block by block through mdadm_write and
+ * mdadm_read, then fills it with half constant and half random blocks and
+ * times the pipelined dump and restore, with and without skipping blocks.
+ * Then checks a restore of a mirrored array. */
+static int bench_dump(void)
+{
+  const mdadm_geometry_t *geo = mdadm_get_geometry();
+  uint8_t buf[IO_SIZE];
+  int fds[2];
+  double t;
+
+  if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
+    errx(1, "cannot connect to the server");
+  if (mdadm_mount() != 1 || mdadm_write_permission() != 0)
+    errx(1, "cannot mount the array");
+
+  printf("%-22s %10s %12s\n", "copy", "MB/s", "image bytes");
+
+  memset(buf, 0x5a, sizeof(buf));
+  t = now();
+  for (uint64_t addr = 0; addr + IO_SIZE <= geo->capacity; addr += IO_SIZE)
+  {
+    if (mdadm_write(addr, IO_SIZE, buf) != IO_SIZE)
+      errx(1, "write at %lu failed", (unsigned long)addr);
+  }
+  printf("%-22s %10.2f %12s\n", "mdadm_write", geo->capacity / (now() - t) / 1e6, "-");
+
+  t = now();
+  for (uint64_t addr = 0; addr + IO_SIZE <= geo->capacity; addr += IO_SIZE)
+  {
+    if (mdadm_read(addr, IO_SIZE, buf) != IO_SIZE)
+      errx(1, "read at %lu failed", (unsigned long)addr);
+  }
+  printf("%-22s %10.2f %12s\n", "mdadm_read", geo->capacity / (now() - t) / 1e6, "-");
+
+  for (uint64_t addr = 0; addr < geo->capacity; addr += JBOD_BLOCK_SIZE)
+  {
+    if ((addr / JBOD_BLOCK_SIZE) % 2 == 0)
+      memset(buf, 0, JBOD_BLOCK_SIZE);
+    else
+      for (int i = 0; i < JBOD_BLOCK_SIZE; i++)
+        buf[i] = rand();
+    if (mdadm_write(addr, JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE)
+      errx(1, "write at %lu failed", (unsigned long)addr);
+  }
+
+  for (int skip = 0; skip <= 1; skip++)
+  {
+    char path[] = "/tmp/bench-dump-XXXXXX";
+    if ((fds[skip] = mkstemp(path)) < 0)
+      err(1, "cannot create a dump file");
+    unlink(path);
+
+    t = now();
+    if (mdadm_dump(fds[skip], skip ? MDADM_STREAM_SKIP_CONSTANT : 0) != 1)
+      errx(1, "dump failed");
+    double mbs = geo->capacity / (now() - t) / 1e6;
+    printf("%-22s %10.2f %12ld\n", skip ? "dump skip-constant" : "dump", mbs, (long)rewind_file(fds[skip]));
+  }
+
+  for (int skip = 0; skip <= 1; skip++)
+  {
+    rewind_file(fds[0]);
+    t = now();
+    if (mdadm_restore(fds[0], skip ? MDADM_STREAM_SKIP_UNCHANGED : 0) != 1)
+      errx(1, "restore failed");
+    printf("%-22s %10.2f %12s\n", skip ? "restore skip-unchanged" : "restore", geo->capacity / (now() - t) / 1e6, "-");
+  }
+
+  close(fds[0]);
+  close(fds[1]);
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  dump_check_mirrored();
+  jbod_disconnect();
+  return 0;
+}
+
+#define VECTOR_EXTENTS 64
+#define VECTOR_BATCHES 200
+#define VECTOR_SPAN (64 * JBOD_BLOCK_SIZE)
+
+/* Fills |extents| with VECTOR_EXTENTS extents of 16 to 128 bytes at random
+ * addresses in the first VECTOR_SPAN bytes, each with its own stretch of
+ * |data| */
+static void random_extents(mdadm_extent_t *extents, uint8_t *data, unsigned int *seed)
+{
+  for (int i = 0; i < VECTOR_EXTENTS; i++)
+  {
+    extents[i].len = 16 + rand_r(seed) % 113;
+    extents[i].addr = rand_r(seed) % (VECTOR_SPAN - extents[i].len);
+    extents[i].buf = data + i * 128;
+  }
+}
+
+/* Times batches of scattered extents written and read one call each, then
+ * as one vectored call, and counts the server requests they take. The
+ * array is then checked against a copy kept in memory. */
+static int bench_vector(void)
+{
+  static uint8_t shadow[VECTOR_SPAN];
+  uint8_t data[VECTOR_EXTENTS * 128], check[VECTOR_SPAN];
+  mdadm_extent_t extents[VECTOR_EXTENTS];
+  int status[VECTOR_EXTENTS];
+
+  if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
+    errx(1, "cannot connect to the server");
+  if (mdadm_mount() != 1 || mdadm_write_permission() != 0)
+    errx(1, "cannot mount the array");
+  memset(shadow, 0, sizeof(shadow));
+  for (uint64_t addr = 0; addr < VECTOR_SPAN; addr += 1024)
+  {
+    if (mdadm_write(addr, 1024, shadow) != 1024)
+      errx(1, "write at %lu failed", (unsigned long)addr);
+  }
+
+  printf("%-8s %-9s %12s %12s\n", "op", "calls", "us/batch", "req/batch");
+  for (int write = 1; write >= 0; write--)
+  {
+    for (int vectored = 0; vectored <= 1; vectored++)
+    {
+      unsigned int seed = 42;
+      uint64_t requests = 0;
+      double elapsed = 0;
+      for (int b = 0; b < VECTOR_BATCHES; b++)
+      {
+        random_extents(extents, data, &seed);
+        for (int i = 0; write && i < VECTOR_EXTENTS; i++)
+        {
+          for (uint32_t j = 0; j < extents[i].len; j++)
+            data[i * 128 + j] = rand_r(&seed);
+        }
+
+        uint64_t ops = jbod_client_ops();
+        double t = now();
+        if (vectored)
+        {
+          int rc = write ? mdadm_writev(extents, VECTOR_EXTENTS, status) : mdadm_readv(extents, VECTOR_EXTENTS, status);
+          if (rc != 1)
+            errx(1, "vectored batch %d failed", b);
+        }
+        else
+        {
+          for (int i = 0; i < VECTOR_EXTENTS; i++)
+          {
+            int rc = write ? mdadm_write(extents[i].addr, extents[i].len, extents[i].buf)
+                           : mdadm_read(extents[i].addr, extents[i].len, extents[i].buf);
+            if (rc != (int)extents[i].len)
+              errx(1, "extent %d of batch %d failed", i, b);
+          }
+        }
+        elapsed += now() - t;
+        requests += jbod_client_ops() - ops;
+
+        // Later extents win where writes overlap; reads must match
+        for (int i = 0; i < VECTOR_EXTENTS; i++)
+        {
+          if (write)
+            memcpy(shadow + extents[i].addr, extents[i].buf, extents[i].len);
+          else if (memcmp(shadow + extents[i].addr, extents[i].buf, extents[i].len) != 0)
+            errx(1, "extent %d of batch %d read back wrong", i, b);
+        }
+      }
+      printf("%-8s %-9s %12.1f %12.1f\n", write ? "write" : "read", vectored ? "vectored" : "one each",
+             elapsed / VECTOR_BATCHES * 1e6, (double)requests / VECTOR_BATCHES);
+    }
+  }
+
+  for (uint64_t addr = 0; addr < VECTOR_SPAN; addr += 1024)
+  {
+    if (mdadm_read(addr, 1024, check + addr) != 1024)
+      errx(1, "read at %lu failed", (unsigned long)addr);
+  }
+  if (memcmp(check, shadow, VECTOR_SPAN) != 0)
+    errx(1, "the array does not hold what was written");
+
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  jbod_disconnect();
+  return 0;
+}
+
+#define COHERENCE_THREADS 4
+#define COHERENCE_BLOCKS 32
+#define COHERENCE_OPS 4000
+
+/* Shared by the clients of the coherence benchmark: the last version of each
+ * block whose write completed */
+static uint32_t completed[COHERENCE_BLOCKS];
+
+typedef struct {
+  int id;
+  bool cached;
+  uint64_t reads, hits, stale;
+} coherence_client_t;
+
+/* A client with its own connection and private cache: reads random blocks,
+ * and one time in ten writes one of the blocks it owns instead, with the
+ * block's next version stamped in its first bytes. A read is stale if it
+ * returns a version older than one whose write had completed before the read
+ * began. */
+static void *coherence_client(void *arg)
+{
+  coherence_client_t *c = (coherence_client_t *)arg;
+  uint8_t buf[JBOD_BLOCK_SIZE];
+  unsigned int seed = c->id + 1;
+
+  if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
+    errx(1, "client %d cannot connect to the server", c->id);
+  cache_use_private(true);
+  if (c->cached && cache_create(2 * COHERENCE_BLOCKS) != 1)
+    errx(1, "cannot create the cache of client %d", c->id);
+
+  for (int i = 0; i < COHERENCE_OPS; i++)
+  {
+    int b = rand_r(&seed) % COHERENCE_BLOCKS;
+    uint32_t version;
+    if (rand_r(&seed) % 10 == 0)
+    {
+      // Each block has one writer, so its versions complete in order
+      b -= b % COHERENCE_THREADS - c->id;
+      version = completed[b] + 1;
+      memset(buf, 0, sizeof(buf));
+      memcpy(buf, &version, sizeof(version));
+      if (mdadm_write((uint64_t)b * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE)
+        errx(1, "write of block %d failed", b);
+      __atomic_store_n(&completed[b], version, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    uint32_t before = __atomic_load_n(&completed[b], __ATOMIC_ACQUIRE);
+    uint64_t ops = jbod_client_ops();
+    if (mdadm_read((uint64_t)b * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE)
+      errx(1, "read of block %d failed", b);
+    memcpy(&version, buf, sizeof(version));
+    c->reads++;
+    c->hits += jbod_client_ops() == ops;
+    c->stale += version < before;
+  }
+
+  cache_destroy();
+  cache_use_private(false);
+  jbod_disconnect();
+  return NULL;
+}
+
+/* Runs COHERENCE_THREADS clients over the same COHERENCE_BLOCKS blocks,
+ * caching without and with leases, then uncached, and reports their stale reads, cache hit rate and
+ * throughput */
+static int bench_coherence(void)
+{
+  uint8_t buf[JBOD_BLOCK_SIZE];
+
+  if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
+    errx(1, "cannot connect to the server");
+  if (mdadm_mount() != 1 || mdadm_write_permission() != 0)
+    errx(1, "cannot mount the array");
+
+  static const char *modes[] = {"cached", "leased", "uncached"};
+  printf("%-8s %10s %10s %10s %10s\n", "cache", "reads", "stale", "hit %", "ops/s");
+  for (int mode = 0; mode < 3; mode++)
+  {
+    // Every block starts at version 0
+    memset(buf, 0, sizeof(buf));
+    for (int b = 0; b < COHERENCE_BLOCKS; b++)
+    {
+      if (mdadm_write((uint64_t)b * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE)
+        errx(1, "write of block %d failed", b);
+      completed[b] = 0;
+    }
+
+    mdadm_set_leases(mode == 1);
+    coherence_client_t clients[COHERENCE_THREADS];
+    pthread_t tids[COHERENCE_THREADS];
+    double t = now();
+    for (int i = 0; i < COHERENCE_THREADS; i++)
+    {
+      clients[i] = (coherence_client_t){.id = i, .cached = mode < 2};
+      if (pthread_create(&tids[i], NULL, coherence_client, &clients[i]) != 0)
+        errx(1, "cannot start client %d", i);
+    }
+
+    coherence_client_t total = {0};
+    for (int i = 0; i < COHERENCE_THREADS; i++)
+    {
+      pthread_join(tids[i], NULL);
+      total.reads += clients[i].reads;
+      total.hits += clients[i].hits;
+      total.stale += clients[i].stale;
+    }
+    double elapsed = now() - t;
+    mdadm_set_leases(false);
+
+    printf("%-8s %10lu %10lu %10.1f %10.0f\n", modes[mode], (unsigned long)total.reads,
+           (unsigned long)total.stale, 100.0 * total.hits / total.reads,
+           COHERENCE_THREADS * COHERENCE_OPS / elapsed);
+  }
+
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  jbod_disconnect();
+  return 0;
+}
+
+#define SNAPSHOT_WRITES 512
+
+/* Fills |buf| with the contents block |block| has in round |round| */
+static void snapshot_pattern(uint8_t *buf, uint64_t block, int round)
+{
+  for (int i = 0; i < JBOD_BLOCK_SIZE; i++)
+    buf[i] = block * 31 + i + round * 101;
+}
+
+/* Checks blocks [0, |count|) read through snapshot |snap|, or the live array
+ * for -1, against the contents of |round|, or of |new_round| for the first
+ * |rewritten| blocks */
+static void snapshot_check(int snap, uint64_t count, uint64_t rewritten, int round, int new_round)
+{
+  uint8_t buf[JBOD_BLOCK_SIZE], want[JBOD_BLOCK_SIZE];
+  for (uint64_t b = 0; b < count; b++)
+  {
+    int rc = snap < 0 ? mdadm_read(b * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, buf)
+                      : mdadm_snapshot_read(snap, b * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, buf);
+    snapshot_pattern(want, b, b < rewritten ? new_round : round);
+    if (rc != JBOD_BLOCK_SIZE || memcmp(buf, want, JBOD_BLOCK_SIZE) != 0)
+      errx(1, "block %lu of the %s reads back wrong", (unsigned long)b, snap < 0 ? "array" : "snapshot");
+  }
+}
+
+/* Times |count| block writes starting at block 0 with the contents of
+ * |round|, and prints them with the server requests they took */
+static void snapshot_writes(const char *name, uint64_t count, int round)
+{
+  uint8_t buf[JBOD_BLOCK_SIZE];
+  uint64_t ops = jbod_client_ops();
+  double t = now();
+  for (uint64_t b = 0; b < count; b++)
+  {
+    snapshot_pattern(buf, b, round);
+    if (mdadm_write(b * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE)
+      errx(1, "write to block %lu failed", (unsigned long)b);
+  }
+  printf("%-26s %12.1f %12.2f\n", name, (now() - t) / count * 1e6, (double)(jbod_client_ops() - ops) / count);
+}
+
+/* Takes a snapshot of a full array with a quarter of it reserved, against
+ * reading the whole array, which any copy of its data costs at least. Then
+ * rewrites blocks shared with the snapshot and rewrites them again, once
+ * they are the live array's own, and checks both views. */
+static int bench_snapshot(void)
+{
+  const mdadm_geometry_t *geo = mdadm_get_geometry();
+  uint64_t total = geo->capacity / JBOD_BLOCK_SIZE;
+  uint8_t buf[JBOD_BLOCK_SIZE];
+
+  if (mdadm_set_snapshot_reserve(total / 4) != 1)
+    errx(1, "cannot reserve blocks for snapshots");
+  uint64_t count = geo->capacity / JBOD_BLOCK_SIZE;
+  uint64_t rewritten = count < SNAPSHOT_WRITES ? count : SNAPSHOT_WRITES;
+
+  if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
+    errx(1, "cannot connect to the server");
+  if (mdadm_mount() != 1 || mdadm_write_permission() != 0)
+    errx(1, "cannot mount the array");
+  for (uint64_t b = 0; b < count; b++)
+  {
+    snapshot_pattern(buf, b, 0);
+    if (mdadm_write(b * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE)
+      errx(1, "write to block %lu failed", (unsigned long)b);
+  }
+
+  printf("%-26s %12s %12s\n", "op", "us", "req/block");
+
+  uint64_t ops = jbod_client_ops();
+  double t = now();
+  int snap = mdadm_snapshot_create();
+  if (snap < 0)
+    errx(1, "cannot take a snapshot");
+  printf("%-26s %12.1f %12.2f\n", "snapshot", (now() - t) * 1e6, (double)(jbod_client_ops() - ops) / count);
+
+  ops = jbod_client_ops();
+  t = now();
+  for (uint64_t b = 0; b < count; b++)
+  {
+    if (mdadm_read(b * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE)
+      errx(1, "read of block %lu failed", (unsigned long)b);
+  }
+  printf("%-26s %12.1f %12.2f\n", "read the array", (now() - t) * 1e6, (double)(jbod_client_ops() - ops) / count);
+
+  printf("\n%-26s %12s %12s\n", "write", "us/block", "req/block");
+  snapshot_writes("shared, copied on write", rewritten, 1);
+  snapshot_writes("own blocks", rewritten, 2);
+
+  snapshot_check(snap, count, 0, 0, 0);
+  snapshot_check(-1, count, rewritten, 0, 2);
+  mdadm_print_snapshot_stats();
+
+  // Unmounting moves the rewritten blocks home
+  mdadm_snapshot_delete(snap);
+  t = now();
+  if (mdadm_unmount() != 1)
+    errx(1, "cannot unmount the array");
+  printf("\n%-26s %12.1f\n", "unmount, moving home", (now() - t) * 1e6);
+
+  mdadm_revoke_write_permission();
+  jbod_disconnect();
+  return 0;
+}
+
+/* Times signing every block one request at a time, as the tester's SIGNALL
+ * does, against mdadm_verify: first with every block to sign, then after
+ * writes to a few blocks. Each incremental root must match the root of a
+ * tree signed from scratch. */
+static int bench_merkle(void)
+{
+  static const int writes[] = {0, 1, 16, 256};
+  const mdadm_geometry_t *geo = mdadm_get_geometry();
+  uint64_t num_blocks = (uint64_t)geo->num_disks * geo->blocks_per_disk;
+  uint8_t buf[JBOD_BLOCK_SIZE], root[MERKLE_DIGEST_LEN], full[MERKLE_DIGEST_LEN];
+  unsigned int seed = 42;
+
+  if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
+    errx(1, "cannot connect to the server");
+  if (mdadm_mount() != 1 || mdadm_write_permission() != 0)
+    errx(1, "cannot mount the array");
+
+  printf("%-22s %8s %10s %10s\n", "verify", "written", "ms", "requests");
+
+  uint64_t ops = jbod_client_ops();
+  double t = now();
+  for (uint32_t d = 0; d < geo->num_disks; d++)
+  {
+    for (uint32_t b = 0; b < geo->blocks_per_disk; b++)
+    {
+      if (jbod_client_operation(jbod_encode_op(JBOD_SIGN_BLOCK, d, b), buf) != 0)
+        errx(1, "cannot sign block %u of disk %u", b, d);
+    }
+  }
+  printf("%-22s %8s %10.2f %10lu\n", "every block, 1 by 1", "-", (now() - t) * 1e3,
+         (unsigned long)(jbod_client_ops() - ops));
+
+  for (int i = 0; i < (int)(sizeof(writes) / sizeof(writes[0])); i++)
+  {
+    for (int w = 0; w < writes[i]; w++)
+    {
+      for (int j = 0; j < JBOD_BLOCK_SIZE; j++)
+        buf[j] = rand_r(&seed);
+      uint64_t addr = rand_r(&seed) % (geo->capacity / JBOD_BLOCK_SIZE) * JBOD_BLOCK_SIZE;
+      if (mdadm_write(addr, JBOD_BLOCK_SIZE, buf) != JBOD_BLOCK_SIZE)
+        errx(1, "write at %lu failed", (unsigned long)addr);
+    }
+
+    ops = jbod_client_ops();
+    t = now();
+    int n = mdadm_verify(root);
+    if (n < 0)
+      errx(1, "verify failed");
+    printf("%-22s %8d %10.2f %10lu\n", i == 0 ? "mdadm_verify, first" : "mdadm_verify", writes[i],
+           (now() - t) * 1e3, (unsigned long)(jbod_client_ops() - ops));
+
+    // The stored root must be the one of the array as it is now
+    merkle_mark_all_dirty();
+    if (mdadm_verify(full) != (int)num_blocks || memcmp(root, full, MERKLE_DIGEST_LEN) != 0)
+      errx(1, "the incremental root does not match a full one");
+  }
+  merkle_print_stats();
+
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  jbod_disconnect();
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int ch;
+
+  while ((ch = getopt(argc, argv, BENCH_ARGUMENTS)) != -1)
+  {
+    switch (ch)
+    {
+    case 'h':
+      fprintf(stderr, USAGE);
+      return 0;
+    case 'g': {
+      uint32_t disks, blocks;
+      if (sscanf(optarg, "%u:%u", &disks, &blocks) != 2 || mdadm_set_geometry(disks, blocks) != 1)
+        errx(1, "invalid geometry [%s]", optarg);
+      break;
+    }
+    case 'u':
+      stripe_blocks = atoi(optarg);
+      break;
+    case 'W':
+      window = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, USAGE);
+      return -1;
+    }
+  }
+
+  if (optind >= argc)
+  {
+    fprintf(stderr, USAGE);
+    return -1;
+  }
+
+  if (window < JBOD_BLOCK_SIZE)
+    errx(1, "window must be at least one block");
+
+  if (strcmp(argv[optind], "layout") == 0)
+    return bench_layout();
+  if (strcmp(argv[optind], "cache") == 0)
+    return bench_cache();
+  if (strcmp(argv[optind], "log") == 0)
+    return bench_log();
+  if (strcmp(argv[optind], "dump") == 0)
+    return bench_dump();
+  if (strcmp(argv[optind], "vector") == 0)
+    return bench_vector();
+  if (strcmp(argv[optind], "coherence") == 0)
+    return bench_coherence();
+  if (strcmp(argv[optind], "snapshot") == 0)
+    return bench_snapshot();
+  if (strcmp(argv[optind], "merkle") == 0)
+    return bench_merkle();
+
+  fprintf(stderr, "Unknown mode [%s], aborting.\n", argv[optind]);
+  return -1;
+}
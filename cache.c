@@ -2,19 +2,1030 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#if !defined(CACHE_NO_SIMD) && defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CACHE_X86_SIMD
+#endif
 
 #include "cache.h"
 #include "jbod.h"
+#include "mdadm.h"
+#include "net.h"
+#include "trace.h"
+
+// Tags are scanned in groups of up to this many, so the tag array is padded
+// to a multiple of it with invalid tags
+#define TAG_GROUP 8
+
+// The block store is reserved in huge pages of this size, and committed in
+// steps of ARENA_COMMIT_STEP when it is made of normal pages
+#define HUGE_PAGE_SIZE (2u << 20)
+#define ARENA_COMMIT_STEP (64u << 10)
+
+// TinyLFU admission filter: a count-min sketch of SKETCH_DEPTH rows of
+// SKETCH_WIDTH saturating counters estimates how often each block was looked
+// up, behind a doorkeeper Bloom filter that absorbs the first lookup of a
+// block. Every SKETCH_SAMPLE lookups per cache entry, the counters are halved
+// and the doorkeeper cleared, so old popularity fades.
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 8192
+#define SKETCH_MAX 15
+#define SKETCH_SAMPLE 10
+#define DOORKEEPER_BITS 65536
+
+// Missed blocks first go into a window of 1 in WINDOW_RATIO entries, where
+// they can be reused right away; the filter decides when they leave it
+#define WINDOW_RATIO 100
+#define MAX_ENTRIES (CACHE_MAX_BLOCKS * CACHE_DEDUP_ENTRIES_PER_BLOCK)
+#define MAX_WINDOW (MAX_ENTRIES / WINDOW_RATIO)
+
+typedef struct {
+  uint8_t counters[SKETCH_DEPTH][SKETCH_WIDTH];
+  uint64_t doorkeeper[DOORKEEPER_BITS / 64];
+  int samples; // lookups recorded since the last aging, halved by it
+
+  // The window's entries, oldest first, in a ring
+  bool in_window[MAX_ENTRIES];
+  int window[MAX_WINDOW];
+  int window_head;
+  int window_len;
+} admission_t;
+
+// The state of one cache. Threads share the process-wide cache unless they
+// ask for a private one (see cache_use_private).
+typedef struct {
+  uint32_t *tags;   // packed (valid, disk, block) of each entry
+  int *clocks;      // recency of each entry, -1 if invalid
+  int *entry_block; // index of the buffer holding each entry's data
+  int cache_size;
+  int clock;
+  int num_queries;
+  int num_hits;
+
+  // Data buffers the entries point into, with a free list and a hash index
+  cache_block_t *blocks;
+  uint8_t (*block_data)[JBOD_BLOCK_SIZE];
+  int num_blocks;     // budget: buffers the entries may hold at once
+  int free_block;     // head of the free list, chained through next
+  int *hash_buckets;  // CACHE_MAX_BLOCKS of them, used in dedup mode
+
+  bool dedup;
+  int num_valid;       // valid entries, kept for the dedup ratio
+  int num_used_blocks; // buffers referenced by at least one entry
+
+  // The block store: an arena with room for CACHE_MAX_BLOCKS buffers. Buffers
+  // past |arena_slots| have never been used and are not on the free list.
+  uint8_t *arena;
+  size_t arena_len;       // bytes reserved, 0 if the arena is in the backing file
+  size_t arena_committed; // bytes readable and writable
+  bool arena_huge;        // made of explicit huge pages
+  int arena_slots;
+
+  // Everything else lives in one region: a header, the buffers' bookkeeping,
+  // the hash buckets and the entry arrays. It is heap memory, or a shared
+  // mapping of the backing file, which then holds the block store as well.
+  cache_file_header_t *header;
+  size_t region_len;
+  bool region_mapped;
+  const char *path; // backing file, or NULL
+  bool reattached;
+
+  bool admission;
+  admission_t *sketch; // admission filter state, while the cache exists
+  int num_admitted;
+  int num_rejected;
+
+  // In lease mode, when each entry's read lease runs out (CLOCK_MONOTONIC
+  // ns, 0 for none); an entry past it is dropped by its next lookup
+  bool leases;
+  uint64_t *lease_expiry;
+  int num_expired;
+  int num_invalidated;
+
+  pthread_mutex_t lock; // shared cache in locking mode only
+} cache_t;
+
+static const int hash_mask = CACHE_MAX_BLOCKS - 1;
+
+// Settings for the next cache_create
+static bool dedup_next = false;
+static bool admission_next = false;
+static bool leases_next = false;
+static const char *backing_path = NULL;
+static uint64_t backing_generation = 0;
+
+static cache_t shared_cache = {.free_block = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+static _Thread_local cache_t *private_cache = NULL;
+static bool locking = false;
+
+/* The cache the calling thread works on */
+static cache_t *this_cache(void)
+{
+  return private_cache != NULL ? private_cache : &shared_cache;
+}
+
+void cache_use_private(bool enable)
+{
+  if (enable && private_cache == NULL)
+  {
+    private_cache = calloc(1, sizeof(cache_t));
+    private_cache->free_block = -1;
+  }
+  else if (!enable && private_cache != NULL)
+  {
+    free(private_cache);
+    private_cache = NULL;
+  }
+}
+
+bool cache_is_private(void)
+{
+  return private_cache != NULL;
+}
+
+void cache_set_locking(bool enable)
+{
+  locking = enable;
+}
+
+void cache_set_dedup(bool enable)
+{
+  dedup_next = enable;
+}
+
+void cache_set_admission(bool enable)
+{
+  admission_next = enable;
+}
+
+void cache_set_leases(bool enable)
+{
+  leases_next = enable;
+}
+
+void cache_set_backing_file(const char *path, uint64_t generation)
+{
+  backing_path = path;
+  backing_generation = generation;
+}
+
+void cache_set_generation(uint64_t generation)
+{
+  backing_generation = generation;
+}
+
+bool cache_reattached(void)
+{
+  return this_cache()->reattached;
+}
+
+/* Index of the first entry whose tag is |tag|, or -1. Scalar version. */
+static int find_tag_scalar(const cache_t *c, uint32_t tag)
+{
+  for (int i = 0; i < c->cache_size; i++)
+  {
+    if (c->tags[i] == tag)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+#ifdef CACHE_X86_SIMD
+/* SSE2 version: compares four tags per instruction */
+static int find_tag_sse2(const cache_t *c, uint32_t tag)
+{
+  __m128i key = _mm_set1_epi32(tag);
+  for (int i = 0; i < c->cache_size; i += 4)
+  {
+    __m128i group = _mm_load_si128((const __m128i *)(c->tags + i));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(group, key)));
+    if (mask != 0)
+    {
+      // A match in the padding past the last entry is no match
+      int j = i + __builtin_ctz(mask);
+      return j < c->cache_size ? j : -1;
+    }
+  }
+  return -1;
+}
+
+/* AVX2 version: compares eight tags per instruction. It is compiled for
+ * AVX2 on its own and only used if the CPU has it. */
+__attribute__((target("avx2"))) static int find_tag_avx2(const cache_t *c, uint32_t tag)
+{
+  __m256i key = _mm256_set1_epi32(tag);
+  for (int i = 0; i < c->cache_size; i += 8)
+  {
+    __m256i group = _mm256_load_si256((const __m256i *)(c->tags + i));
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(group, key)));
+    if (mask != 0)
+    {
+      int j = i + __builtin_ctz(mask);
+      return j < c->cache_size ? j : -1;
+    }
+  }
+  return -1;
+}
+#endif
+
+static int (*find_tag)(const cache_t *c, uint32_t tag) = NULL;
+static const char *find_tag_name = "scalar";
+
+/* Picks the widest tag matcher the CPU supports */
+static void choose_find_tag(void)
+{
+  find_tag = find_tag_scalar;
+  find_tag_name = "scalar";
+#ifdef CACHE_X86_SIMD
+  find_tag = find_tag_sse2;
+  find_tag_name = "sse2";
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    find_tag = find_tag_avx2;
+    find_tag_name = "avx2";
+  }
+#endif
+}
+
+const char *cache_tag_match(void)
+{
+  if (find_tag == NULL)
+  {
+    choose_find_tag();
+  }
+  return find_tag_name;
+}
+
+/* Sets |*tag| to the tag of |disk_num| and |block_num|. Returns false if they
+ * do not fit in a tag, and so can never be cached. */
+static bool make_tag(int disk_num, int block_num, uint32_t *tag)
+{
+  if (disk_num < 0 || disk_num >= JBOD_OP_MAX_DISKS || block_num < 0 || block_num >= JBOD_OP_MAX_BLOCKS)
+  {
+    return false;
+  }
+  *tag = CACHE_TAG(disk_num, block_num);
+  return true;
+}
+
+/* Rounds |n| up to a multiple of |align|, a power of two */
+static size_t align_up(size_t n, size_t align)
+{
+  return (n + align - 1) & ~(align - 1);
+}
+
+/* Reserves address space for the block store without committing memory.
+ * Explicit huge pages are used if the system has some set aside; otherwise
+ * the arena is aligned to a huge page so transparent huge pages can back it.
+ * Returns 1 on success and -1 on failure. */
+static int arena_reserve(cache_t *c)
+{
+  size_t len = align_up((size_t)CACHE_MAX_BLOCKS * JBOD_BLOCK_SIZE, HUGE_PAGE_SIZE);
+
+  // Without MAP_NORESERVE this fails up front when no huge pages are free
+  void *p = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  c->arena_huge = p != MAP_FAILED;
+
+  if (!c->arena_huge)
+  {
+    // Reserve twice the size and keep the huge page aligned part
+    uint8_t *raw = mmap(NULL, 2 * len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED)
+    {
+      return -1;
+    }
+    uint8_t *aligned = (uint8_t *)align_up((uintptr_t)raw, HUGE_PAGE_SIZE);
+    if (aligned > raw)
+    {
+      munmap(raw, aligned - raw);
+    }
+    munmap(aligned + len, raw + 2 * len - (aligned + len));
+    madvise(aligned, len, MADV_HUGEPAGE);
+    p = aligned;
+  }
+
+  c->arena = p;
+  c->arena_len = len;
+  c->arena_committed = 0;
+  return 1;
+}
+
+/* Makes the first |slots| buffers of the block store usable. Returns true
+ * on success and false if the memory cannot be committed. */
+static bool arena_commit(cache_t *c, int slots)
+{
+  size_t need = (size_t)slots * JBOD_BLOCK_SIZE;
+  if (need <= c->arena_committed)
+  {
+    return true;
+  }
+
+  need = align_up(need, c->arena_huge ? HUGE_PAGE_SIZE : ARENA_COMMIT_STEP);
+  need = need < c->arena_len ? need : c->arena_len;
+  if (mprotect(c->arena, need, PROT_READ | PROT_WRITE) != 0)
+  {
+    return false;
+  }
+  c->arena_committed = need;
+  return true;
+}
+
+/* FNV-1a hash of a block's contents */
+static uint32_t block_hash(const uint8_t *buf)
+{
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < JBOD_BLOCK_SIZE; i++)
+  {
+    h ^= buf[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* Unlinks buffer |b| from its hash bucket */
+static void unhash_block(cache_t *c, int b)
+{
+  int *link = &c->hash_buckets[c->blocks[b].hash & hash_mask];
+  while (*link != b)
+  {
+    link = &c->blocks[*link].next;
+  }
+  *link = c->blocks[b].next;
+}
+
+/* Drops a reference to the buffer of entry |i| and marks the entry invalid */
+static void release_entry(cache_t *c, int i)
+{
+  int b = c->entry_block[i];
+  c->num_valid--;
+  c->tags[i] = 0;
+  c->clocks[i] = -1;
+  c->entry_block[i] = -1;
+
+  if (--c->blocks[b].refs == 0)
+  {
+    // Last user gone: return the buffer to the free list
+    if (c->dedup)
+    {
+      unhash_block(c, b);
+    }
+    c->blocks[b].next = c->free_block;
+    c->free_block = b;
+    c->num_used_blocks--;
+  }
+}
+
+/* Index of the entry to evict: the Most Recently Used (MRU) valid entry.
+ * Invalid entries have a clock of -1, so only the clocks are scanned. */
+static int victim_entry(const cache_t *c)
+{
+  int mru_index = -1, mru_clock = -1;
+  const bool *in_window = c->sketch != NULL ? c->sketch->in_window : NULL;
+  for (int i = 0; i < c->cache_size; i++)
+  {
+    if (c->clocks[i] > mru_clock && (in_window == NULL || !in_window[i]))
+    {
+      mru_clock = c->clocks[i];
+      mru_index = i; // Index of the MRU entry
+    }
+  }
+  return mru_index;
+}
+
+/* Hash of a tag for sketch row or Bloom filter function |seed| */
+static uint32_t tag_hash(uint32_t tag, uint32_t seed)
+{
+  uint32_t h = tag ^ (seed * 0x9e3779b9u);
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return h;
+}
+
+/* The doorkeeper uses two hash functions, after the sketch rows' */
+static bool doorkeeper_test(const admission_t *a, uint32_t tag)
+{
+  for (uint32_t k = SKETCH_DEPTH; k < SKETCH_DEPTH + 2; k++)
+  {
+    uint32_t bit = tag_hash(tag, k) & (DOORKEEPER_BITS - 1);
+    if (!(a->doorkeeper[bit / 64] & (1ull << (bit % 64))))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void doorkeeper_set(admission_t *a, uint32_t tag)
+{
+  for (uint32_t k = SKETCH_DEPTH; k < SKETCH_DEPTH + 2; k++)
+  {
+    uint32_t bit = tag_hash(tag, k) & (DOORKEEPER_BITS - 1);
+    a->doorkeeper[bit / 64] |= 1ull << (bit % 64);
+  }
+}
+
+/* Estimated number of lookups of |tag| since it was last aged */
+static int estimate(const admission_t *a, uint32_t tag)
+{
+  int min = SKETCH_MAX;
+  for (uint32_t r = 0; r < SKETCH_DEPTH; r++)
+  {
+    int n = a->counters[r][tag_hash(tag, r) & (SKETCH_WIDTH - 1)];
+    min = n < min ? n : min;
+  }
+  return min + doorkeeper_test(a, tag);
+}
+
+/* Counts a lookup of |tag|. The first one only goes into the doorkeeper; the
+ * others raise the smallest of the tag's counters (conservative update). */
+static void record_access(cache_t *c, uint32_t tag)
+{
+  admission_t *a = c->sketch;
+  if (!doorkeeper_test(a, tag))
+  {
+    doorkeeper_set(a, tag);
+  }
+  else
+  {
+    int min = estimate(a, tag) - 1;
+    for (uint32_t r = 0; r < SKETCH_DEPTH && min < SKETCH_MAX; r++)
+    {
+      uint8_t *n = &a->counters[r][tag_hash(tag, r) & (SKETCH_WIDTH - 1)];
+      if (*n == min)
+      {
+        (*n)++;
+      }
+    }
+  }
+
+  if (++a->samples >= SKETCH_SAMPLE * c->cache_size)
+  {
+    for (uint32_t r = 0; r < SKETCH_DEPTH; r++)
+    {
+      for (int i = 0; i < SKETCH_WIDTH; i++)
+      {
+        a->counters[r][i] >>= 1;
+      }
+    }
+    memset(a->doorkeeper, 0, sizeof(a->doorkeeper));
+    a->samples /= 2;
+  }
+}
+
+static void window_push(admission_t *a, int i)
+{
+  a->window[(a->window_head + a->window_len++) % MAX_WINDOW] = i;
+  a->in_window[i] = true;
+}
+
+static int window_pop(admission_t *a)
+{
+  int i = a->window[a->window_head];
+  a->window_head = (a->window_head + 1) % MAX_WINDOW;
+  a->window_len--;
+  a->in_window[i] = false;
+  return i;
+}
+
+/* Empties the window, whose entries join the rest of the cache */
+static void window_clear(admission_t *a)
+{
+  while (a->window_len > 0)
+  {
+    window_pop(a);
+  }
+}
+
+/* Takes entry |i| out of the window, keeping the others in order */
+static void window_remove(admission_t *a, int i)
+{
+  int len = a->window_len;
+  a->window_len = 0;
+  for (int k = 0; k < len; k++)
+  {
+    int j = a->window[(a->window_head + k) % MAX_WINDOW];
+    if (j != i)
+    {
+      a->window[(a->window_head + a->window_len++) % MAX_WINDOW] = j;
+    }
+  }
+  a->in_window[i] = false;
+}
+
+/* Drops entry |i| before it would be evicted: its lease ran out or the
+ * block changed */
+static void drop_entry(cache_t *c, int i)
+{
+  if (c->sketch != NULL && c->sketch->in_window[i])
+  {
+    window_remove(c->sketch, i);
+  }
+  release_entry(c, i);
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Frees an entry for a missed block on a full cache with the admission
+ * filter, and puts it in the window. Once the window is full, the block
+ * that has been in it longest must leave: it is admitted to the rest of the
+ * cache, evicting the MRU entry there, only if it has been looked up more
+ * often than that entry; otherwise it is the one evicted. Returns the free
+ * entry. */
+static int admit_entry(cache_t *c)
+{
+  admission_t *a = c->sketch;
+  int window_size = c->cache_size / WINDOW_RATIO > 0 ? c->cache_size / WINDOW_RATIO : 1;
+  int slot;
+
+  // With every valid entry in the window there is no MRU entry outside it:
+  // the window's oldest block leaves instead
+  if (a->window_len < window_size && (slot = victim_entry(c)) == -1)
+  {
+    slot = window_pop(a);
+  }
+  else if (a->window_len >= window_size)
+  {
+    int candidate = window_pop(a);
+    int victim = victim_entry(c);
+    if (victim != -1 && estimate(a, c->tags[candidate]) > estimate(a, c->tags[victim]))
+    {
+      c->num_admitted++;
+      slot = victim;
+    }
+    else
+    {
+      c->num_rejected++;
+      slot = candidate;
+    }
+  }
+
+  release_entry(c, slot);
+  window_push(a, slot);
+  return slot;
+}
+
+/* Index of the entry to evict to free a buffer: the MRU entry outside the
+ * admission window, or else the oldest valid entry in the window, which it
+ * leaves. Returns -1 if no valid entry is left. */
+static int evict_entry(cache_t *c)
+{
+  int i = victim_entry(c);
+  if (i != -1 || c->sketch == NULL)
+  {
+    return i;
+  }
+
+  admission_t *a = c->sketch;
+  for (int k = 0; k < a->window_len; k++)
+  {
+    int j = a->window[(a->window_head + k) % MAX_WINDOW];
+    if (c->clocks[j] != -1)
+    {
+      window_remove(a, j);
+      return j;
+    }
+  }
+  return -1;
+}
+
+/* Takes a buffer from the free list, or a never used one from the arena,
+ * evicting entries while all the budget's buffers are in use. Returns its
+ * index, or -1 if the arena cannot grow or nothing is left to evict. */
+static int alloc_block(cache_t *c)
+{
+  while (c->num_used_blocks >= c->num_blocks)
+  {
+    int victim = evict_entry(c);
+    if (victim == -1)
+    {
+      return -1;
+    }
+    release_entry(c, victim);
+  }
+
+  int b = c->free_block;
+  if (b != -1)
+  {
+    c->free_block = c->blocks[b].next;
+  }
+  else
+  {
+    if (!arena_commit(c, c->arena_slots + 1))
+    {
+      return -1;
+    }
+    b = c->arena_slots++;
+  }
+
+  c->num_used_blocks++;
+  return b;
+}
+
+/* Points the unattached entry |i| at a buffer holding |buf|. In dedup mode
+ * an existing buffer with the same contents is shared. Returns true on
+ * success and false if no buffer could be allocated. */
+static bool attach_block(cache_t *c, int i, const uint8_t *buf)
+{
+  uint32_t h = 0;
+  if (c->dedup)
+  {
+    h = block_hash(buf);
+    for (int b = c->hash_buckets[h & hash_mask]; b != -1; b = c->blocks[b].next)
+    {
+      if (c->blocks[b].hash == h && memcmp(c->block_data[b], buf, JBOD_BLOCK_SIZE) == 0)
+      {
+        c->blocks[b].refs++;
+        c->entry_block[i] = b;
+        return true;
+      }
+    }
+  }
+
+  // Entry |i| is not valid yet, so it can never be chosen as the victim
+  int b = alloc_block(c);
+  if (b == -1)
+  {
+    return false;
+  }
+
+  c->blocks[b].refs = 1;
+  memcpy(c->block_data[b], buf, JBOD_BLOCK_SIZE);
+  if (c->dedup)
+  {
+    c->blocks[b].hash = h;
+    c->blocks[b].next = c->hash_buckets[h & hash_mask];
+    c->hash_buckets[h & hash_mask] = b;
+  }
+
+  c->entry_block[i] = b;
+  return true;
+}
+
+/* Rounds |n| up to a multiple of 64 bytes, the alignment of each array in
+ * the region */
+static size_t align64(size_t n)
+{
+  return align_up(n, 64);
+}
+
+/* Number of tag slots for |entries| entries, padded to whole groups */
+static int tag_slots(int entries)
+{
+  return (entries + TAG_GROUP - 1) / TAG_GROUP * TAG_GROUP;
+}
+
+/* Byte offsets of the parts of the region. Everything up to |tags| has a
+ * fixed size, so a resize only moves the entry arrays behind it. */
+typedef struct {
+  size_t blocks;
+  size_t buckets;
+  size_t data; // the block store, in a backing file only
+  size_t tags;
+  size_t clocks;
+  size_t entry_block;
+  size_t len;
+} region_layout_t;
+
+static void region_layout(const cache_t *c, int entries, region_layout_t *l)
+{
+  l->blocks = align64(sizeof(cache_file_header_t));
+  l->buckets = l->blocks + align64(CACHE_MAX_BLOCKS * sizeof(cache_block_t));
+  l->data = l->buckets + align64(CACHE_MAX_BLOCKS * sizeof(int));
+  l->tags = l->data + (c->path != NULL ? (size_t)CACHE_MAX_BLOCKS * JBOD_BLOCK_SIZE : 0);
+  l->clocks = l->tags + align64(tag_slots(entries) * sizeof(uint32_t));
+  l->entry_block = l->clocks + align64(entries * sizeof(int));
+  l->len = l->entry_block + align64(entries * sizeof(int));
+}
+
+/* Points the arrays into the region at |base| */
+static void region_attach(cache_t *c, uint8_t *base, const region_layout_t *l)
+{
+  c->header = (cache_file_header_t *)base;
+  c->region_len = l->len;
+  c->blocks = (cache_block_t *)(base + l->blocks);
+  c->hash_buckets = (int *)(base + l->buckets);
+  c->tags = (uint32_t *)(base + l->tags);
+  c->clocks = (int *)(base + l->clocks);
+  c->entry_block = (int *)(base + l->entry_block);
+
+  if (c->path != NULL)
+  {
+    // The block store is part of the file, and its pages appear as they are written
+    c->arena = base + l->data;
+    c->arena_len = 0;
+    c->arena_committed = (size_t)CACHE_MAX_BLOCKS * JBOD_BLOCK_SIZE;
+  }
+  c->block_data = (uint8_t(*)[JBOD_BLOCK_SIZE])c->arena;
+}
+
+/* Maps |len| bytes of the backing file, resizing the file to |len| bytes.
+ * Sets |*same_size| if it already had that size. Returns the mapping, or
+ * NULL on failure. */
+static uint8_t *map_backing_file(const cache_t *c, size_t len, bool *same_size)
+{
+  int fd = open(c->path, O_RDWR | O_CREAT, 0600);
+  if (fd == -1)
+  {
+    return NULL;
+  }
+
+  struct stat st;
+  *same_size = fstat(fd, &st) == 0 && (size_t)st.st_size == len;
+  if (!*same_size && ftruncate(fd, len) != 0)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  uint8_t *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return base == MAP_FAILED ? NULL : base;
+}
+
+/* Returns true if the freshly mapped region holds a cache that was closed
+ * cleanly with the same shape, geometry and server generation, and whose
+ * entries and free list all point inside it */
+static bool region_reusable(cache_t *c, int entries, int num_entries)
+{
+  const mdadm_geometry_t *geo = mdadm_get_geometry();
+
+  if (c->header->magic != CACHE_FILE_MAGIC || c->header->version != CACHE_FILE_VERSION || c->header->clean != 1 ||
+      c->header->num_disks != geo->num_disks || c->header->blocks_per_disk != geo->blocks_per_disk ||
+      c->header->layout != geo->layout || c->header->stripe_blocks != geo->stripe_blocks ||
+      c->header->cache_size != entries || c->header->num_blocks != num_entries || c->header->dedup != c->dedup ||
+      backing_generation == 0 || c->header->generation != backing_generation)
+  {
+    return false;
+  }
+
+  int slots = c->header->arena_slots;
+  if (slots < 0 || slots > CACHE_MAX_BLOCKS)
+  {
+    return false;
+  }
+
+  // The free list must end within as many steps as there are buffers
+  int steps = 0;
+  for (int b = c->header->free_block; b != -1; b = c->blocks[b].next)
+  {
+    if (b < 0 || b >= slots || ++steps > slots)
+    {
+      return false;
+    }
+  }
 
-// Uncomment the below code before implementing cache functioncs.
-static cache_entry_t *cache = NULL;
-static int cache_size = 0;
-static int clock = 0;
-static int num_queries = 0;
-static int num_hits = 0;
+  for (int i = 0; i < tag_slots(entries); i++)
+  {
+    if (c->tags[i] == 0)
+    {
+      continue;
+    }
 
-int cache_create(int num_entries)
+    // Padding tags must stay invalid, and valid ones must fit the geometry
+    uint32_t disk = (c->tags[i] >> 16) & 0x7fff, block = c->tags[i] & 0xffff;
+    if (i >= entries || !(c->tags[i] & CACHE_TAG_VALID) || disk >= geo->num_disks || block >= geo->blocks_per_disk ||
+        c->entry_block[i] < 0 || c->entry_block[i] >= slots || c->clocks[i] < 0)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Marks every entry of the region invalid, including the padding tags */
+static void clear_entries(cache_t *c)
+{
+  memset(c->tags, 0, tag_slots(c->cache_size) * sizeof(uint32_t));
+  for (int i = 0; i < c->cache_size; i++)
+  {
+    c->clocks[i] = -1;
+    c->entry_block[i] = -1;
+  }
+}
+
+/* Allocates the region for |entries| entries, and the block store: heap
+ * memory and a reserved arena, or a mapping of the backing file. Sets
+ * |*reuse| if a backing file with valid contents was re-attached. Returns 1
+ * on success and -1 on failure. */
+static int region_open(cache_t *c, int entries, int num_entries, bool *reuse)
+{
+  region_layout_t l;
+  region_layout(c, entries, &l);
+  uint8_t *base;
+
+  *reuse = false;
+
+  if (c->path == NULL)
+  {
+    base = aligned_alloc(64, l.len);
+    if (base == NULL)
+    {
+      return -1;
+    }
+    memset(base, 0, l.len);
+    if (arena_reserve(c) == -1)
+    {
+      free(base);
+      return -1;
+    }
+    c->region_mapped = false;
+  }
+  else
+  {
+    base = map_backing_file(c, l.len, reuse);
+    if (base == NULL)
+    {
+      return -1;
+    }
+    c->region_mapped = true;
+  }
+
+  region_attach(c, base, &l);
+  *reuse = *reuse && region_reusable(c, entries, num_entries);
+  return 1;
+}
+
+/* Gives the region room for |entries| entries, keeping the fixed part and
+ * the block store. The entry arrays come back all invalid. Returns 1 on
+ * success and -1 on failure, in which case the old region is kept. */
+static int region_reshape(cache_t *c, int entries)
+{
+  region_layout_t l;
+  region_layout(c, entries, &l);
+  uint8_t *base;
+
+  if (!c->region_mapped)
+  {
+    base = aligned_alloc(64, l.len);
+    if (base == NULL)
+    {
+      return -1;
+    }
+    memcpy(base, c->header, l.tags);
+    free(c->header);
+  }
+  else
+  {
+    bool same_size;
+    munmap(c->header, c->region_len);
+    base = map_backing_file(c, l.len, &same_size);
+    if (base == NULL)
+    {
+      // The file keeps its contents, but is not marked clean: start cold next time
+      c->header = NULL;
+      return -1;
+    }
+  }
+
+  region_attach(c, base, &l);
+  c->cache_size = entries;
+  clear_entries(c);
+  return 1;
+}
+
+/* Writes the policy state to the header and flushes a mapped region */
+static void region_sync(cache_t *c, bool clean)
+{
+  c->header->cache_size = c->cache_size;
+  c->header->num_blocks = c->num_blocks;
+  c->header->clock = c->clock;
+  c->header->free_block = c->free_block;
+  c->header->num_valid = c->num_valid;
+  c->header->num_used_blocks = c->num_used_blocks;
+  c->header->arena_slots = c->arena_slots;
+  c->header->generation = backing_generation;
+  c->header->clean = clean;
+
+  if (c->region_mapped)
+  {
+    msync(c->header, c->region_len, MS_SYNC);
+  }
+}
+
+static void cache_free(cache_t *c)
+{
+  // A mapped cache is left behind clean, for the next run to re-attach
+  if (c->header != NULL)
+  {
+    region_sync(c, true);
+
+    if (c->region_mapped)
+    {
+      munmap(c->header, c->region_len);
+    }
+    else
+    {
+      free(c->header);
+    }
+  }
+
+  if (c->arena_len > 0)
+  {
+    munmap(c->arena, c->arena_len);
+  }
+
+  c->header = NULL;
+  c->tags = NULL;
+  c->clocks = NULL;
+  c->entry_block = NULL;
+  c->blocks = NULL;
+  c->block_data = NULL;
+  c->hash_buckets = NULL;
+  c->arena = NULL;
+  c->arena_len = 0;
+  c->arena_committed = 0;
+  c->cache_size = 0;
+  c->num_blocks = 0;
+
+  free(c->sketch);
+  c->sketch = NULL;
+  free(c->lease_expiry);
+  c->lease_expiry = NULL;
+}
+
+/* Allocates entries and buffers for a cache with a budget of |num_entries|
+ * data blocks, re-attaching the backing file's contents when they are still
+ * valid. Returns 1 on success and -1 on failure. */
+static int cache_alloc(cache_t *c, int num_entries)
+{
+  int entries = c->dedup ? num_entries * CACHE_DEDUP_ENTRIES_PER_BLOCK : num_entries;
+
+  if (find_tag == NULL)
+  {
+    choose_find_tag();
+  }
+
+  // Allocate space for the entries and their buffers
+  bool reuse;
+  if (region_open(c, entries, num_entries, &reuse) == -1)
+  {
+    cache_free(c);
+    return -1;
+  }
+
+  c->cache_size = entries;
+  c->num_blocks = num_entries;
+  c->reattached = reuse;
+
+  if (reuse)
+  {
+    // Pick up where the previous run left off
+    c->clock = c->header->clock;
+    c->free_block = c->header->free_block;
+    c->num_valid = c->header->num_valid;
+    c->num_used_blocks = c->header->num_used_blocks;
+    c->arena_slots = c->header->arena_slots;
+    region_sync(c, false); // not clean again until cache_destroy
+    return 1;
+  }
+
+  const mdadm_geometry_t *geo = mdadm_get_geometry();
+  c->header->magic = CACHE_FILE_MAGIC;
+  c->header->version = CACHE_FILE_VERSION;
+  c->header->num_disks = geo->num_disks;
+  c->header->blocks_per_disk = geo->blocks_per_disk;
+  c->header->layout = geo->layout;
+  c->header->stripe_blocks = geo->stripe_blocks;
+  c->header->dedup = c->dedup;
+
+  // The region may hold garbage from a discarded file, so initialize the values
+  clear_entries(c);
+  for (int b = 0; b < CACHE_MAX_BLOCKS; b++)
+  {
+    c->blocks[b].refs = 0;
+    c->blocks[b].next = -1;
+    c->hash_buckets[b] = -1;
+  }
+  c->free_block = -1;
+  c->arena_slots = 0;
+  c->num_valid = 0;
+  c->num_used_blocks = 0;
+
+  region_sync(c, false);
+  return 1;
+}
+
+static int create(cache_t *c, int num_entries)
 {
   // num_enteries minimum at 2
   if (num_entries < 2)
@@ -23,60 +1034,63 @@ int cache_create(int num_entries)
   }
 
   // num_enteries maximum at 4096
-  if (num_entries > 4096)
+  if (num_entries > CACHE_MAX_BLOCKS)
   {
 
     return -1;
   }
 
   // Cache can never be NULL
-  if (cache != NULL)
+  if (c->tags != NULL)
   {
     return -1;
   }
 
-  // Dynamically allocate space for num_entries cache entries
-  cache = (cache_entry_t *)malloc(num_entries * sizeof(cache_entry_t));
-
-  if (cache == NULL)
+  c->dedup = dedup_next;
+  c->path = c == &shared_cache ? backing_path : NULL; // private caches are memory only
+  // The sketch is not kept in the backing file; a re-attached cache relearns it
+  c->admission = admission_next;
+  if (c->admission && (c->sketch = calloc(1, sizeof(admission_t))) == NULL)
   {
     return -1;
   }
-
-  cache_size = num_entries;
-
-  // All contents may contain garbage value as the memory is allocated with malloc
-  // Initializing the values
-  for (int i = 0; i < num_entries; i++)
+  // Leases are not kept in the backing file either: re-attached entries
+  // start without one, so they are fetched again before being trusted
+  c->leases = leases_next;
+  if (c->leases && (c->lease_expiry = calloc(MAX_ENTRIES, sizeof(uint64_t))) == NULL)
+  {
+    free(c->sketch);
+    c->sketch = NULL;
+    return -1;
+  }
+  c->clock = 0; // Reset the clock, unless re-attached contents carry it over
+  if (cache_alloc(c, num_entries) == -1)
   {
-    cache[i].valid = false;
-    cache[i].disk_num = -1;
-    cache[i].block_num = -1;
-    cache[i].clock_accesses = 0;
+    return -1;
   }
 
-  clock = 0; // Reset the clock
-  num_queries = 0;
-  num_hits = 0;
+  c->num_queries = 0;
+  c->num_hits = 0;
+  c->num_admitted = 0;
+  c->num_rejected = 0;
+  c->num_expired = 0;
+  c->num_invalidated = 0;
 
   return 1;
 }
 
-int cache_destroy(void)
+static int destroy(cache_t *c)
 {
-  if (cache == NULL)
+  if (c->tags == NULL)
   {
     return -1;
   }
 
-  free(cache); // Freeing up the dynamically allocated space
-
-  cache = NULL;
-  cache_size = 0;
+  cache_free(c); // Freeing up the dynamically allocated space
   return 1;
 }
 
-int cache_lookup(int disk_num, int block_num, uint8_t *buf)
+static int lookup(cache_t *c, int disk_num, int block_num, uint8_t *buf)
 {
   // buf can never be NULL
   if (buf == NULL)
@@ -84,176 +1098,431 @@ int cache_lookup(int disk_num, int block_num, uint8_t *buf)
     return -1;
   }
 
-  if (cache == NULL)
+  if (c->tags == NULL)
   {
     return -1;
   }
 
-  num_queries++; // Keep track of the lookup attempts
+  c->num_queries++; // Keep track of the lookup attempts
 
-  for (int i = 0; i < cache_size; i++)
+  uint32_t tag;
+  int i;
+  if (!make_tag(disk_num, block_num, &tag))
   {
-    if (cache[i].valid && cache[i].disk_num == disk_num && cache[i].block_num == block_num)
-    {
-      // Block found in the cache
-      memcpy(buf, cache[i].block, JBOD_BLOCK_SIZE);
-      num_hits++; // Keep track of the lookup successes
-      num_queries++;
-      clock++;
-      cache[i].clock_accesses = clock; // Entry was accessed recently
-      return 1;
-    }
+    return -1;
   }
-  return -1;
+  if (c->sketch != NULL)
+  {
+    record_access(c, tag);
+  }
+  if ((i = find_tag(c, tag)) == -1)
+  {
+    return -1;
+  }
+
+  // Without a live lease the copy may be stale: it is a miss
+  if (c->lease_expiry != NULL && c->lease_expiry[i] <= now_ns())
+  {
+    c->num_expired++;
+    drop_entry(c, i);
+    return -1;
+  }
+
+  // Block found in the cache
+  memcpy(buf, c->block_data[c->entry_block[i]], JBOD_BLOCK_SIZE);
+  c->num_hits++; // Keep track of the lookup successes
+  c->clock++;
+  c->clocks[i] = c->clock; // Entry was accessed recently
+  return 1;
 }
 
-void cache_update(int disk_num, int block_num, const uint8_t *buf)
+static void update(cache_t *c, int disk_num, int block_num, const uint8_t *buf)
 {
   if (buf == NULL)
   {
     return;
   }
 
-  if (cache == NULL)
+  if (c->tags == NULL)
   {
     return;
   }
 
-  for (int i = 0; i < cache_size; i++)
+  uint32_t tag;
+  int i;
+  if (!make_tag(disk_num, block_num, &tag) || (i = find_tag(c, tag)) == -1)
   {
+    return;
+  }
 
-    if (cache[i].valid && cache[i].disk_num == disk_num && cache[i].block_num == block_num)
+  // Entry exists in cache, so we update it. A shared buffer is never
+  // written in place: the entry lets go of it and gets its own copy.
+  if (!c->dedup)
+  {
+    memcpy(c->block_data[c->entry_block[i]], buf, JBOD_BLOCK_SIZE);
+  }
+  else
+  {
+    release_entry(c, i);
+    if (!attach_block(c, i, buf))
     {
-      // Entry exists in cache, so we update it
-      if (cache[i].disk_num == disk_num && cache[i].block_num == block_num)
-      {
-        memcpy(cache[i].block, buf, JBOD_BLOCK_SIZE);
-        clock++;
-        cache[i].clock_accesses = clock; // Entry was accessed recently
-        return;
-      }
+      return;
     }
+    c->tags[i] = tag;
+    c->num_valid++;
   }
+  c->clock++;
+  c->clocks[i] = c->clock; // Entry was accessed recently
 }
 
-int cache_insert(int disk_num, int block_num, const uint8_t *buf)
+static int insert(cache_t *c, int disk_num, int block_num, const uint8_t *buf)
 {
   if (buf == NULL)
   {
     return -1;
   }
 
-  if (cache == NULL)
+  if (c->tags == NULL)
   {
     return -1;
   }
 
-  // Validate the disk and block numbers
-  if (disk_num < 0 || disk_num >= JBOD_NUM_DISKS || block_num < 0 || block_num >= JBOD_NUM_BLOCKS_PER_DISK)
+  // Validate the disk and block numbers against the array's geometry
+  const mdadm_geometry_t *geo = mdadm_get_geometry();
+  if (disk_num < 0 || disk_num >= (int)geo->num_disks || block_num < 0 || block_num >= (int)geo->blocks_per_disk)
   {
     return -1;
   }
 
-  // If the block exists in the cache, we update it with the current elements
-  for (int i = 0; i < cache_size; i++)
+  // If the block is already in the cache, this is not an insert
+  uint32_t tag = CACHE_TAG(disk_num, block_num);
+  if (find_tag(c, tag) != -1)
   {
-    if (cache[i].valid && cache[i].disk_num == disk_num && cache[i].block_num == block_num)
-    {
-      return -1;
-    }
+    return -1;
   }
 
-  // Looking up for an empty spot
-  for (int i = 0; i < cache_size; i++)
+  // Looking up for an empty spot, otherwise evict the Most Recently Used (MRU)
+  // entry, or let the admission filter pick one
+  int slot = find_tag(c, 0);
+  if (slot == -1 && c->sketch != NULL)
   {
-    if (!cache[i].valid)
-    {
-      cache[i].valid = true;
-      cache[i].disk_num = disk_num;
-      cache[i].block_num = block_num;
-      memcpy(cache[i].block, buf, JBOD_BLOCK_SIZE);
-      cache[i].clock_accesses = clock++;
-      return 1;
-    }
+    slot = admit_entry(c);
+  }
+  else if (slot == -1)
+  {
+    slot = victim_entry(c);
+    release_entry(c, slot);
   }
 
-  // Evict the Most Recently Used (MRU) entry when cache is full
-  int mru_index = 0;
-  for (int i = 1; i < cache_size; i++)
+  // Initialize new content at slot
+  if (!attach_block(c, slot, buf))
   {
-    if (cache[i].clock_accesses > cache[mru_index].clock_accesses)
-    {
-      mru_index = i; // Index of the MRU entry
-    }
+    return -1;
+  }
+  c->tags[slot] = tag;
+  c->num_valid++;
+  c->clocks[slot] = c->clock++;
+  if (c->lease_expiry != NULL)
+  {
+    c->lease_expiry[slot] = 0; // until cache_lease
   }
 
-  // Initialize new content at mru_index
-  cache[mru_index].valid = true;
-  cache[mru_index].disk_num = disk_num;
-  cache[mru_index].block_num = block_num;
-  memcpy(cache[mru_index].block, buf, JBOD_BLOCK_SIZE);
-  cache[mru_index].clock_accesses = clock++;
+  return 1;
+}
+
+static int lease(cache_t *c, int disk_num, int block_num, uint64_t expiry)
+{
+  uint32_t tag;
+  int i;
+  if (c->lease_expiry == NULL || !make_tag(disk_num, block_num, &tag) || (i = find_tag(c, tag)) == -1)
+  {
+    return -1;
+  }
 
+  c->lease_expiry[i] = expiry;
   return 1;
 }
 
-bool cache_enabled(void)
+static int invalidate(cache_t *c, int disk_num, int block_num)
+{
+  uint32_t tag;
+  int i;
+  if (c->tags == NULL || !make_tag(disk_num, block_num, &tag) || (i = find_tag(c, tag)) == -1)
+  {
+    return -1;
+  }
+
+  c->num_invalidated++;
+  drop_entry(c, i);
+  return 1;
+}
+
+static bool enabled(const cache_t *c)
 {
-  if (cache != NULL && cache_size > 0)
+  if (c->tags != NULL && c->cache_size > 0)
   {
     return true;
   }
   return false;
 }
 
-void cache_print_hit_rate(void)
+static void print_hit_rate(const cache_t *c)
+{
+  fprintf(stderr, "num_hits: %d, num_queries: %d\n", c->num_hits, c->num_queries);
+  fprintf(stderr, "Hit rate: %5.1f%%\n", 100 * (float)c->num_hits / c->num_queries);
+
+  if (c->dedup)
+  {
+    fprintf(stderr, "Dedup: %d entries in %d blocks, ratio %4.2f:1\n", c->num_valid, c->num_used_blocks,
+            c->num_used_blocks ? (float)c->num_valid / c->num_used_blocks : 0.0f);
+  }
+
+  if (c->admission)
+  {
+    fprintf(stderr, "Admission: %d admitted, %d rejected\n", c->num_admitted, c->num_rejected);
+  }
+
+  if (c->leases)
+  {
+    fprintf(stderr, "Leases: %d expired, %d invalidated\n", c->num_expired, c->num_invalidated);
+  }
+}
+
+/* qsort comparison putting the most recent clocks first */
+static int compare_clocks_desc(const void *a, const void *b)
 {
-  fprintf(stderr, "num_hits: %d, num_queries: %d\n", num_hits, num_queries);
-  fprintf(stderr, "Hit rate: %5.1f%%\n", 100 * (float)num_hits / num_queries);
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x < y) - (x > y);
 }
 
-int cache_resize(int new_num_entries)
+static int resize(cache_t *c, int new_num_entries)
 {
-  if (new_num_entries < 2 || new_num_entries > 4096)
+  if (new_num_entries < 2 || new_num_entries > CACHE_MAX_BLOCKS)
   {
     return -1;
   }
 
-  if (cache == NULL)
+  if (c->tags == NULL)
   {
     return -1;
   }
 
-  // Allocate memory for the new cache with the specified size
-  cache_entry_t *new_cache = (cache_entry_t *)malloc(new_num_entries * sizeof(cache_entry_t));
-  if (new_cache == NULL)
+  int new_size = c->dedup ? new_num_entries * CACHE_DEDUP_ENTRIES_PER_BLOCK : new_num_entries;
+
+  // Entries move, so the window starts over
+  if (c->sketch != NULL)
+  {
+    window_clear(c->sketch);
+  }
+
+  // If the new cache is smaller, evict the most recently used entries until
+  // the rest fit, both in entries and in buffers. The excess entries are the
+  // ones above the excess-th largest clock, plus enough of those at it.
+  int excess = c->num_valid - new_size;
+  if (excess > 0)
+  {
+    int *sorted = (int *)malloc(c->num_valid * sizeof(int));
+    if (sorted == NULL)
+    {
+      return -1;
+    }
+    int n = 0;
+    for (int i = 0; i < c->cache_size; i++)
+    {
+      if (c->clocks[i] != -1)
+      {
+        sorted[n++] = c->clocks[i];
+      }
+    }
+    qsort(sorted, n, sizeof(int), compare_clocks_desc);
+    int threshold = sorted[excess - 1];
+    free(sorted);
+
+    for (int i = 0; i < c->cache_size; i++)
+    {
+      if (c->clocks[i] > threshold)
+      {
+        release_entry(c, i);
+        excess--;
+      }
+    }
+    for (int i = 0; i < c->cache_size && excess > 0; i++)
+    {
+      if (c->clocks[i] == threshold)
+      {
+        release_entry(c, i);
+        excess--;
+      }
+    }
+  }
+  while (c->num_used_blocks > new_num_entries)
+  {
+    int victim = evict_entry(c);
+    if (victim == -1)
+    {
+      break;
+    }
+    release_entry(c, victim);
+  }
+
+  // Only the entries move: keep the valid ones aside, in order, while the
+  // entry arrays are rebuilt. Their buffers stay where they are.
+  uint32_t *old_tags = (uint32_t *)malloc((c->num_valid + 1) * sizeof(uint32_t));
+  int *old_clocks = (int *)malloc((c->num_valid + 1) * sizeof(int));
+  int *old_blocks = (int *)malloc((c->num_valid + 1) * sizeof(int));
+  if (old_tags == NULL || old_clocks == NULL || old_blocks == NULL)
   {
+    free(old_tags);
+    free(old_clocks);
+    free(old_blocks);
     return -1; // Memory allocation failed
   }
 
-  // If the new size is smaller, only copy up to the new size, else copy old enteries
-  int entries_to_copy = (new_num_entries < cache_size) ? new_num_entries : cache_size;
-  for (int i = 0; i < entries_to_copy; i++)
+  int kept = 0;
+  for (int i = 0; i < c->cache_size; i++)
   {
-    if (cache[i].valid)
+    if (c->tags[i] != 0)
     {
-      new_cache[i] = cache[i];
+      old_tags[kept] = c->tags[i];
+      old_clocks[kept] = c->clocks[i];
+      old_blocks[kept] = c->entry_block[i];
+      // Moving down in place never overwrites a lease not yet moved
+      if (c->lease_expiry != NULL)
+      {
+        c->lease_expiry[kept] = c->lease_expiry[i];
+      }
+      kept++;
     }
   }
 
-  // Initialize cache_enteries that have not been copied from old cache
-  for (int i = 0; i < new_num_entries; i++)
+  if (region_reshape(c, new_size) == -1)
   {
-    new_cache[i].valid = false;
-    new_cache[i].disk_num = -1;
-    new_cache[i].block_num = -1;
-    new_cache[i].clock_accesses = 0;
+    free(old_tags);
+    free(old_clocks);
+    free(old_blocks);
+    if (c->header == NULL)
+    {
+      cache_free(c); // the backing file could not be mapped again
+    }
+    return -1;
   }
 
-  free(cache);
+  c->num_blocks = new_num_entries;
+  memcpy(c->tags, old_tags, kept * sizeof(uint32_t));
+  memcpy(c->clocks, old_clocks, kept * sizeof(int));
+  memcpy(c->entry_block, old_blocks, kept * sizeof(int));
+
+  free(old_tags);
+  free(old_clocks);
+  free(old_blocks);
 
-  cache = new_cache;            // Global cache pointer points to new cache
-  cache_size = new_num_entries; // Global cache_size is the new cache size
+  if (c->region_mapped)
+  {
+    region_sync(c, false);
+  }
 
   return 1;
 }
+
+/* The functions below run the ones above on the calling thread's cache,
+ * holding its lock if the shared cache is in locking mode */
+
+static cache_t *lock_cache(void)
+{
+  cache_t *c = this_cache();
+  if (c == &shared_cache && locking)
+  {
+    pthread_mutex_lock(&c->lock);
+  }
+  return c;
+}
+
+static void unlock_cache(cache_t *c)
+{
+  if (c == &shared_cache && locking)
+  {
+    pthread_mutex_unlock(&c->lock);
+  }
+}
+
+int cache_create(int num_entries)
+{
+  cache_t *c = lock_cache();
+  int rc = create(c, num_entries);
+  unlock_cache(c);
+  return rc;
+}
+
+int cache_destroy(void)
+{
+  cache_t *c = lock_cache();
+  int rc = destroy(c);
+  unlock_cache(c);
+  return rc;
+}
+
+int cache_lookup(int disk_num, int block_num, uint8_t *buf)
+{
+  TRACE_SCOPE("cache", "lookup");
+  cache_t *c = lock_cache();
+  int rc = lookup(c, disk_num, block_num, buf);
+  unlock_cache(c);
+  return rc;
+}
+
+void cache_update(int disk_num, int block_num, const uint8_t *buf)
+{
+  TRACE_SCOPE("cache", "update");
+  cache_t *c = lock_cache();
+  update(c, disk_num, block_num, buf);
+  unlock_cache(c);
+}
+
+int cache_insert(int disk_num, int block_num, const uint8_t *buf)
+{
+  TRACE_SCOPE("cache", "insert");
+  cache_t *c = lock_cache();
+  int rc = insert(c, disk_num, block_num, buf);
+  unlock_cache(c);
+  return rc;
+}
+
+bool cache_enabled(void)
+{
+  cache_t *c = lock_cache();
+  bool rc = enabled(c);
+  unlock_cache(c);
+  return rc;
+}
+
+void cache_print_hit_rate(void)
+{
+  cache_t *c = lock_cache();
+  print_hit_rate(c);
+  unlock_cache(c);
+}
+
+int cache_lease(int disk_num, int block_num, uint64_t expiry)
+{
+  cache_t *c = lock_cache();
+  int rc = lease(c, disk_num, block_num, expiry);
+  unlock_cache(c);
+  return rc;
+}
+
+int cache_invalidate(int disk_num, int block_num)
+{
+  TRACE_SCOPE("cache", "invalidate");
+  cache_t *c = lock_cache();
+  int rc = invalidate(c, disk_num, block_num);
+  unlock_cache(c);
+  return rc;
+}
+
+int cache_resize(int new_size)
+{
+  cache_t *c = lock_cache();
+  int rc = resize(c, new_size);
+  unlock_cache(c);
+  return rc;
+}
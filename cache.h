@@ -7,16 +7,113 @@
 #include "jbod.h"
 #include "util.h"
 
+/* In dedup mode each data buffer may be shared by several entries holding
+ * identical contents, so the cache keeps this many entries per buffer. */
+#define CACHE_DEDUP_ENTRIES_PER_BLOCK 4
+
+/* The most buffers a cache can have: the largest size cache_create accepts.
+ * The block store reserves room for this many up front. */
+#define CACHE_MAX_BLOCKS 4096
+
+/* Bookkeeping for one data buffer. Without dedup every entry owns one; with
+ * dedup entries with equal contents share one, found by |hash|. The data
+ * itself lives in a separate 64-byte aligned block store. */
+typedef struct {
+  int refs;
+  uint32_t hash;
+  int next; // next buffer with the same hash bucket, or -1
+} cache_block_t;
+
+/* The cache is kept as a structure of arrays, so lookups only scan the tags:
+ * - tags:   one packed 32-bit tag per entry, CACHE_TAG_VALID | disk << 16 |
+ *           block, or 0 for an invalid entry
+ * - clocks: the recency of each entry, -1 when invalid
+ * - the index of each entry's buffer, and the buffers' bookkeeping and data
+ * The block store is one arena reserved for CACHE_MAX_BLOCKS buffers, using
+ * huge pages when the system has them, and is committed as buffers are first
+ * needed. Buffers are recycled through a free list, so resizing the cache
+ * only rebuilds the entry arrays and never moves data. */
+#define CACHE_TAG_VALID 0x80000000u
+#define CACHE_TAG(disk, block) (CACHE_TAG_VALID | (uint32_t)(disk) << 16 | (uint32_t)(block))
+
+/* Header of a cache backing file, followed by the buffers' bookkeeping, the
+ * hash buckets, the block store and the entry arrays. The contents are only trusted again if
+ * the file was closed cleanly, matches the array geometry and cache shape,
+ * and was written at the same server generation. */
 typedef struct {
-  bool valid;
-  int disk_num;
-  int block_num;
-  uint8_t block[JBOD_BLOCK_SIZE];
-  int clock_accesses;
-} cache_entry_t;
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_disks;
+  uint32_t blocks_per_disk;
+  uint32_t layout;
+  uint32_t stripe_blocks;
+  int32_t cache_size;
+  int32_t num_blocks;
+  int32_t dedup;
+  int32_t clock;
+  int32_t free_block;
+  int32_t num_valid;
+  int32_t num_used_blocks;
+  int32_t arena_slots; // buffers of the block store handed out so far
+  uint32_t clean;
+  uint64_t generation;
+} cache_file_header_t;
+
+#define CACHE_FILE_MAGIC 0x4d444348 // "MDCH"
+#define CACHE_FILE_VERSION 3
+
+/* Turns content deduplication on or off for the next cache_create. The
+ * memory budget stays |num_entries| data blocks, but up to
+ * CACHE_DEDUP_ENTRIES_PER_BLOCK times as many entries can share them. */
+void cache_set_dedup(bool enable);
+
+/* Turns the TinyLFU admission filter on or off for the next cache_create.
+ * Every lookup is counted in a small frequency sketch. On a full cache, a
+ * missed block goes into a small window of recent blocks, and a block leaving
+ * the window only evicts an entry from the rest of the cache when it has been
+ * looked up more often than that entry, so one-time scans cannot flush it. */
+void cache_set_admission(bool enable);
+
+/* Turns read leases on or off for the next cache_create. A leased cache
+ * only trusts an entry until the lease its block was read under runs out
+ * (see cache_lease): after that, looking it up drops it and misses. New
+ * entries have no lease. */
+void cache_set_leases(bool enable);
+
+/* Backs the next cache_create with the file at |path| (NULL for memory only).
+ * If the file holds a cache of the same shape and geometry that was closed
+ * cleanly at server generation |generation|, its contents are re-attached;
+ * otherwise they are discarded. Pass 0 if the generation is unknown, which
+ * always discards. */
+void cache_set_backing_file(const char *path, uint64_t generation);
+
+/* Records the server generation the cache contents are valid for; call it
+ * before cache_destroy so the next run can re-attach them. */
+void cache_set_generation(uint64_t generation);
+
+/* Returns true if cache_create re-attached contents from the backing file. */
+bool cache_reattached(void);
+
+/* Every other call acts on the calling thread's cache. Threads share the
+ * process-wide cache by default; cache_use_private(true) gives the calling
+ * thread a cache of its own, created and destroyed with cache_create and
+ * cache_destroy as usual, and always memory only. Destroy it before
+ * cache_use_private(false). */
+void cache_use_private(bool enable);
+
+/* Returns true if the calling thread has a cache of its own. */
+bool cache_is_private(void);
+
+/* Serializes every call on the process-wide cache with a lock, so several
+ * threads can share it. */
+void cache_set_locking(bool enable);
+
+/* Returns the name of the tag matcher lookups use: "avx2", "sse2" or
+ * "scalar". Build with -DCACHE_NO_SIMD to force the scalar one. */
+const char *cache_tag_match(void);
 
 /* Returns 1 on success and -1 on failure. Should allocate a space for
- * |num_entries| cache entries, each of type cache_entry_t. Calling it again
+ * |num_entries| cache entries. Calling it again
  * without first calling cache_destroy (see below) should fail. */
 int cache_create(int num_entries);
 
@@ -39,16 +136,25 @@ int cache_insert(int disk_num, int block_num, const uint8_t *buf);
  * corresponding block with data from |buf| */
 void cache_update(int disk_num, int block_num, const uint8_t *buf);
 
+/* Returns 1 on success and -1 on failure. In a leased cache, trusts the
+ * entry for |disk_num| and |block_num| until |expiry|, in CLOCK_MONOTONIC
+ * nanoseconds. */
+int cache_lease(int disk_num, int block_num, uint64_t expiry);
+
+/* Returns 1 if an entry for |disk_num| and |block_num| was dropped, and -1
+ * if there was none. */
+int cache_invalidate(int disk_num, int block_num);
+
 /* Returns true if cache is enabled and false if not. */
 bool cache_enabled(void);
 
-/* Prints the hit rate of the cache. */
+/* Prints the hit rate of the cache, and the dedup ratio in dedup mode. */
 void cache_print_hit_rate(void);
 
 /* Resizes the cache to |new_size| entries. If |new_size| is smaller than the
  * current size, evicts the most recently used entries. If |new_size| is
  * larger than the current size, allocates new entries and initializes them to
- * invalid. */
+ * invalid. Cached data stays where it is in the block store. */
 int cache_resize(int new_size);
 
 #endif
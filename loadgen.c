@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "jbod.h"
+#include "mdadm.h"
+#include "net.h"
+
+// Open-loop load generator. The tester and bench run closed-loop: the next
+// operation waits for the previous one, so a slow server slows the offered
+// load down with it and queueing delay never shows. Here operations are sent
+// on a fixed schedule, at a target rate, whatever the server does, and
+// latency is measured from when an operation was due to be sent, not from
+// when it was sent (no coordinated omission): an operation that waits behind
+// a slow one is charged for the wait. Rates are swept to find the knee, where
+// the server stops keeping up, and printed as CSV.
+
+#define LOADGEN_ARGUMENTS "hg:r:a:c:d:w:n:s:"
+#define USAGE                                                                          \
+  "USAGE: loadgen [-h] [-g disks:blocks] [-r rate|start:stop:step] [-a const|poisson]\n" \
+  "               [-c connections] [-d seconds] [-w write_percent] [-n bytes]\n"       \
+  "               [-s cache_size]\n"                                                   \
+  "\n"                                                                                 \
+  "where:\n"                                                                           \
+  "    -h - help mode (display this message)\n"                                        \
+  "    -g - array geometry, number of disks and blocks per disk (default 16:256)\n"   \
+  "    -r - target rate in operations per second, or a sweep of rates\n"              \
+  "         (default 500:10000:500); a sweep stops once the server falls behind\n"    \
+  "    -a - arrivals at a constant rate, or a Poisson process (default)\n"            \
+  "    -c - connections, each with its own thread and an equal share of the rate\n"  \
+  "         (more than 1 needs a server that serves clients concurrently)\n"          \
+  "    -d - seconds of operations to schedule at each rate (default 2)\n"             \
+  "    -w - percentage of writes, the rest are reads (default 0)\n"                   \
+  "    -n - bytes per operation, at a random multiple of it (default 256, max 1024)\n" \
+  "    -s - share a cache of this many entries between the connections\n"             \
+  "\n"                                                                                 \
+  "Prints one CSV line per rate: the operations sent and the ones left unsent\n"      \
+  "when the run was cut off, the rate achieved, and the latency percentiles in\n"     \
+  "microseconds.\n"                                                                    \
+  "\n"
+
+#define MAX_IO_SIZE 1024
+#define MAX_CONNECTIONS 64
+
+// A rate is saturated once less than this share of it is achieved, or its
+// p99 is more than SATURATED_P99 times the p99 of the first rate
+#define SATURATED_SHARE 0.95
+#define SATURATED_P99 10
+// A run is cut off this long after its last operation was due
+#define GRACE_NS 1000000000ULL
+
+static bool poisson = true;
+static int num_connections = 1;
+static double seconds = 2;
+static int write_percent = 0;
+static uint32_t io_size = JBOD_BLOCK_SIZE;
+
+/* One connection's share of a run */
+typedef struct {
+  int id;
+  double rate;       // operations per second, for this connection
+  uint64_t start;    // CLOCK_MONOTONIC ns the schedule starts at
+  uint64_t end;      // no operation is due after this
+  unsigned int seed;
+  double *lat;       // microseconds from due to done, per operation
+  size_t num_lat, max_lat;
+  uint64_t sent, unsent, failed;
+  uint64_t last_done;
+} load_conn_t;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+  struct timespec ts = {ns / 1000000000ULL, ns % 1000000000ULL};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+    ;
+}
+
+/* Returns the time to the next arrival, in nanoseconds */
+static uint64_t interarrival(load_conn_t *c)
+{
+  double mean = 1e9 / c->rate;
+  if (!poisson)
+    return (uint64_t)mean;
+
+  // Exponentially distributed gaps make the arrivals a Poisson process
+  double u = (rand_r(&c->seed) + 1.0) / ((double)RAND_MAX + 2.0);
+  return (uint64_t)(-log(u) * mean);
+}
+
+static void add_latency(load_conn_t *c, double us)
+{
+  if (c->num_lat == c->max_lat)
+  {
+    c->max_lat = c->max_lat ? 2 * c->max_lat : 4096;
+    c->lat = realloc(c->lat, c->max_lat * sizeof(double));
+    if (c->lat == NULL)
+      err(1, "cannot hold %zu latency samples", c->max_lat);
+  }
+  c->lat[c->num_lat++] = us;
+}
+
+/* Sends one operation at every arrival of |c|'s schedule, as soon as it is
+ * due, or as soon as the previous one is done if that is later. Operations
+ * still unsent GRACE_NS after the last one was due are given up on, and
+ * counted with the time they had waited by then. */
+static void run_schedule(load_conn_t *c)
+{
+  const mdadm_geometry_t *geo = mdadm_get_geometry();
+  uint64_t slots = geo->capacity / io_size;
+  uint64_t cutoff = c->end + GRACE_NS;
+  uint8_t buf[MAX_IO_SIZE];
+
+  for (uint64_t due = c->start + interarrival(c); due < c->end; due += interarrival(c))
+  {
+    uint64_t now = now_ns();
+    if (now >= cutoff)
+    {
+      c->unsent++;
+      add_latency(c, (cutoff - due) / 1e3);
+      continue;
+    }
+    if (now < due)
+      sleep_until(due);
+
+    uint64_t addr = (uint64_t)(rand_r(&c->seed) % slots) * io_size;
+    int rc;
+    if ((int)(rand_r(&c->seed) % 100) < write_percent)
+    {
+      memset(buf, c->id + 1, io_size);
+      rc = mdadm_write(addr, io_size, buf);
+    }
+    else
+    {
+      rc = mdadm_read(addr, io_size, buf);
+    }
+
+    c->last_done = now_ns();
+    c->sent++;
+    c->failed += rc != (int)io_size;
+    add_latency(c, (c->last_done - due) / 1e3);
+  }
+}
+
+static void *load_worker(void *arg)
+{
+  load_conn_t *c = (load_conn_t *)arg;
+  if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
+    errx(1, "connection %d cannot connect to the server", c->id);
+  run_schedule(c);
+  jbod_disconnect();
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Returns the |q| quantile of the |n| sorted values in |v| */
+static double quantile(const double *v, size_t n, double q)
+{
+  if (n == 0)
+    return 0;
+  size_t i = (size_t)(q * n);
+  return v[i < n ? i : n - 1];
+}
+
+/* Runs the schedule at |rate| operations per second over every connection,
+ * the first on this thread, which is already connected. Prints its CSV line.
+ * Returns the achieved rate and sets |*p99|. */
+static double run_rate(double rate, double *p99)
+{
+  load_conn_t conns[MAX_CONNECTIONS];
+  pthread_t tids[MAX_CONNECTIONS];
+
+  // Leave the other connections time to connect before the first arrival
+  uint64_t start = now_ns() + 50000000ULL;
+  for (int i = 0; i < num_connections; i++)
+  {
+    conns[i] = (load_conn_t){
+      .id = i,
+      .rate = rate / num_connections,
+      .start = start,
+      .end = start + (uint64_t)(seconds * 1e9),
+      .seed = (unsigned int)rate * MAX_CONNECTIONS + i,
+    };
+    // Constant arrivals on several connections interleave rather than coincide
+    if (!poisson)
+      conns[i].start += (uint64_t)(i * 1e9 / rate);
+  }
+
+  for (int i = 1; i < num_connections; i++)
+  {
+    if (pthread_create(&tids[i], NULL, load_worker, &conns[i]) != 0)
+      errx(1, "cannot start connection %d", i);
+  }
+  run_schedule(&conns[0]);
+
+  load_conn_t total = {0};
+  for (int i = 0; i < num_connections; i++)
+  {
+    if (i > 0)
+      pthread_join(tids[i], NULL);
+    total.sent += conns[i].sent;
+    total.unsent += conns[i].unsent;
+    total.failed += conns[i].failed;
+    if (conns[i].last_done > total.last_done)
+      total.last_done = conns[i].last_done;
+    for (size_t j = 0; j < conns[i].num_lat; j++)
+      add_latency(&total, conns[i].lat[j]);
+    free(conns[i].lat);
+  }
+
+  // Operations that finish late stretch the run, and bring the rate down
+  double elapsed = seconds;
+  if (total.last_done > start && (total.last_done - start) / 1e9 > elapsed)
+    elapsed = (total.last_done - start) / 1e9;
+  double achieved = total.sent / elapsed;
+
+  qsort(total.lat, total.num_lat, sizeof(double), compare_doubles);
+  *p99 = quantile(total.lat, total.num_lat, 0.99);
+  printf("%.0f,%s,%d,%lu,%lu,%lu,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f\n", rate, poisson ? "poisson" : "const",
+         num_connections, (unsigned long)total.sent, (unsigned long)total.unsent, (unsigned long)total.failed,
+         achieved, quantile(total.lat, total.num_lat, 0.5), quantile(total.lat, total.num_lat, 0.9), *p99,
+         quantile(total.lat, total.num_lat, 0.999), total.num_lat ? total.lat[total.num_lat - 1] : 0.0);
+  fflush(stdout);
+  free(total.lat);
+
+  return achieved;
+}
+
+int main(int argc, char *argv[])
+{
+  double first = 500, last = 10000, step = 500;
+  int ch, cache_size = 0;
+
+  while ((ch = getopt(argc, argv, LOADGEN_ARGUMENTS)) != -1)
+  {
+    switch (ch)
+    {
+    case 'h':
+      fprintf(stderr, USAGE);
+      return 0;
+    case 'g': {
+      uint32_t disks, blocks;
+      if (sscanf(optarg, "%u:%u", &disks, &blocks) != 2 || mdadm_set_geometry(disks, blocks) != 1)
+        errx(1, "invalid geometry [%s]", optarg);
+      break;
+    }
+    case 'r': {
+      int n = sscanf(optarg, "%lf:%lf:%lf", &first, &last, &step);
+      if (n == 1)
+      {
+        last = first;
+        step = 1;
+      }
+      if ((n != 1 && n != 3) || first <= 0 || last < first || step <= 0)
+        errx(1, "invalid rate [%s]", optarg);
+      break;
+    }
+    case 'a':
+      if (strcmp(optarg, "const") == 0)
+        poisson = false;
+      else if (strcmp(optarg, "poisson") == 0)
+        poisson = true;
+      else
+        errx(1, "invalid arrivals [%s]", optarg);
+      break;
+    case 'c':
+      num_connections = atoi(optarg);
+      if (num_connections < 1 || num_connections > MAX_CONNECTIONS)
+        errx(1, "invalid number of connections [%s]", optarg);
+      break;
+    case 'd':
+      seconds = atof(optarg);
+      if (!(seconds > 0))
+        errx(1, "invalid duration [%s]", optarg);
+      break;
+    case 'w':
+      write_percent = atoi(optarg);
+      if (write_percent < 0 || write_percent > 100)
+        errx(1, "invalid write percentage [%s]", optarg);
+      break;
+    case 'n':
+      io_size = atoi(optarg);
+      if (io_size < 1 || io_size > MAX_IO_SIZE)
+        errx(1, "invalid operation size [%s]", optarg);
+      break;
+    case 's':
+      cache_size = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, USAGE);
+      return -1;
+    }
+  }
+
+  if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
+    errx(1, "cannot connect to the server");
+  if (mdadm_mount() != 1)
+    errx(1, "cannot mount the array");
+  if (write_percent > 0 && mdadm_write_permission() != 0)
+    errx(1, "cannot get write permission");
+  if (cache_size > 0 && cache_create(cache_size) != 1)
+    errx(1, "cannot create a cache of %d entries", cache_size);
+
+  printf("target_ops,arrivals,connections,sent,unsent,failed,achieved_ops,p50_us,p90_us,p99_us,p999_us,max_us\n");
+
+  double base_p99 = 0, knee = 0;
+  for (double rate = first; rate <= last; rate += step)
+  {
+    double p99;
+    double achieved = run_rate(rate, &p99);
+    if (base_p99 == 0)
+      base_p99 = p99;
+
+    if (achieved < SATURATED_SHARE * rate || p99 > SATURATED_P99 * base_p99)
+    {
+      fprintf(stderr, "saturated at %.0f ops/s: %.0f achieved, p99 %.1f us\n", rate, achieved, p99);
+      break;
+    }
+    knee = rate;
+  }
+  if (knee > 0)
+    fprintf(stderr, "knee: %.0f ops/s, the highest rate kept up with\n", knee);
+
+  if (cache_size > 0)
+    cache_destroy();
+  if (write_percent > 0)
+    mdadm_revoke_write_permission();
+  mdadm_unmount();
+  jbod_disconnect();
+  return 0;
+}
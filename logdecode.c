@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "util.h"
+
+// Formats a binary debug log (see set_debug_log_binary) as text: one line per
+// message, with its time in seconds since the first message and the number of
+// the thread that logged it.
+
+#define LOGDECODE_ARGUMENTS "h"
+#define USAGE                                                               \
+  "USAGE: logdecode [-h] [log-file]\n"                                     \
+  "\n"                                                                     \
+  "where:\n"                                                               \
+  "    -h - help mode (display this message)\n"                            \
+  "\n"                                                                     \
+  "Reads the log from standard input if no file is given.\n"              \
+  "\n"
+
+#define MAX_FORMATS 65536
+
+static char *formats[MAX_FORMATS];
+
+/* Reads exactly |len| bytes. Returns false at the end of the log. */
+static bool read_field(FILE *f, void *buf, size_t len)
+{
+  return fread(buf, 1, len, f) == len;
+}
+
+int main(int argc, char *argv[])
+{
+  int ch;
+
+  while ((ch = getopt(argc, argv, LOGDECODE_ARGUMENTS)) != -1)
+  {
+    switch (ch)
+    {
+    case 'h':
+      fprintf(stderr, USAGE);
+      return 0;
+    default:
+      fprintf(stderr, USAGE);
+      return -1;
+    }
+  }
+
+  FILE *f = stdin;
+  if (optind < argc && (f = fopen(argv[optind], "r")) == NULL)
+    err(1, "cannot open %s", argv[optind]);
+
+  char magic[8];
+  if (!read_field(f, magic, sizeof(magic)) || memcmp(magic, DEBUG_LOG_MAGIC, sizeof(magic)) != 0)
+    errx(1, "not a binary debug log");
+
+  uint64_t first_ns = 0;
+  bool seen_record = false;
+  uint8_t type;
+  while (read_field(f, &type, 1))
+  {
+    uint16_t id, len;
+
+    if (type == DEBUG_LOG_FORMAT)
+    {
+      if (!read_field(f, &id, 2) || !read_field(f, &len, 2))
+        errx(1, "truncated format definition");
+      free(formats[id]);
+      formats[id] = malloc(len + 1);
+      if (formats[id] == NULL || !read_field(f, formats[id], len))
+        errx(1, "truncated format definition");
+      formats[id][len] = '\0';
+    }
+    else if (type == DEBUG_LOG_RECORD)
+    {
+      uint64_t ns;
+      uint16_t thread;
+      uint8_t args[UINT16_MAX];
+      if (!read_field(f, &ns, 8) || !read_field(f, &id, 2) || !read_field(f, &thread, 2) ||
+          !read_field(f, &len, 2) || !read_field(f, args, len))
+        errx(1, "truncated record");
+      if (formats[id] == NULL)
+        errx(1, "record uses undefined format %u", id);
+
+      if (!seen_record)
+      {
+        first_ns = ns;
+        seen_record = true;
+      }
+
+      char line[1024];
+      debug_log_format(formats[id], args, len, line, sizeof(line));
+      printf("%12.6f %3u %s\n", (double)(int64_t)(ns - first_ns) / 1e9, thread, line);
+    }
+    else
+    {
+      errx(1, "unknown entry type 0x%02x", type);
+    }
+  }
+
+  if (f != stdin)
+    fclose(f);
+  return 0;
+}
@@ -1,295 +1,2389 @@
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "cache.h"
 #include "jbod.h"
 #include "mdadm.h"
+#include "merkle.h"
 #include "net.h"        // Added by me 
+#include "trace.h"
 
 // I had different variables for these, but changed my code as per the provided code here
 int is_mounted = 0;
 int is_written = 0;
 
-int mdadm_mount(void)
+// Offsets within a block are the low bits of an address
+#define BLOCK_SHIFT 8
+_Static_assert((1 << BLOCK_SHIFT) == JBOD_BLOCK_SIZE, "JBOD_BLOCK_SIZE must be 1 << BLOCK_SHIFT");
+
+// Geometry of the array, the compile-time JBOD layout unless set otherwise
+static mdadm_geometry_t geometry = {
+  .num_disks = JBOD_NUM_DISKS,
+  .blocks_per_disk = JBOD_NUM_BLOCKS_PER_DISK,
+  .disk_size = JBOD_DISK_SIZE,
+  .capacity = (uint64_t)JBOD_NUM_DISKS * JBOD_DISK_SIZE,
+  .blocks_shift = 8, // log2(JBOD_NUM_BLOCKS_PER_DISK)
+  .blocks_mask = JBOD_NUM_BLOCKS_PER_DISK - 1,
+  .layout = MDADM_LAYOUT_LINEAR,
+  .stripe_blocks = 1,
+  .stripe_shift = 0,
+  .disks_shift = 4, // log2(JBOD_NUM_DISKS)
+  .reserved_blocks = 0,
+};
+
+/* Returns log2(v) if v is a power of two and -1 otherwise */
+static int exact_log2(uint32_t v)
 {
+  return (v & (v - 1)) == 0 ? __builtin_ctz(v) : -1;
+}
 
+/* Applies a new geometry, layout and snapshot reserve, recomputing the
+ * derived fields used by locate(). Returns 1 on success and -1 if the
+ * combination is invalid. */
+static int apply_geometry(uint32_t num_disks, uint32_t blocks_per_disk, mdadm_layout_t layout, uint32_t stripe_blocks,
+                          uint32_t reserved_blocks)
+{
   if (is_mounted == 1)
   {
     return -1;
   }
 
-  uint32_t op = JBOD_MOUNT;
-  int chk_status = jbod_client_operation(op << 12, NULL);
+  // The opcode format limits how many disks and blocks can be addressed
+  if (num_disks == 0 || num_disks > JBOD_OP_MAX_DISKS || blocks_per_disk == 0 || blocks_per_disk > JBOD_OP_MAX_BLOCKS)
+  {
+    return -1;
+  }
+
+  // Every disk has to hold a whole number of stripe units
+  if (layout == MDADM_LAYOUT_STRIPED && (stripe_blocks == 0 || blocks_per_disk % stripe_blocks != 0))
+  {
+    return -1;
+  }
+
+  // Mirrors pair up the disks
+  if (layout == MDADM_LAYOUT_MIRRORED && num_disks % 2 != 0)
+  {
+    return -1;
+  }
+
+  // The reserve comes out of the array, leaving at least one block
+  uint64_t capacity = (uint64_t)blocks_per_disk * JBOD_BLOCK_SIZE * num_disks;
+  if (layout == MDADM_LAYOUT_MIRRORED)
+  {
+    capacity /= 2;
+  }
+  if ((uint64_t)reserved_blocks * JBOD_BLOCK_SIZE >= capacity)
+  {
+    return -1;
+  }
+
+  geometry.num_disks = num_disks;
+  geometry.blocks_per_disk = blocks_per_disk;
+  geometry.disk_size = (uint64_t)blocks_per_disk * JBOD_BLOCK_SIZE;
+  geometry.capacity = capacity - (uint64_t)reserved_blocks * JBOD_BLOCK_SIZE;
+  geometry.reserved_blocks = reserved_blocks;
+  geometry.layout = layout;
+  geometry.stripe_blocks = layout == MDADM_LAYOUT_STRIPED ? stripe_blocks : 1;
+
+  // Power of two sizes take the shift/mask fast path in locate()
+  geometry.blocks_shift = exact_log2(blocks_per_disk);
+  geometry.blocks_mask = geometry.blocks_shift >= 0 ? blocks_per_disk - 1 : 0;
+  geometry.stripe_shift = exact_log2(geometry.stripe_blocks);
+  geometry.disks_shift = exact_log2(num_disks);
+
+  return 1;
+}
+
+int mdadm_set_geometry(uint32_t num_disks, uint32_t blocks_per_disk)
+{
+  return apply_geometry(num_disks, blocks_per_disk, geometry.layout, geometry.stripe_blocks, geometry.reserved_blocks);
+}
+
+int mdadm_set_layout(mdadm_layout_t layout, uint32_t stripe_blocks)
+{
+  return apply_geometry(geometry.num_disks, geometry.blocks_per_disk, layout, stripe_blocks, geometry.reserved_blocks);
+}
+
+int mdadm_set_snapshot_reserve(uint32_t blocks)
+{
+  return apply_geometry(geometry.num_disks, geometry.blocks_per_disk, geometry.layout, geometry.stripe_blocks, blocks);
+}
+
+const mdadm_geometry_t *mdadm_get_geometry(void)
+{
+  return &geometry;
+}
+
+// Snapshots. With blocks reserved, the array's logical blocks go through
+// live_map to physical blocks, numbered like logical ones but running on
+// into the reserve; each snapshot freezes a copy of the map, and map_refs
+// counts the maps using each physical block. Written under snap_lock; the
+// map pointers only change while nothing else runs, at mount and unmount.
+static uint32_t *live_map = NULL;
+static uint32_t *snapshots[MDADM_MAX_SNAPSHOTS];
+static uint8_t *map_refs = NULL;
+static uint64_t num_logical = 0;
+static uint64_t num_physical = 0;
+static uint64_t free_hint = 0;    // where the search for a free block starts
+static uint64_t num_remapped = 0; // logical blocks away from their own physical block
+static int num_snapshots = 0;
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t snapshots_taken = 0;
+static uint64_t blocks_copied = 0;
+static uint64_t copies_failed = 0;
+
+/* Maps the physical block |block_index| to a disk and the block within the
+ * disk according to the current layout */
+static inline void place(uint64_t block_index, uint32_t *disk, uint32_t *block)
+{
+
+  if (geometry.layout == MDADM_LAYOUT_STRIPED)
+  {
+    // Stripe unit number and block within the unit
+    uint64_t unit;
+    uint32_t within;
+    if (geometry.stripe_shift >= 0)
+    {
+      unit = block_index >> geometry.stripe_shift;
+      within = block_index & (geometry.stripe_blocks - 1);
+    }
+    else
+    {
+      unit = block_index / geometry.stripe_blocks;
+      within = block_index % geometry.stripe_blocks;
+    }
+
+    // Units go round-robin over the disks, one row of units at a time
+    uint64_t row;
+    if (geometry.disks_shift >= 0)
+    {
+      *disk = unit & (geometry.num_disks - 1);
+      row = unit >> geometry.disks_shift;
+    }
+    else
+    {
+      *disk = unit % geometry.num_disks;
+      row = unit / geometry.num_disks;
+    }
+
+    *block = row * geometry.stripe_blocks + within;
+    return;
+  }
+
+  if (geometry.blocks_shift >= 0)
+  {
+    *disk = block_index >> geometry.blocks_shift;
+    *block = block_index & geometry.blocks_mask;
+  }
+  else
+  {
+    *disk = block_index / geometry.blocks_per_disk;
+    *block = block_index % geometry.blocks_per_disk;
+  }
+
+  // Mirror pairs are laid out linearly; report the first member of the pair
+  if (geometry.layout == MDADM_LAYOUT_MIRRORED)
+  {
+    *disk *= 2;
+  }
+}
+
+/* Splits an array address into its disk, block within the disk and offset
+ * within the block, through the live map when there is one */
+static inline void locate(uint64_t addr, uint32_t *disk, uint32_t *block, uint32_t *offset)
+{
+  uint64_t block_index = addr >> BLOCK_SHIFT;
+  *offset = addr & (JBOD_BLOCK_SIZE - 1);
+
+  if (live_map != NULL)
+  {
+    block_index = __atomic_load_n(&live_map[block_index], __ATOMIC_RELAXED);
+  }
+  place(block_index, disk, block);
+}
+
+void mdadm_map(uint64_t addr, uint32_t *disk, uint32_t *block, uint32_t *offset)
+{
+  locate(addr, disk, block, offset);
+}
+
+/* Returns true if [addr, addr + len) lies inside the array, without
+ * overflowing for addresses near the top of the 64-bit range */
+static inline bool in_bounds(uint64_t addr, uint32_t len)
+{
+  return addr <= geometry.capacity && len <= geometry.capacity - addr;
+}
+
+// Mirrored layout: last block each disk was positioned after, which is per
+// connection and so per thread, and read counts over all threads
+static _Thread_local uint32_t head_pos[JBOD_OP_MAX_DISKS];
+static uint64_t mirror_reads[JBOD_OP_MAX_DISKS];
+static uint64_t mirror_retries = 0;
+
+// Where this thread's connection is positioned: the disk and block the next
+// read or write would use. Only known while no other request has been sent
+// on the connection since (see jbod_client_ops).
+static _Thread_local uint32_t pos_disk = 0;
+static _Thread_local uint32_t pos_block = 0;
+static _Thread_local uint64_t pos_ops = UINT64_MAX;
+
+// Reads and writes of a block, and the seeks issued for them, over all threads
+static uint64_t block_ops = 0;
+static uint64_t seek_ops = 0;
+
+/* Seeks to |block| of |disk|, unless the connection is already there, and
+ * runs |cmd| (a read or a write) on it. Returns 0 on success and -1 on
+ * failure. */
+static int block_io(int cmd, uint32_t disk, uint32_t block, uint8_t *buf)
+{
+  TRACE_SCOPE("mdadm", cmd == JBOD_READ_BLOCK ? "fetch block" : "store block");
+  TRACE_ARG("disk", disk);
+  TRACE_ARG("block", block);
+
+  bool known = pos_ops == jbod_client_ops();
+  __atomic_fetch_add(&block_ops, 1, __ATOMIC_RELAXED);
+
+  // Seek to the correct disk
+  if (!known || pos_disk != disk)
+  {
+    __atomic_fetch_add(&seek_ops, 1, __ATOMIC_RELAXED);
+    uint32_t op_seek_disk = jbod_encode_op(JBOD_SEEK_TO_DISK, disk, 0);
+    if (jbod_client_operation(op_seek_disk, NULL) != 0)
+    {
+      return -1;
+    }
+  }
+
+  // Seek to the correct block; a new disk always gets one
+  if (!known || pos_disk != disk || pos_block != block)
+  {
+    __atomic_fetch_add(&seek_ops, 1, __ATOMIC_RELAXED);
+    uint32_t op_seek_block = jbod_encode_op(JBOD_SEEK_TO_BLOCK, 0, block);
+    if (jbod_client_operation(op_seek_block, NULL) != 0)
+    {
+      return -1;
+    }
+  }
+
+  if (jbod_client_operation(jbod_encode_op(cmd, 0, 0), buf) != 0)
+  {
+    return -1;
+  }
+
+  // Reads and writes leave the disk positioned on the next block
+  head_pos[disk] = block + 1;
+  pos_disk = disk;
+  pos_block = block + 1;
+  pos_ops = jbod_client_ops();
+  return 0;
+}
+
+/* Distance the head of |disk| has to travel to reach |block| */
+static uint32_t seek_distance(uint32_t disk, uint32_t block)
+{
+  return head_pos[disk] > block ? head_pos[disk] - block : block - head_pos[disk];
+}
+
+/* Reads |block| of the (primary) |disk| returned by locate() into |buf|.
+ * A mirrored read goes to the member whose head is closest, or the less
+ * loaded one on a tie, and falls back to the other member on an error.
+ * Returns 0 on success and -1 on failure. */
+static int fetch_block(uint32_t disk, uint32_t block, uint8_t *buf)
+{
+  if (geometry.layout != MDADM_LAYOUT_MIRRORED)
+  {
+    return block_io(JBOD_READ_BLOCK, disk, block, buf);
+  }
+
+  uint32_t first = disk, second = disk + 1;
+  uint32_t d0 = seek_distance(first, block), d1 = seek_distance(second, block);
+  if (d1 < d0 || (d1 == d0 && mirror_reads[second] < mirror_reads[first]))
+  {
+    first = disk + 1;
+    second = disk;
+  }
+
+  __atomic_fetch_add(&mirror_reads[first], 1, __ATOMIC_RELAXED);
+  if (block_io(JBOD_READ_BLOCK, first, block, buf) == 0)
+  {
+    return 0;
+  }
+
+  __atomic_fetch_add(&mirror_retries, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mirror_reads[second], 1, __ATOMIC_RELAXED);
+  return block_io(JBOD_READ_BLOCK, second, block, buf);
+}
+
+/* Writes |buf| to |block| of the (primary) |disk| returned by locate(), and
+ * to its mirror in the mirrored layout. Returns 0 on success and -1 on failure. */
+static int store_block(uint32_t disk, uint32_t block, uint8_t *buf)
+{
+  if (block_io(JBOD_WRITE_BLOCK, disk, block, buf) != 0)
+  {
+    return -1;
+  }
+
+  if (geometry.layout == MDADM_LAYOUT_MIRRORED)
+  {
+    return block_io(JBOD_WRITE_BLOCK, disk + 1, block, buf);
+  }
+
+  return 0;
+}
+
+int mdadm_get_generation(uint64_t *generation)
+{
+  uint8_t buf[JBOD_BLOCK_SIZE];
+
+  // A server without the extension rejects the command: no generation
+  memset(buf, 0, sizeof(buf));
+  if (jbod_client_operation(jbod_encode_op(JBOD_GET_GENERATION, 0, 0), buf) != 0)
+  {
+    *generation = 0;
+    return 1;
+  }
+
+  *generation = 0;
+  for (int i = 0; i < 8; i++)
+  {
+    *generation = (*generation << 8) | buf[i];
+  }
+  return 1;
+}
+
+// Reads that miss on the same block at the same time share one fetch: the
+// first becomes the leader and fetches it, the others wait for its result
+#define MAX_FLIGHTS 64
+
+/* A fetch in flight. The slot is held until the leader and every waiter have
+ * taken the result. */
+typedef struct {
+  bool active;
+  bool done;
+  bool stale; // a write to the block finished while it was being fetched
+  uint32_t disk;
+  uint32_t block;
+  int users;
+  int rc;
+  uint8_t data[JBOD_BLOCK_SIZE];
+} flight_t;
+
+static flight_t flights[MAX_FLIGHTS];
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flight_done = PTHREAD_COND_INITIALIZER;
+static uint64_t flight_fetches = 0;
+static uint64_t flight_joins = 0;
+
+// Cached blocks are trusted only under a read lease from the server
+static bool leases = false;
+
+/* Caches |block| of the (primary) |disk|, just fetched into |buf|, under
+ * the lease it was read with in lease mode */
+static void cache_fetched(uint32_t disk, uint32_t block, const uint8_t *buf, uint64_t lease)
+{
+  if (cache_insert(disk, block, buf) == 1 && leases)
+  {
+    cache_lease(disk, block, lease);
+  }
+}
+
+/* Looks |block| of the (primary) |disk| up in the cache into |buf|, after
+ * handling the invalidations that have arrived in lease mode. Returns true
+ * on a hit. */
+static bool cache_hit(uint32_t disk, uint32_t block, uint8_t *buf)
+{
+  if (!cache_enabled())
+  {
+    return false;
+  }
+  if (leases)
+  {
+    jbod_client_poll();
+  }
+  return cache_lookup(disk, block, buf) == 1;
+}
+
+/* Reads |block| of the (primary) |disk| into |buf| after a cache miss and
+ * caches it. If another thread is already fetching the block, waits for its
+ * result instead of asking the server again. Returns 0 on success and -1 on
+ * failure. */
+static int fetch_missed_block(uint32_t disk, uint32_t block, uint8_t *buf)
+{
+  flight_t *f = NULL, *free_slot = NULL;
+
+  pthread_mutex_lock(&flight_lock);
+  for (int i = 0; i < MAX_FLIGHTS && f == NULL; i++)
+  {
+    flight_t *g = &flights[i];
+    if (!g->active)
+    {
+      free_slot = free_slot != NULL ? free_slot : g;
+    }
+    else if (g->disk == disk && g->block == block && !g->done && !g->stale)
+    {
+      f = g;
+    }
+  }
+
+  if (f != NULL)
+  {
+    flight_joins++;
+    f->users++;
+    while (!f->done)
+    {
+      pthread_cond_wait(&flight_done, &flight_lock);
+    }
+    int rc = f->rc;
+    memcpy(buf, f->data, JBOD_BLOCK_SIZE);
+    // The leader filled the shared cache; a private one is ours to fill,
+    // unless it needs a lease of our own
+    bool insert = rc == 0 && !f->stale && cache_is_private() && !leases;
+    f->active = --f->users > 0;
+    pthread_mutex_unlock(&flight_lock);
+
+    if (insert && cache_enabled())
+    {
+      cache_insert(disk, block, buf);
+    }
+    return rc;
+  }
+
+  if (free_slot == NULL)
+  {
+    // More misses in flight than slots: fetch without sharing
+    pthread_mutex_unlock(&flight_lock);
+    if (fetch_block(disk, block, buf) != 0)
+    {
+      return -1;
+    }
+    if (cache_enabled())
+    {
+      cache_fetched(disk, block, buf, jbod_client_lease());
+    }
+    return 0;
+  }
+
+  f = free_slot;
+  f->active = true;
+  f->done = false;
+  f->stale = false;
+  f->disk = disk;
+  f->block = block;
+  f->users = 1;
+  flight_fetches++;
+  pthread_mutex_unlock(&flight_lock);
+
+  // Only the leader touches the slot's data until it is done
+  int rc = fetch_block(disk, block, f->data);
+  uint64_t lease = jbod_client_lease();
+
+  pthread_mutex_lock(&flight_lock);
+  f->rc = rc;
+  f->done = true;
+  // Inserting under the flight lock orders it before any write that marks
+  // the flight stale, and so before that write's cache_update
+  if (rc == 0 && !f->stale && cache_enabled())
+  {
+    cache_fetched(disk, block, f->data, lease);
+  }
+  memcpy(buf, f->data, JBOD_BLOCK_SIZE);
+  f->active = --f->users > 0;
+  pthread_cond_broadcast(&flight_done);
+  pthread_mutex_unlock(&flight_lock);
+  return rc;
+}
+
+/* Marks the fetches of |block| of the (primary) |disk| in flight stale:
+ * they may have read the old contents, so they are not cached or joined */
+static void stale_flights(uint32_t disk, uint32_t block)
+{
+  pthread_mutex_lock(&flight_lock);
+  for (int i = 0; i < MAX_FLIGHTS; i++)
+  {
+    if (flights[i].active && flights[i].disk == disk && flights[i].block == block)
+    {
+      flights[i].stale = true;
+    }
+  }
+  pthread_mutex_unlock(&flight_lock);
+}
+
+/* Marks the Merkle leaves of |block| of the (primary) |disk| dirty, for
+ * every member of a mirror */
+static void leaf_changed(uint32_t disk, uint32_t block)
+{
+  merkle_mark_dirty(disk * geometry.blocks_per_disk + block);
+  if (geometry.layout == MDADM_LAYOUT_MIRRORED)
+  {
+    merkle_mark_dirty((disk + 1) * geometry.blocks_per_disk + block);
+  }
+}
+
+/* Records that |data| was written to |block| of the (primary) |disk|: a
+ * fetch of the block still in flight may have read the old contents, and
+ * the cached copy is updated */
+static void block_written(uint32_t disk, uint32_t block, const uint8_t *data)
+{
+  stale_flights(disk, block);
+  leaf_changed(disk, block);
+
+  if (cache_enabled())
+  {
+    cache_update(disk, block, data);
+  }
+}
+
+/* Called for every invalidation the server pushes: another client wrote
+ * |block| of |disk|, so the copy cached under a lease is dropped. A write to
+ * either member of a mirror is one to the pair's primary. */
+static void block_invalidated(uint32_t disk, uint32_t block)
+{
+  if (geometry.layout == MDADM_LAYOUT_MIRRORED)
+  {
+    disk -= disk % 2;
+  }
+
+  stale_flights(disk, block);
+  leaf_changed(disk, block);
+  if (cache_enabled())
+  {
+    cache_invalidate(disk, block);
+  }
+}
+
+void mdadm_set_leases(bool enable)
+{
+  leases = enable;
+  jbod_set_leases(enable, enable ? block_invalidated : NULL);
+  cache_set_leases(enable);
+}
+
+void mdadm_print_fetch_stats(void)
+{
+  fprintf(stderr, "block fetches: %lu, misses that joined one in flight: %lu\n", (unsigned long)flight_fetches,
+          (unsigned long)flight_joins);
+}
+
+void mdadm_print_mirror_stats(void)
+{
+  if (geometry.layout != MDADM_LAYOUT_MIRRORED)
+  {
+    return;
+  }
+
+  for (uint32_t d = 0; d < geometry.num_disks; d += 2)
+  {
+    fprintf(stderr, "mirror %u: %lu reads from disk %u, %lu from disk %u\n", d / 2,
+            (unsigned long)mirror_reads[d], d, (unsigned long)mirror_reads[d + 1], d + 1);
+  }
+  fprintf(stderr, "mirror retries: %lu\n", (unsigned long)mirror_retries);
+}
+
+/* Sets up the identity map over the array for a mount with blocks reserved.
+ * Returns 0 on success and -1 on failure. */
+static int snapshot_setup(void)
+{
+  if (geometry.reserved_blocks == 0)
+  {
+    return 0;
+  }
+
+  num_logical = geometry.capacity / JBOD_BLOCK_SIZE;
+  num_physical = num_logical + geometry.reserved_blocks;
+  live_map = malloc(num_logical * sizeof(uint32_t));
+  map_refs = calloc(num_physical, 1);
+  if (live_map == NULL || map_refs == NULL)
+  {
+    free(live_map);
+    free(map_refs);
+    live_map = NULL;
+    map_refs = NULL;
+    return -1;
+  }
+
+  for (uint64_t i = 0; i < num_logical; i++)
+  {
+    live_map[i] = i;
+    map_refs[i] = 1;
+  }
+  free_hint = num_logical;
+  num_remapped = 0;
+  return 0;
+}
+
+/* Drops every snapshot */
+static void drop_snapshots(void)
+{
+  for (int i = 0; i < MDADM_MAX_SNAPSHOTS; i++)
+  {
+    mdadm_snapshot_delete(i);
+  }
+}
+
+/* Moves logical block |index| to physical block |target|, which the live
+ * map does not use, and points the map at it once it is stored there. A
+ * snapshot still using |target| is about to lose it, so the snapshots are
+ * dropped first. |owner| maps physical blocks to the logical block the live
+ * map puts there, or -1. Returns 0 on success and -1 on failure, leaving
+ * the map as it was. */
+static int move_block(uint64_t index, uint64_t target, int64_t *owner)
+{
+  uint8_t buf[JBOD_BLOCK_SIZE];
+  uint32_t disk, block;
+  uint32_t old = live_map[index];
+
+  place(old, &disk, &block);
+  if (!cache_hit(disk, block, buf) && fetch_block(disk, block, buf) != 0)
+  {
+    return -1;
+  }
+  if (map_refs[target] > 0)
+  {
+    drop_snapshots();
+  }
+  place(target, &disk, &block);
+  if (store_block(disk, block, buf) != 0)
+  {
+    return -1;
+  }
+  block_written(disk, block, buf);
+
+  pthread_mutex_lock(&snap_lock);
+  map_refs[old]--;
+  map_refs[target]++;
+  num_remapped += (target != index) - (old != index);
+  __atomic_store_n(&live_map[index], target, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&snap_lock);
+  owner[old] = -1;
+  owner[target] = index;
+  return 0;
+}
+
+/* Moves every remapped logical block back to its own physical block, so
+ * the disks hold the live array as it would be laid out without a map.
+ * Blocks move one at a time, each to a block the live map does not use, so
+ * the map stays right after every move and a failed move can be retried.
+ * Returns 0 on success and -1 on failure. */
+static int snapshot_move_home(void)
+{
+  if (num_remapped == 0)
+  {
+    return 0;
+  }
+  if (is_written == 0)
+  {
+    return -1;
+  }
+
+  // |ready| lists the remapped blocks whose home no live block holds
+  int64_t *owner = malloc(num_physical * sizeof(int64_t));
+  uint64_t *ready = malloc(num_logical * sizeof(uint64_t));
+  if (owner == NULL || ready == NULL)
+  {
+    free(owner);
+    free(ready);
+    return -1;
+  }
+  for (uint64_t p = 0; p < num_physical; p++)
+  {
+    owner[p] = -1;
+  }
+  for (uint64_t i = 0; i < num_logical; i++)
+  {
+    owner[live_map[i]] = i;
+  }
+  uint64_t num_ready = 0;
+  for (uint64_t i = 0; i < num_logical; i++)
+  {
+    if (live_map[i] != i && owner[i] == -1)
+    {
+      ready[num_ready++] = i;
+    }
+  }
+
+  // Taking |ready| in order keeps the moves sequential
+  int rc = 0;
+  uint64_t next = 0, first_ready = 0;
+  while (rc == 0 && num_remapped > 0)
+  {
+    if (first_ready < num_ready)
+    {
+      // Moving a block home frees where it was, which may be the home of
+      // another remapped block
+      uint64_t index = ready[first_ready];
+      uint32_t old = live_map[index];
+      if ((rc = move_block(index, index, owner)) == 0)
+      {
+        first_ready++;
+        if (old < num_logical && live_map[old] != old)
+        {
+          ready[num_ready++] = old;
+        }
+      }
+      continue;
+    }
+
+    // The remaining blocks sit in each other's homes, in cycles, and every
+    // home holds a live block: one of them moves to the reserve, which frees
+    // the home of the next
+    while (live_map[next] == next)
+    {
+      next++;
+    }
+    uint64_t target = num_logical;
+    while (owner[target] != -1)
+    {
+      target++;
+    }
+    uint32_t old = live_map[next];
+    if ((rc = move_block(next, target, owner)) == 0 && old < num_logical)
+    {
+      ready[num_ready++] = old;
+    }
+  }
+
+  free(owner);
+  free(ready);
+  return rc;
+}
+
+/* Moves the live blocks home, then drops every snapshot and frees the maps
+ * for an unmount. Returns 0 on success and -1 if the blocks could not all
+ * be moved, leaving the maps in place. */
+static int snapshot_teardown(void)
+{
+  if (live_map == NULL)
+  {
+    return 0;
+  }
+
+  if (snapshot_move_home() != 0)
+  {
+    return -1;
+  }
+  drop_snapshots();
+
+  free(live_map);
+  free(map_refs);
+  live_map = NULL;
+  map_refs = NULL;
+  return 0;
+}
+
+/* Makes logical block |index| safe to store over before a write: when a
+ * snapshot shares its physical block, a free block from the reserve is set
+ * aside for it, |*copy| is set to that block and |*disk| and |*block| to
+ * where it is. Otherwise |*copy| is set to -1 and the block stays in place.
+ * Returns 0 on success and -1 if no free block is left. */
+static int copy_on_write(uint64_t index, int64_t *copy, uint32_t *disk, uint32_t *block)
+{
+  *copy = -1;
+  if (live_map == NULL)
+  {
+    return 0;
+  }
+
+  pthread_mutex_lock(&snap_lock);
+  if (map_refs[live_map[index]] == 1)
+  {
+    pthread_mutex_unlock(&snap_lock);
+    return 0;
+  }
+
+  uint64_t free_block = num_physical;
+  for (uint64_t n = 0; n < num_physical; n++)
+  {
+    uint64_t i = (free_hint + n) % num_physical;
+    if (map_refs[i] == 0)
+    {
+      free_block = i;
+      break;
+    }
+  }
+  if (free_block == num_physical)
+  {
+    copies_failed++;
+    pthread_mutex_unlock(&snap_lock);
+    return -1;
+  }
+
+  // Held by no map yet, but no longer free
+  map_refs[free_block] = 1;
+  free_hint = free_block + 1;
+  pthread_mutex_unlock(&snap_lock);
+
+  *copy = free_block;
+  place(free_block, disk, block);
+  return 0;
+}
+
+/* Ends the copy of logical block |index| to the block |copy| set aside by
+ * copy_on_write: points the live map at it once the block has been
+ * |stored|, and frees it again otherwise */
+static void finish_copy(uint64_t index, int64_t copy, bool stored)
+{
+  if (copy == -1)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&snap_lock);
+  if (stored)
+  {
+    uint32_t old = live_map[index];
+    map_refs[old]--;
+    num_remapped += ((uint64_t)copy != index) - (old != index);
+    __atomic_store_n(&live_map[index], (uint32_t)copy, __ATOMIC_RELAXED);
+    blocks_copied++;
+  }
+  else
+  {
+    map_refs[copy] = 0;
+  }
+  pthread_mutex_unlock(&snap_lock);
+}
+
+/* Stores |data| as logical block |index|, placed at |*disk| and |*block|,
+ * copying it away from any snapshot sharing it; |*disk| and |*block| are
+ * set to where it went. The live map only changes once the data is there.
+ * Returns 0 on success and -1 on failure. */
+static int store_logical(uint64_t index, uint32_t *disk, uint32_t *block, uint8_t *data)
+{
+  int64_t copy;
+  if (copy_on_write(index, &copy, disk, block) != 0)
+  {
+    return -1;
+  }
+
+  int rc = store_block(*disk, *block, data);
+  finish_copy(index, copy, rc == 0);
+  return rc;
+}
+
+int mdadm_snapshot_create(void)
+{
+  if (is_mounted == 0 || live_map == NULL)
+  {
+    return -1;
+  }
+
+  uint32_t *map = malloc(num_logical * sizeof(uint32_t));
+  if (map == NULL)
+  {
+    return -1;
+  }
+
+  pthread_mutex_lock(&snap_lock);
+  int snap = 0;
+  while (snap < MDADM_MAX_SNAPSHOTS && snapshots[snap] != NULL)
+  {
+    snap++;
+  }
+  if (snap == MDADM_MAX_SNAPSHOTS)
+  {
+    pthread_mutex_unlock(&snap_lock);
+    free(map);
+    return -1;
+  }
+
+  // Only the map is copied; the blocks become shared
+  memcpy(map, live_map, num_logical * sizeof(uint32_t));
+  for (uint64_t i = 0; i < num_logical; i++)
+  {
+    map_refs[map[i]]++;
+  }
+  snapshots[snap] = map;
+  num_snapshots++;
+  snapshots_taken++;
+  pthread_mutex_unlock(&snap_lock);
+  return snap;
+}
+
+int mdadm_snapshot_delete(int snap)
+{
+  if (snap < 0 || snap >= MDADM_MAX_SNAPSHOTS)
+  {
+    return -1;
+  }
+
+  pthread_mutex_lock(&snap_lock);
+  uint32_t *map = snapshots[snap];
+  if (map == NULL)
+  {
+    pthread_mutex_unlock(&snap_lock);
+    return -1;
+  }
+  for (uint64_t i = 0; i < num_logical; i++)
+  {
+    map_refs[map[i]]--;
+  }
+  snapshots[snap] = NULL;
+  num_snapshots--;
+  pthread_mutex_unlock(&snap_lock);
+
+  free(map);
+  return 1;
+}
+
+int mdadm_snapshot_read(int snap, uint64_t addr, uint32_t len, uint8_t *buf)
+{
+  TRACE_SCOPE("mdadm", "snapshot read");
+  TRACE_ARG("addr", addr);
+  TRACE_ARG("len", len);
+
+  if (is_mounted == 0)
+  {
+    return -3;
+  }
+  if (snap < 0 || snap >= MDADM_MAX_SNAPSHOTS || snapshots[snap] == NULL)
+  {
+    return -1;
+  }
+  if (len == 0 && buf == NULL)
+  {
+    return len;
+  }
+  if (len != 0 && buf == NULL)
+  {
+    return -4;
+  }
+  if (!in_bounds(addr, len))
+  {
+    return -1;
+  }
+  if (len > 1024)
+  {
+    return -2;
+  }
+
+  // A frozen block is never written again, so it is read and cached like
+  // any other
+  const uint32_t *map = snapshots[snap];
+  for (uint32_t done = 0; done < len;)
+  {
+    uint32_t disk, block;
+    uint32_t offset = (addr + done) & (JBOD_BLOCK_SIZE - 1);
+    uint8_t data[JBOD_BLOCK_SIZE];
+    place(map[(addr + done) >> BLOCK_SHIFT], &disk, &block);
+    if (!cache_hit(disk, block, data) && fetch_missed_block(disk, block, data) != 0)
+    {
+      return -1;
+    }
+
+    uint32_t n = JBOD_BLOCK_SIZE - offset < len - done ? JBOD_BLOCK_SIZE - offset : len - done;
+    memcpy(buf + done, data + offset, n);
+    done += n;
+  }
+  return len;
+}
+
+void mdadm_print_snapshot_stats(void)
+{
+  if (live_map == NULL)
+  {
+    return;
+  }
+
+  uint64_t in_use = 0;
+  for (uint64_t i = 0; i < num_physical; i++)
+  {
+    in_use += map_refs[i] > 0;
+  }
+  fprintf(stderr, "snapshots: %d live, %lu taken, %lu blocks copied on write, %lu writes out of space, "
+          "%lu of %lu reserve blocks in use\n", num_snapshots, (unsigned long)snapshots_taken,
+          (unsigned long)blocks_copied, (unsigned long)copies_failed, (unsigned long)(in_use - num_logical),
+          (unsigned long)geometry.reserved_blocks);
+}
+
+int mdadm_mount(void)
+{
+
+  if (is_mounted == 1)
+  {
+    return -1;
+  }
+
+  if (snapshot_setup() != 0)
+  {
+    return -1;
+  }
+
+  uint32_t op = JBOD_MOUNT;
+  int chk_status = jbod_client_operation(op << 12, NULL);
+
+  if (chk_status == 0)
+  {
+    // The disks may have changed while unmounted
+    is_mounted = 1;
+    merkle_mark_all_dirty();
+    return 1;
+  }
+
+  snapshot_teardown();
+  return -1;
+}
+
+int mdadm_unmount(void)
+{
+
+  if (is_mounted == 0)
+  {
+    return -1;
+  }
+
+  // The map lives in memory only, so the disks must be left without one
+  if (snapshot_teardown() != 0)
+  {
+    return -1;
+  }
+
+  uint32_t op = JBOD_UNMOUNT;
+  int chk_status = jbod_client_operation(op << 12, NULL);
+
+  if (chk_status == 0)
+  {
+    is_mounted = 0;
+    return 1;
+  }
+
+  return -1;
+}
+
+int mdadm_write_permission(void)
+{
+
+  uint32_t op = JBOD_WRITE_PERMISSION;
+  int write_status = jbod_client_operation(op << 12, NULL);
+
+  if (write_status == 0)
+  {
+    is_written = 1; // Permission granted to write
+    return 0;       // Success
+  }
+
+  return -1; // Failure
+}
+
+int mdadm_revoke_write_permission(void)
+{
+
+  uint32_t op = JBOD_REVOKE_WRITE_PERMISSION;
+  int write_status = jbod_client_operation(op << 12, NULL);
+
+  if (write_status == 0)
+  {
+    is_written = 0; // Permission revoked to write
+    return 0;       // Success
+  }
+
+  return -1; // Failure
+}
+
+int mdadm_read(uint64_t addr, uint32_t len, uint8_t *buf)
+{
+  TRACE_SCOPE("mdadm", "read");
+  TRACE_ARG("addr", addr);
+  TRACE_ARG("len", len);
+
+  // Check if mounted
+  if (is_mounted == 0)
+  {
+    return -3;
+  }
+
+  // Check for valid length and buffer
+  if (len == 0 && buf == NULL)
+  {
+    return len;
+  }
+
+  if (len != 0 && buf == NULL)
+  {
+    return -4;
+  }
+
+  // Check for valid address and read length
+  if (!in_bounds(addr, len))
+  {
+    return -1;
+  }
+
+  if (len > 1024)
+  {
+    return -2;
+  }
+
+  uint32_t remaining_len = len;          // Number of bytes left to read
+  uint64_t current_addr = addr;          // Current address to read from
+  uint8_t buffer_array[JBOD_BLOCK_SIZE]; // Buffer to hold block data
+  int bytes_read = 0;                    // Track total bytes read
+
+  while (remaining_len > 0)
+  {
+    // Calculating the current disk, block, and position within block
+    uint32_t current_Disk, current_Block, current_PosInBlock;
+    locate(current_addr, &current_Disk, &current_Block, &current_PosInBlock);
+
+    // Check if cache is enabled and if the block is already in the cache
+    uint8_t cache_buf[JBOD_BLOCK_SIZE];
+    if (cache_hit(current_Disk, current_Block, cache_buf))
+    {
+      // Cache hit
+      int bytes_left_in_block = JBOD_BLOCK_SIZE - current_PosInBlock;
+      int bytes_to_copy = (remaining_len < bytes_left_in_block) ? remaining_len : bytes_left_in_block;
+      // Copy data from the cached block to the output buffer
+      memcpy(buf + bytes_read, cache_buf + current_PosInBlock, bytes_to_copy);
+
+      current_addr += bytes_to_copy;
+      remaining_len -= bytes_to_copy;
+      bytes_read += bytes_to_copy;
+      continue;
+    }
+
+    // Read block from disk to buffer and cache it, sharing the fetch with
+    // any other thread that missed on it
+    if (fetch_missed_block(current_Disk, current_Block, buffer_array) != 0)
+    {
+      return -1;
+    }
+
+    // Calculate how much data to copy from block to output buffer
+    int bytes_left_in_block = JBOD_BLOCK_SIZE - current_PosInBlock;
+    int bytes_to_copy = (remaining_len < bytes_left_in_block) ? remaining_len : bytes_left_in_block;
+
+    memcpy(buf + bytes_read, buffer_array + current_PosInBlock, bytes_to_copy);
+
+    current_addr += bytes_to_copy;
+    remaining_len -= bytes_to_copy;
+    bytes_read += bytes_to_copy;
+  }
+
+  return len;
+}
+
+int mdadm_write(uint64_t addr, uint32_t len, const uint8_t *buf)
+{
+  TRACE_SCOPE("mdadm", "write");
+  TRACE_ARG("addr", addr);
+  TRACE_ARG("len", len);
+
+  // Check if system is mounted
+  // The first two if statements are the highest priority ones
+  if (is_mounted == 0)
+  {
+    return -3;
+  }
+
+  // Check if write permission is granted
+  if (is_written == 0)
+  {
+    return -5;
+  }
+
+  // Check for valid length and buffer
+
+  if (len == 0 && buf == NULL)
+  {
+    return len;
+  }
+  if (len != 0 && buf == NULL)
+  {
+    return -4;
+  }
+
+  // Check for write length bounds
+  if (len > 1024)
+  {
+    return -2;
+  }
+
+  // Check for address bounds
+  if (!in_bounds(addr, len))
+  {
+    return -1;
+  }
+
+  uint64_t current_addr = addr;             // Current address to write to
+  uint8_t buffer_array[JBOD_BLOCK_SIZE];    // Buffer to hold block data
+  uint32_t bytes_written = 0;               // Track the number of bytes written
+
+  while (bytes_written < len)
+  {
+    // Calculate disk, block, and offset within the block
+    uint32_t current_Disk, current_Block, current_PosInBlock;
+    locate(current_addr, &current_Disk, &current_Block, &current_PosInBlock);
+
+    // Check if the block is already cached; without a cache we always have to read it first
+    if (!cache_hit(current_Disk, current_Block, buffer_array))
+    {
+
+      // Cache miss: read the current block to avoid overwriting data outside the write range
+      if (fetch_block(current_Disk, current_Block, buffer_array) != 0)
+      {
+        return -1;
+      }
+    }
+
+    int bytes_left_in_block = JBOD_BLOCK_SIZE - current_PosInBlock; // The number of bytes to write into
+    bytes_left_in_block = bytes_left_in_block > len - bytes_written ? len - bytes_written : bytes_left_in_block;
+    // Copy data from write_buf to buffer_array, starting at current_PosInBlock
+    memcpy(buffer_array + current_PosInBlock, buf + bytes_written, bytes_left_in_block);
+
+    // Write the merged block back (to every member of a mirror); a block
+    // shared with a snapshot goes to a block of its own
+    if (store_logical(current_addr >> BLOCK_SHIFT, &current_Disk, &current_Block, buffer_array) != 0)
+    {
+      return -1;
+    }
+
+    block_written(current_Disk, current_Block, buffer_array);
+
+    current_addr += bytes_left_in_block;  // Updating the addr pointer
+    bytes_written += bytes_left_in_block; // Tracking the number of bytes written
+  }
+
+  return len;
+}
+
+/* The part of one extent of a vectored batch that falls in one block */
+typedef struct {
+  uint64_t key; // sweep position of the block, see sweep_key
+  uint64_t index; // logical block
+  uint32_t disk;
+  uint32_t block;
+  uint16_t offset;
+  uint16_t len;
+  int extent;
+  uint8_t *buf;
+} vector_piece_t;
+
+static uint64_t sweep_key(uint32_t disk, uint32_t block);
+
+/* Orders pieces by block, and pieces of one block by extent */
+static int compare_pieces(const void *a, const void *b)
+{
+  const vector_piece_t *x = a, *y = b;
+  if (x->key != y->key)
+  {
+    return x->key < y->key ? -1 : 1;
+  }
+  return (x->extent > y->extent) - (x->extent < y->extent);
+}
+
+/* Checks every extent like mdadm_read (or mdadm_write, if |write|) checks
+ * its arguments, setting |status| for the bad ones, and splits the good
+ * ones into pieces sorted by block. Returns the pieces, |*num_pieces| of
+ * them, or NULL if there are none or they do not fit in memory. */
+static vector_piece_t *split_extents(const mdadm_extent_t *extents, int count, int *status, bool write,
+                                     int *num_pieces)
+{
+  // An extent of at most 1024 bytes spans at most 5 blocks
+  vector_piece_t *pieces = malloc((size_t)count * 5 * sizeof(vector_piece_t));
+  int n = 0;
+
+  for (int i = 0; i < count; i++)
+  {
+    const mdadm_extent_t *e = &extents[i];
+    status[i] = e->len;
+    if (e->len == 0 && e->buf == NULL)
+    {
+      continue;
+    }
+    if (e->len != 0 && e->buf == NULL)
+    {
+      status[i] = -4;
+      continue;
+    }
+    // mdadm_write checks the length before the address, mdadm_read after
+    if (write && e->len > 1024)
+    {
+      status[i] = -2;
+      continue;
+    }
+    if (!in_bounds(e->addr, e->len))
+    {
+      status[i] = -1;
+      continue;
+    }
+    if (e->len > 1024)
+    {
+      status[i] = -2;
+      continue;
+    }
+    if (pieces == NULL)
+    {
+      status[i] = -1;
+      continue;
+    }
+
+    for (uint32_t done = 0; done < e->len;)
+    {
+      vector_piece_t *p = &pieces[n++];
+      uint32_t offset;
+      locate(e->addr + done, &p->disk, &p->block, &offset);
+      p->index = (e->addr + done) >> BLOCK_SHIFT;
+      uint32_t len = JBOD_BLOCK_SIZE - offset < e->len - done ? JBOD_BLOCK_SIZE - offset : e->len - done;
+      p->key = sweep_key(p->disk, p->block);
+      p->offset = offset;
+      p->len = len;
+      p->extent = i;
+      p->buf = (uint8_t *)e->buf + done;
+      done += len;
+    }
+  }
+
+  qsort(pieces, n, sizeof(vector_piece_t), compare_pieces);
+  *num_pieces = n;
+  return pieces;
+}
+
+/* Marks the extents of pieces [first, last) failed */
+static void fail_pieces(const vector_piece_t *pieces, int first, int last, int *status)
+{
+  for (int i = first; i < last; i++)
+  {
+    status[pieces[i].extent] = -1;
+  }
+}
+
+/* Runs a vectored batch in two sweeps over its blocks, in disk and block
+ * order: the first fetches each block once, unless the writes cover it
+ * entirely, and serves the reads or merges the writes, in extent order; the
+ * second stores the written blocks. Sweeping twice rather than storing each
+ * block right after fetching it keeps runs of blocks sequential, without a
+ * seek back to every block before it is stored. */
+static int run_vector(const mdadm_extent_t *extents, int count, int *status, bool write)
+{
+  int num_pieces = 0;
+  vector_piece_t *pieces = split_extents(extents, count, status, write, &num_pieces);
+
+  // Index of each block's first piece, and the blocks' contents
+  int *groups = malloc((num_pieces + 1) * sizeof(int));
+  uint8_t *blocks = malloc((size_t)num_pieces * JBOD_BLOCK_SIZE);
+  bool *fetched = malloc(num_pieces * sizeof(bool));
+  if (num_pieces > 0 && (groups == NULL || blocks == NULL || fetched == NULL))
+  {
+    fail_pieces(pieces, 0, num_pieces, status);
+    num_pieces = 0;
+  }
+
+  int num_groups = 0;
+  for (int i = 0; i < num_pieces; i++)
+  {
+    if (i == 0 || pieces[i].key != pieces[i - 1].key)
+    {
+      groups[num_groups++] = i;
+    }
+  }
+  if (groups != NULL)
+  {
+    groups[num_groups] = num_pieces;
+  }
+
+  for (int g = 0; g < num_groups; g++)
+  {
+    int first = groups[g], last = groups[g + 1];
+    uint32_t disk = pieces[first].disk, blk = pieces[first].block;
+    uint8_t *block = blocks + (size_t)g * JBOD_BLOCK_SIZE;
+
+    bool covered[JBOD_BLOCK_SIZE] = {false};
+    int num_covered = 0;
+    for (int i = first; write && i < last; i++)
+    {
+      for (int j = pieces[i].offset; j < pieces[i].offset + pieces[i].len; j++)
+      {
+        num_covered += !covered[j];
+        covered[j] = true;
+      }
+    }
+
+    // Reads share the fetch with other threads and fill the cache like
+    // mdadm_read; writes fetch like mdadm_write
+    fetched[g] = true;
+    if (num_covered < JBOD_BLOCK_SIZE && !cache_hit(disk, blk, block))
+    {
+      int rc = write ? fetch_block(disk, blk, block) : fetch_missed_block(disk, blk, block);
+      if (rc != 0)
+      {
+        fetched[g] = false;
+        fail_pieces(pieces, first, last, status);
+        continue;
+      }
+    }
+
+    for (int i = first; i < last; i++)
+    {
+      if (write)
+      {
+        memcpy(block + pieces[i].offset, pieces[i].buf, pieces[i].len);
+      }
+      else
+      {
+        memcpy(pieces[i].buf, block + pieces[i].offset, pieces[i].len);
+      }
+    }
+  }
+
+  for (int g = 0; write && g < num_groups; g++)
+  {
+    int first = groups[g], last = groups[g + 1];
+    uint8_t *block = blocks + (size_t)g * JBOD_BLOCK_SIZE;
+    uint32_t disk = pieces[first].disk, blk = pieces[first].block;
+    if (!fetched[g])
+    {
+      continue;
+    }
+    if (store_logical(pieces[first].index, &disk, &blk, block) != 0)
+    {
+      fail_pieces(pieces, first, last, status);
+      continue;
+    }
+    block_written(disk, blk, block);
+  }
+
+  free(groups);
+  free(blocks);
+  free(fetched);
+  free(pieces);
+
+  for (int i = 0; i < count; i++)
+  {
+    if (status[i] < 0)
+    {
+      return -1;
+    }
+  }
+  return 1;
+}
+
+int mdadm_readv(const mdadm_extent_t *extents, int count, int *status)
+{
+  TRACE_SCOPE("mdadm", "readv");
+  TRACE_ARG("count", count);
+
+  if (is_mounted == 0)
+  {
+    return -3;
+  }
+  if (extents == NULL || status == NULL || count < 0)
+  {
+    return -1;
+  }
+  return run_vector(extents, count, status, false);
+}
+
+int mdadm_writev(const mdadm_extent_t *extents, int count, int *status)
+{
+  TRACE_SCOPE("mdadm", "writev");
+  TRACE_ARG("count", count);
+
+  if (is_mounted == 0)
+  {
+    return -3;
+  }
+  if (is_written == 0)
+  {
+    return -5;
+  }
+  if (extents == NULL || status == NULL || count < 0)
+  {
+    return -1;
+  }
+  return run_vector(extents, count, status, true);
+}
+
+// The submission queue holds up to MDADM_QUEUE_MAX_DEPTH blocks with
+// pending operations, and a job waits for at most QUEUE_AGE_FACTOR times the
+// depth of other jobs' dispatches before it goes next regardless of position
+#define QUEUE_AGE_FACTOR 8
+#define QUEUE_JOB_READS 8
+
+/* A read to copy out of a job's block once it has been fetched */
+typedef struct {
+  uint8_t *buf;
+  uint16_t offset;
+  uint16_t len;
+} queue_read_t;
+
+/* The pending operations on one block. Its reads see the block as it was
+ * before the job; its writes are merged into |data|, where |written| marks
+ * the bytes they cover, and stored in one go. */
+typedef struct {
+  uint32_t disk;
+  uint32_t block;
+  uint64_t index;  // logical block
+  uint64_t queued; // dispatches so far when the job was queued, for aging
+  int num_reads;
+  queue_read_t reads[QUEUE_JOB_READS];
+  bool has_write;
+  int num_written;
+  bool written[JBOD_BLOCK_SIZE];
+  uint8_t data[JBOD_BLOCK_SIZE];
+} queue_job_t;
+
+/* Each thread queues on its own connection */
+typedef struct {
+  int depth;
+  int num_jobs;
+  queue_job_t jobs[MDADM_QUEUE_MAX_DEPTH];
+  uint64_t dispatches;
+  bool failed;
+} queue_t;
+
+static _Thread_local queue_t *queue = NULL;
+static uint64_t queue_forwards = 0;
+static uint64_t queue_aged = 0;
+
+int mdadm_queue_set_depth(int depth)
+{
+  if (depth < 1 || depth > MDADM_QUEUE_MAX_DEPTH || (queue != NULL && queue->num_jobs > 0))
+  {
+    return -1;
+  }
+
+  if (queue == NULL && (queue = calloc(1, sizeof(queue_t))) == NULL)
+  {
+    return -1;
+  }
+  queue->depth = depth;
+  return 1;
+}
+
+/* Position of |block| of |disk| along the elevator's sweep */
+static uint64_t sweep_key(uint32_t disk, uint32_t block)
+{
+  return (uint64_t)disk * geometry.blocks_per_disk + block;
+}
+
+/* Carries out |j|: fetches the block if a read or a partial write needs its
+ * old contents, serves the reads and stores the merged writes. Returns 0 on
+ * success and -1 on failure. */
+static int run_job(queue_job_t *j)
+{
+  uint8_t block[JBOD_BLOCK_SIZE];
+
+  if (j->num_reads > 0 || j->num_written < JBOD_BLOCK_SIZE)
+  {
+    // A block that is only read is cached like mdadm_read caches it, one
+    // that is written like mdadm_write
+    if (!cache_hit(j->disk, j->block, block))
+    {
+      int rc = j->has_write ? fetch_block(j->disk, j->block, block) : fetch_missed_block(j->disk, j->block, block);
+      if (rc != 0)
+      {
+        return -1;
+      }
+    }
+  }
+
+  for (int i = 0; i < j->num_reads; i++)
+  {
+    memcpy(j->reads[i].buf, block + j->reads[i].offset, j->reads[i].len);
+  }
+
+  if (!j->has_write)
+  {
+    return 0;
+  }
+  for (int i = 0; i < JBOD_BLOCK_SIZE; i++)
+  {
+    if (j->written[i])
+    {
+      block[i] = j->data[i];
+    }
+  }
+  uint32_t disk = j->disk, blk = j->block;
+  if (store_logical(j->index, &disk, &blk, block) != 0)
+  {
+    return -1;
+  }
+  block_written(disk, blk, block);
+  return 0;
+}
+
+/* Runs job |i| and takes it off the queue */
+static void dispatch_job(queue_t *q, int i)
+{
+  if (run_job(&q->jobs[i]) != 0)
+  {
+    q->failed = true;
+  }
+  q->dispatches++;
+  q->jobs[i] = q->jobs[--q->num_jobs];
+}
+
+/* Index of the job to run next (C-LOOK): the first at or after the
+ * connection's position in (disk, block) order, wrapping around to the
+ * lowest, unless a job has waited too long, in which case the oldest */
+static int next_job(queue_t *q)
+{
+  uint64_t head = pos_ops == jbod_client_ops() ? sweep_key(pos_disk, pos_block) : 0;
+  int ahead = -1, lowest = -1, oldest = 0;
+
+  for (int i = 0; i < q->num_jobs; i++)
+  {
+    uint64_t key = sweep_key(q->jobs[i].disk, q->jobs[i].block);
+    if (key >= head && (ahead == -1 || key < sweep_key(q->jobs[ahead].disk, q->jobs[ahead].block)))
+    {
+      ahead = i;
+    }
+    if (lowest == -1 || key < sweep_key(q->jobs[lowest].disk, q->jobs[lowest].block))
+    {
+      lowest = i;
+    }
+    if (q->jobs[i].queued < q->jobs[oldest].queued)
+    {
+      oldest = i;
+    }
+  }
+
+  if (q->dispatches - q->jobs[oldest].queued >= (uint64_t)QUEUE_AGE_FACTOR * q->depth)
+  {
+    __atomic_fetch_add(&queue_aged, 1, __ATOMIC_RELAXED);
+    return oldest;
+  }
+  return ahead != -1 ? ahead : lowest;
+}
+
+/* Returns the job for |block| of |disk|, where logical block |index| is,
+ * making one, and room for it, if there is none. Returns NULL if the queue
+ * is off. */
+static queue_job_t *queue_job(uint64_t index, uint32_t disk, uint32_t block)
+{
+  queue_t *q = queue;
+  if (q == NULL)
+  {
+    return NULL;
+  }
+
+  for (int i = 0; i < q->num_jobs; i++)
+  {
+    if (q->jobs[i].disk == disk && q->jobs[i].block == block)
+    {
+      return &q->jobs[i];
+    }
+  }
+
+  if (q->num_jobs == q->depth)
+  {
+    dispatch_job(q, next_job(q));
+  }
+
+  queue_job_t *j = &q->jobs[q->num_jobs++];
+  j->disk = disk;
+  j->block = block;
+  j->index = index;
+  j->queued = q->dispatches;
+  j->num_reads = 0;
+  j->has_write = false;
+  j->num_written = 0;
+  memset(j->written, 0, sizeof(j->written));
+  return j;
+}
+
+/* Runs the job for |block| of |disk| now, if there is one */
+static void queue_drain_block(uint32_t disk, uint32_t block)
+{
+  for (int i = 0; i < queue->num_jobs; i++)
+  {
+    if (queue->jobs[i].disk == disk && queue->jobs[i].block == block)
+    {
+      dispatch_job(queue, i);
+      return;
+    }
+  }
+}
+
+/* Queues a read of |len| bytes at |offset| of a block into |buf|. A read
+ * that follows a write to the same block must see it: when the pending
+ * writes cover the whole read it is served from them right away, and
+ * otherwise the block's job runs first. */
+static void queue_read_piece(uint64_t index, uint32_t disk, uint32_t block, uint32_t offset, uint32_t len,
+                             uint8_t *buf)
+{
+  queue_job_t *j = queue_job(index, disk, block);
+
+  if (j->has_write)
+  {
+    bool covered = true;
+    for (uint32_t i = offset; i < offset + len && covered; i++)
+    {
+      covered = j->written[i];
+    }
+    if (covered)
+    {
+      memcpy(buf, j->data + offset, len);
+      __atomic_fetch_add(&queue_forwards, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  if (j->has_write || j->num_reads == QUEUE_JOB_READS)
+  {
+    queue_drain_block(disk, block);
+    locate((index << BLOCK_SHIFT) + offset, &disk, &block, &offset);
+    j = queue_job(index, disk, block);
+  }
+
+  j->reads[j->num_reads++] = (queue_read_t){buf, offset, len};
+}
+
+/* Queues a write; later writes to the same bytes win, and reads already
+ * queued on the block still see what was there before */
+static void queue_write_piece(uint64_t index, uint32_t disk, uint32_t block, uint32_t offset, uint32_t len,
+                              const uint8_t *buf)
+{
+  queue_job_t *j = queue_job(index, disk, block);
+
+  j->has_write = true;
+  memcpy(j->data + offset, buf, len);
+  for (uint32_t i = offset; i < offset + len; i++)
+  {
+    j->num_written += !j->written[i];
+    j->written[i] = true;
+  }
+}
+
+int mdadm_queue_read(uint64_t addr, uint32_t len, uint8_t *buf)
+{
+  if (is_mounted == 0)
+  {
+    return -3;
+  }
+  if (len == 0 && buf == NULL)
+  {
+    return len;
+  }
+  if (len != 0 && buf == NULL)
+  {
+    return -4;
+  }
+  if (!in_bounds(addr, len))
+  {
+    return -1;
+  }
+  if (len > 1024)
+  {
+    return -2;
+  }
+  if (queue == NULL)
+  {
+    return mdadm_read(addr, len, buf);
+  }
+
+  for (uint32_t done = 0; done < len;)
+  {
+    uint32_t disk, block, offset;
+    locate(addr + done, &disk, &block, &offset);
+    uint32_t n = JBOD_BLOCK_SIZE - offset < len - done ? JBOD_BLOCK_SIZE - offset : len - done;
+    queue_read_piece((addr + done) >> BLOCK_SHIFT, disk, block, offset, n, buf + done);
+    done += n;
+  }
+  return len;
+}
+
+int mdadm_queue_write(uint64_t addr, uint32_t len, const uint8_t *buf)
+{
+  if (is_mounted == 0)
+  {
+    return -3;
+  }
+  if (is_written == 0)
+  {
+    return -5;
+  }
+  if (len == 0 && buf == NULL)
+  {
+    return len;
+  }
+  if (len != 0 && buf == NULL)
+  {
+    return -4;
+  }
+  if (len > 1024)
+  {
+    return -2;
+  }
+  if (!in_bounds(addr, len))
+  {
+    return -1;
+  }
+  if (queue == NULL)
+  {
+    return mdadm_write(addr, len, buf);
+  }
+
+  // Making room for a block may run queued reads, which could land in |buf|
+  uint8_t data[1024];
+  memcpy(data, buf, len);
 
-  if (chk_status == 0)
+  for (uint32_t done = 0; done < len;)
+  {
+    uint32_t disk, block, offset;
+    locate(addr + done, &disk, &block, &offset);
+    uint32_t n = JBOD_BLOCK_SIZE - offset < len - done ? JBOD_BLOCK_SIZE - offset : len - done;
+    queue_write_piece((addr + done) >> BLOCK_SHIFT, disk, block, offset, n, data + done);
+    done += n;
+  }
+  return len;
+}
+
+int mdadm_queue_flush(void)
+{
+  if (queue == NULL)
   {
-    is_mounted = 1;
     return 1;
   }
 
-  return -1;
+  while (queue->num_jobs > 0)
+  {
+    dispatch_job(queue, next_job(queue));
+  }
+
+  bool failed = queue->failed;
+  queue->failed = false;
+  return failed ? -1 : 1;
 }
 
-int mdadm_unmount(void)
+void mdadm_print_seek_stats(void)
 {
+  fprintf(stderr, "block ops: %lu, seeks: %lu (%.2f per op)\n", (unsigned long)block_ops, (unsigned long)seek_ops,
+          block_ops ? (double)seek_ops / block_ops : 0.0);
+  if (queue != NULL)
+  {
+    fprintf(stderr, "queue: reads served from pending writes: %lu, jobs run for age: %lu\n",
+            (unsigned long)queue_forwards, (unsigned long)queue_aged);
+  }
+}
 
-  if (is_mounted == 0)
+// Dump and restore keep up to STREAM_WINDOW commands in flight on the
+// connection, staging data in a pool of that many blocks, and move data to
+// and from the file descriptor STREAM_CHUNK blocks at a time
+#define STREAM_WINDOW 64
+#define STREAM_CHUNK 256
+#define STREAM_RECORD_LEN 14
+
+typedef struct stream stream_t;
+
+/* Commands in flight, oldest first, each with its pool buffer: the block to
+ * write, or the block read once its reply is in. Replies are handed to
+ * |on_reply| in order as room is needed for new commands. */
+struct stream {
+  uint32_t op[STREAM_WINDOW];
+  uint32_t disk[STREAM_WINDOW];
+  uint32_t block[STREAM_WINDOW];
+  uint8_t data[STREAM_WINDOW][JBOD_BLOCK_SIZE];
+  uint64_t sent;
+  uint64_t done;
+  bool failed;
+  void (*on_reply)(stream_t *s, int slot, void *ctx);
+  void *ctx;
+};
+
+/* Receives the reply to the oldest command in flight */
+static void stream_recv(stream_t *s)
+{
+  int slot = s->done % STREAM_WINDOW;
+  if (jbod_client_recv(s->op[slot], s->data[slot]) != 0)
   {
-    return -1;
+    s->failed = true;
   }
+  else if (s->on_reply != NULL)
+  {
+    s->on_reply(s, slot, s->ctx);
+  }
+  s->done++;
+}
 
-  uint32_t op = JBOD_UNMOUNT;
-  int chk_status = jbod_client_operation(op << 12, NULL);
+/* Sends |cmd| for |block| of |disk|, with |payload| if it writes, first
+ * waiting for the oldest reply if the window is full. Returns false if the
+ * connection failed. */
+static bool stream_send(stream_t *s, int cmd, uint32_t disk, uint32_t block, const uint8_t *payload)
+{
+  if (s->sent - s->done == STREAM_WINDOW)
+  {
+    stream_recv(s);
+  }
 
-  if (chk_status == 0)
+  int slot = s->sent % STREAM_WINDOW;
+  if (cmd == JBOD_SEEK_TO_DISK)
   {
-    is_mounted = 0;
-    return 1;
+    s->op[slot] = jbod_encode_op(cmd, disk, 0);
+  }
+  else if (cmd == JBOD_SEEK_TO_BLOCK)
+  {
+    s->op[slot] = jbod_encode_op(cmd, 0, block);
+  }
+  else if (cmd == JBOD_SIGN_BLOCK)
+  {
+    s->op[slot] = jbod_encode_op(cmd, disk, block);
+  }
+  else
+  {
+    s->op[slot] = jbod_encode_op(cmd, 0, 0);
+  }
+  s->disk[slot] = disk;
+  s->block[slot] = block;
+  if (payload != NULL)
+  {
+    memcpy(s->data[slot], payload, JBOD_BLOCK_SIZE);
   }
 
-  return -1;
+  if (!jbod_client_send(s->op[slot], s->data[slot]))
+  {
+    s->failed = true;
+    return false;
+  }
+  s->sent++;
+  return true;
 }
 
-int mdadm_write_permission(void)
+/* Waits for every reply. Returns true if every command succeeded. */
+static bool stream_finish(stream_t *s)
 {
+  while (s->done < s->sent)
+  {
+    jbod_client_quickack();
+    stream_recv(s);
+  }
+  return !s->failed;
+}
 
-  uint32_t op = JBOD_WRITE_PERMISSION;
-  int write_status = jbod_client_operation(op << 12, NULL);
+/* Output of a dump: records are built in |out| and written in batches;
+ * consecutive data blocks of a disk are gathered into one record */
+typedef struct {
+  int fd;
+  int flags;
+  bool failed;
+  uint32_t run_disk;
+  uint32_t run_block;
+  uint32_t run_count;
+  uint8_t run[STREAM_CHUNK][JBOD_BLOCK_SIZE];
+  uint8_t out[STREAM_CHUNK * JBOD_BLOCK_SIZE];
+  size_t out_len;
+} dump_writer_t;
 
-  if (write_status == 0)
+static bool write_fully(int fd, const uint8_t *buf, size_t len)
+{
+  while (len > 0)
   {
-    is_written = 1; // Permission granted to write
-    return 0;       // Success
+    ssize_t n = write(fd, buf, len);
+    if (n <= 0)
+    {
+      return false;
+    }
+    buf += n;
+    len -= n;
   }
+  return true;
+}
 
-  return -1; // Failure
+static bool read_fully(int fd, uint8_t *buf, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = read(fd, buf, len);
+    if (n <= 0)
+    {
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+  return true;
 }
 
-int mdadm_revoke_write_permission(void)
+static void dump_emit(dump_writer_t *w, const void *data, size_t len)
 {
+  if (w->out_len + len > sizeof(w->out))
+  {
+    w->failed |= !write_fully(w->fd, w->out, w->out_len);
+    w->out_len = 0;
+  }
+  if (len > sizeof(w->out))
+  {
+    w->failed |= !write_fully(w->fd, data, len);
+    return;
+  }
+  memcpy(w->out + w->out_len, data, len);
+  w->out_len += len;
+}
 
-  uint32_t op = JBOD_REVOKE_WRITE_PERMISSION;
-  int write_status = jbod_client_operation(op << 12, NULL);
+static void dump_record(dump_writer_t *w, uint32_t disk, uint32_t block, uint32_t count, uint8_t type, uint8_t fill)
+{
+  uint8_t record[STREAM_RECORD_LEN];
+  memcpy(record, &disk, 4);
+  memcpy(record + 4, &block, 4);
+  memcpy(record + 8, &count, 4);
+  record[12] = type;
+  record[13] = fill;
+  dump_emit(w, record, sizeof(record));
+}
 
-  if (write_status == 0)
+/* Writes out the data blocks gathered so far as one record */
+static void dump_flush_run(dump_writer_t *w)
+{
+  if (w->run_count > 0)
   {
-    is_written = 0; // Permission revoked to write
-    return 0;       // Success
+    dump_record(w, w->run_disk, w->run_block, w->run_count, MDADM_DUMP_DATA, 0);
+    dump_emit(w, w->run, (size_t)w->run_count * JBOD_BLOCK_SIZE);
+    w->run_count = 0;
   }
-
-  return -1; // Failure
 }
 
-int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf)
+/* Returns true if every byte of |block| is the same */
+static bool constant_block(const uint8_t *block)
 {
+  return memcmp(block, block + 1, JBOD_BLOCK_SIZE - 1) == 0;
+}
 
-  // Check if mounted
-  if (is_mounted == 0)
+static void dump_block(stream_t *s, int slot, void *ctx)
+{
+  dump_writer_t *w = (dump_writer_t *)ctx;
+  if (s->op[slot] != jbod_encode_op(JBOD_READ_BLOCK, 0, 0))
   {
-    return -3;
+    return;
   }
 
-  // Check for valid length and buffer
-  if (len == 0 && buf == NULL)
+  uint32_t disk = s->disk[slot], block = s->block[slot];
+  const uint8_t *data = s->data[slot];
+  if ((w->flags & MDADM_STREAM_SKIP_CONSTANT) && constant_block(data))
   {
-    return len;
+    dump_flush_run(w);
+    dump_record(w, disk, block, 1, MDADM_DUMP_FILL, data[0]);
+    return;
   }
 
-  if (len != 0 && buf == NULL)
+  if (w->run_count == STREAM_CHUNK || (w->run_count > 0 && (w->run_disk != disk || w->run_block + w->run_count != block)))
   {
-    return -4;
+    dump_flush_run(w);
+  }
+  if (w->run_count == 0)
+  {
+    w->run_disk = disk;
+    w->run_block = block;
   }
+  memcpy(w->run[w->run_count++], data, JBOD_BLOCK_SIZE);
+}
 
-  // Check for valid address and read length
-  if ((addr + len) > (JBOD_NUM_DISKS * JBOD_DISK_SIZE))
+int mdadm_dump(int fd, int flags)
+{
+  TRACE_SCOPE("mdadm", "dump");
+
+  if (is_mounted == 0)
   {
     return -1;
   }
 
-  if (len > 1024)
+  stream_t *s = calloc(1, sizeof(stream_t));
+  dump_writer_t *w = calloc(1, sizeof(dump_writer_t));
+  if (s == NULL || w == NULL)
   {
-    return -2;
+    free(s);
+    free(w);
+    return -1;
   }
+  w->fd = fd;
+  w->flags = flags;
+  s->on_reply = dump_block;
+  s->ctx = w;
 
-  uint32_t remaining_len = len;          // Number of bytes left to read
-  uint32_t current_addr = addr;          // Current address to read from
-  uint8_t buffer_array[JBOD_BLOCK_SIZE]; // Buffer to hold block data
-  int bytes_read = 0;                    // Track total bytes read
+  uint32_t version = MDADM_DUMP_VERSION;
+  dump_emit(w, MDADM_DUMP_MAGIC, 8);
+  dump_emit(w, &version, 4);
+  dump_emit(w, &geometry.num_disks, 4);
+  dump_emit(w, &geometry.blocks_per_disk, 4);
 
-  while (remaining_len > 0)
+  // Every read leaves the disk on the next block, so a disk is one seek
+  // pair and then nothing but reads
+  for (uint32_t d = 0; d < geometry.num_disks && !s->failed && !w->failed; d++)
   {
-    // Calculating the current disk, block, and position within block
-    int current_Disk = current_addr / JBOD_DISK_SIZE;
-    int current_Block = (current_addr / JBOD_BLOCK_SIZE) % JBOD_NUM_BLOCKS_PER_DISK;
-    int current_PosInBlock = current_addr % JBOD_BLOCK_SIZE;
-
-    // Check if cache is enabled and if the block is already in the cache
-    uint8_t cache_buf[JBOD_BLOCK_SIZE];
-    if (cache_enabled() && cache_lookup(current_Disk, current_Block, cache_buf) == 1)
+    stream_send(s, JBOD_SEEK_TO_DISK, d, 0, NULL);
+    stream_send(s, JBOD_SEEK_TO_BLOCK, d, 0, NULL);
+    for (uint32_t b = 0; b < geometry.blocks_per_disk && !s->failed; b++)
     {
-      // Cache hit
-      int bytes_left_in_block = JBOD_BLOCK_SIZE - current_PosInBlock;
-      int bytes_to_copy = (remaining_len < bytes_left_in_block) ? remaining_len : bytes_left_in_block;
-      // Copy data from the cached block to the output buffer
-      memcpy(buf + bytes_read, buffer_array + current_PosInBlock, bytes_to_copy);
-
-      current_addr += bytes_to_copy;
-      remaining_len -= bytes_to_copy;
-      bytes_read += bytes_to_copy;
-      continue;
+      stream_send(s, JBOD_READ_BLOCK, d, b, NULL);
     }
+    head_pos[d] = geometry.blocks_per_disk;
+  }
+  bool ok = stream_finish(s);
 
-    // Seek to the correct disk
-    uint32_t op_seek_disk = (JBOD_SEEK_TO_DISK << 12) | (current_Disk);
-    if (jbod_client_operation(op_seek_disk, NULL) != 0)
+  dump_flush_run(w);
+  dump_record(w, 0, 0, 0, MDADM_DUMP_END, 0);
+  dump_emit(w, NULL, 0);
+  w->failed |= !write_fully(fd, w->out, w->out_len);
+  ok = ok && !w->failed;
+
+  free(s);
+  free(w);
+  return ok ? 1 : -1;
+}
+
+/* A chunk of consecutive blocks of one disk from a dump, and which of them
+ * differ from what the array holds */
+typedef struct {
+  uint32_t disk;
+  uint32_t first;
+  uint32_t count;
+  uint8_t blocks[STREAM_CHUNK][JBOD_BLOCK_SIZE];
+  bool changed[STREAM_CHUNK];
+} restore_chunk_t;
+
+static void compare_block(stream_t *s, int slot, void *ctx)
+{
+  restore_chunk_t *c = (restore_chunk_t *)ctx;
+  if (s->op[slot] == jbod_encode_op(JBOD_READ_BLOCK, 0, 0))
+  {
+    uint32_t i = s->block[slot] - c->first;
+    c->changed[i] = memcmp(c->blocks[i], s->data[slot], JBOD_BLOCK_SIZE) != 0;
+  }
+}
+
+/* Writes the blocks of |c| to the array, or with MDADM_STREAM_SKIP_UNCHANGED
+ * only those that differ from it. Returns true on success. */
+static bool restore_chunk(stream_t *s, restore_chunk_t *c, int flags)
+{
+  for (uint32_t i = 0; i < c->count; i++)
+  {
+    c->changed[i] = true;
+  }
+
+  if (flags & MDADM_STREAM_SKIP_UNCHANGED)
+  {
+    s->on_reply = compare_block;
+    s->ctx = c;
+    stream_send(s, JBOD_SEEK_TO_DISK, c->disk, 0, NULL);
+    stream_send(s, JBOD_SEEK_TO_BLOCK, c->disk, c->first, NULL);
+    for (uint32_t i = 0; i < c->count && !s->failed; i++)
     {
-      return -1;
+      stream_send(s, JBOD_READ_BLOCK, c->disk, c->first + i, NULL);
     }
-
-    // Seek to the correct block
-    uint32_t op_seek_block = (JBOD_SEEK_TO_BLOCK << 12) | (current_Block << 4);
-    if (jbod_client_operation(op_seek_block, NULL) != 0)
+    if (!stream_finish(s))
     {
-      return -1;
+      return false;
     }
+  }
 
-    // Read block from disk to buffer
-    if (jbod_client_operation(JBOD_READ_BLOCK << 12, buffer_array) != 0)
+  // Writes also leave the disk on the next block: unchanged blocks cost a
+  // seek past them, and nothing else
+  s->on_reply = NULL;
+  stream_send(s, JBOD_SEEK_TO_DISK, c->disk, 0, NULL);
+  uint32_t pos = UINT32_MAX;
+  for (uint32_t i = 0; i < c->count && !s->failed; i++)
+  {
+    if (!c->changed[i])
     {
-      return -1;
+      continue;
     }
-
-    // Insert block into cache
-    if (cache_enabled())
+    uint32_t block = c->first + i;
+    if (pos != block)
     {
-      cache_insert(current_Disk, current_Block, buffer_array);
+      stream_send(s, JBOD_SEEK_TO_BLOCK, c->disk, block, NULL);
     }
-
-    // Calculate how much data to copy from block to output buffer
-    int bytes_left_in_block = JBOD_BLOCK_SIZE - current_PosInBlock;
-    int bytes_to_copy = (remaining_len < bytes_left_in_block) ? remaining_len : bytes_left_in_block;
-
-    memcpy(buf + bytes_read, buffer_array + current_PosInBlock, bytes_to_copy);
-
-    current_addr += bytes_to_copy;
-    remaining_len -= bytes_to_copy;
-    bytes_read += bytes_to_copy;
+    stream_send(s, JBOD_WRITE_BLOCK, c->disk, block, c->blocks[i]);
+    pos = block + 1;
   }
-
-  return len;
-}
-
-int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf)
-{
-
-  // Check if system is mounted
-  // The first two if statements are the highest priority ones
-  if (is_mounted == 0)
+  if (pos != UINT32_MAX)
   {
-    return -3;
+    head_pos[c->disk] = pos;
   }
-
-  // Check if write permission is granted
-  if (is_written == 0)
+  if (!stream_finish(s))
   {
-    return -5;
+    return false;
   }
 
-  // Check for valid length and buffer
-
-  if (len == 0 && buf == NULL)
+  // The chunk may be a mirror's second member, whose blocks are cached and
+  // hashed under the pair's primary
+  uint32_t disk = c->disk;
+  if (geometry.layout == MDADM_LAYOUT_MIRRORED)
   {
-    return len;
+    disk -= disk % 2;
   }
-  if (len != 0 && buf == NULL)
+  for (uint32_t i = 0; i < c->count; i++)
   {
-    return -4;
+    if (c->changed[i])
+    {
+      block_written(disk, c->first + i, c->blocks[i]);
+    }
   }
+  return true;
+}
 
-  // Check for write length bounds
-  if (len > 1024)
+int mdadm_restore(int fd, int flags)
+{
+  TRACE_SCOPE("mdadm", "restore");
+
+  // A dump holds the disks as they are, which only match the array's
+  // blocks while none is remapped
+  if (is_mounted == 0 || is_written == 0 || num_remapped > 0 || num_snapshots > 0)
   {
-    return -2;
+    return -1;
   }
 
-  // Check for address bounds
-  if ((addr + len) > (JBOD_NUM_DISKS * JBOD_DISK_SIZE))
+  uint8_t header[20];
+  uint32_t version, num_disks, blocks_per_disk;
+  if (!read_fully(fd, header, sizeof(header)) || memcmp(header, MDADM_DUMP_MAGIC, 8) != 0)
+  {
+    return -1;
+  }
+  memcpy(&version, header + 8, 4);
+  memcpy(&num_disks, header + 12, 4);
+  memcpy(&blocks_per_disk, header + 16, 4);
+  if (version != MDADM_DUMP_VERSION || num_disks != geometry.num_disks || blocks_per_disk != geometry.blocks_per_disk)
   {
     return -1;
   }
 
-  uint32_t current_addr = addr; // Current address to write to
-  uint8_t buffer_array[256];    // Buffer to hold block data
-  int bytes_written = 0;        // Track the number of bytes written
+  stream_t *s = calloc(1, sizeof(stream_t));
+  restore_chunk_t *c = calloc(1, sizeof(restore_chunk_t));
+  bool ok = s != NULL && c != NULL;
 
-  while (bytes_written < len)
+  // Records are cut into chunks of consecutive blocks of one disk
+  while (ok)
   {
-    // Calculate disk, block, and offset within the block
-    int current_Disk = current_addr / JBOD_DISK_SIZE;
-    int current_Block = (current_addr / JBOD_BLOCK_SIZE) % JBOD_NUM_BLOCKS_PER_DISK;
-    int current_PosInBlock = (current_addr % JBOD_DISK_SIZE) % JBOD_BLOCK_SIZE;
+    uint8_t record[STREAM_RECORD_LEN];
+    uint32_t disk, block, count;
+    if (!read_fully(fd, record, sizeof(record)))
+    {
+      ok = false;
+      break;
+    }
+    memcpy(&disk, record, 4);
+    memcpy(&block, record + 4, 4);
+    memcpy(&count, record + 8, 4);
+    uint8_t type = record[12];
 
-    // Check if the block is already cached
-    if (cache_enabled() && cache_lookup(current_Disk, current_Block, buffer_array) != 1)
+    if (type == MDADM_DUMP_END)
+    {
+      break;
+    }
+    if ((type != MDADM_DUMP_DATA && type != MDADM_DUMP_FILL) || disk >= geometry.num_disks ||
+        block >= geometry.blocks_per_disk || count > geometry.blocks_per_disk - block)
     {
+      ok = false;
+      break;
+    }
 
-      // Cache miss: seek to the correct disk
-      uint32_t op_seek_disk = (JBOD_SEEK_TO_DISK << 12) | current_Disk;
-      if (jbod_client_operation(op_seek_disk, NULL) != 0)
+    for (uint32_t i = 0; i < count && ok; i++, block++)
+    {
+      if (c->count == STREAM_CHUNK || (c->count > 0 && (c->disk != disk || c->first + c->count != block)))
       {
-        return -1;
+        ok = restore_chunk(s, c, flags);
+        c->count = 0;
       }
-
-      // Seek to the correct block
-      uint32_t op_seek_block = (JBOD_SEEK_TO_BLOCK << 12) | (current_Block << 4);
-      if (jbod_client_operation(op_seek_block, NULL) != 0)
+      if (c->count == 0)
       {
-        return -1;
+        c->disk = disk;
+        c->first = block;
       }
-
-      // Read the current block to avoid overwriting data outside the write range
-      if (jbod_client_operation(JBOD_READ_BLOCK << 12, buffer_array) != 0)
+      uint8_t *dst = c->blocks[c->count++];
+      if (type == MDADM_DUMP_FILL)
       {
-        return -1;
+        memset(dst, record[13], JBOD_BLOCK_SIZE);
+      }
+      else if (!read_fully(fd, dst, JBOD_BLOCK_SIZE))
+      {
+        ok = false;
       }
     }
+  }
+  if (ok && c->count > 0)
+  {
+    ok = restore_chunk(s, c, flags);
+  }
 
-    int bytes_left_in_block = JBOD_BLOCK_SIZE - current_PosInBlock; // The number of bytes to write into
-    bytes_left_in_block = bytes_left_in_block > len - bytes_written ? len - bytes_written : bytes_left_in_block;
-    // Copy data from write_buf to buffer_array, starting at current_PosInBlock
-    memcpy(buffer_array + current_PosInBlock, buf + bytes_written, bytes_left_in_block);
+  free(s);
+  free(c);
+  return ok ? 1 : -1;
+}
 
-    // We need to seek to disk and block once again in order to adjust the pointer to where we need to start writing from again.
-    uint32_t op_seek_disk = (JBOD_SEEK_TO_DISK << 12) | current_Disk;
-    if (jbod_client_operation(op_seek_disk, NULL) != 0)
-    {
-      return -1;
-    }
+// The signature the server last gave mdadm_verify for each block, as text
+// The text fills at most the whole payload, so there is always room for it
+#define SIGNATURE_LEN (JBOD_BLOCK_SIZE + 1)
+static char (*signatures)[SIGNATURE_LEN] = NULL;
 
-    // Seek to the correct block
-    uint32_t op_seek_block = (JBOD_SEEK_TO_BLOCK << 12) | (current_Block << 4);
-    if (jbod_client_operation(op_seek_block, NULL) != 0)
-    {
-      return -1;
-    }
+/* Stores the signature of the block just signed and sets its leaf. Only
+ * the text counts: the reference server leaves junk after it. */
+static void signed_block(stream_t *s, int slot, void *ctx)
+{
+  uint32_t leaf = s->disk[slot] * geometry.blocks_per_disk + s->block[slot];
+  size_t len = strnlen((char *)s->data[slot], JBOD_BLOCK_SIZE);
+  merkle_set_leaf(leaf, s->data[slot], len);
+  memcpy(signatures[leaf], s->data[slot], len);
+  signatures[leaf][len] = '\0';
+}
+
+int mdadm_verify(uint8_t root[MERKLE_DIGEST_LEN])
+{
+  TRACE_SCOPE("mdadm", "verify");
+
+  if (is_mounted == 0)
+  {
+    return -1;
+  }
 
-    if (jbod_client_operation(JBOD_WRITE_BLOCK << 12, buffer_array) != 0)
+  // A new geometry starts a new tree, with every block to sign
+  uint32_t num_blocks = geometry.num_disks * geometry.blocks_per_disk;
+  if (merkle_size() != num_blocks)
+  {
+    free(signatures);
+    signatures = calloc(num_blocks, SIGNATURE_LEN);
+    if (signatures == NULL || merkle_create(num_blocks) != 1)
     {
+      free(signatures);
+      signatures = NULL;
+      merkle_destroy();
       return -1;
     }
+  }
 
-    if (cache_enabled())
+  stream_t *s = calloc(1, sizeof(stream_t));
+  if (s == NULL)
+  {
+    return -1;
+  }
+  s->on_reply = signed_block;
+
+  uint32_t leaves[STREAM_CHUNK];
+  int n, num_signed = 0;
+  while (!s->failed && (n = merkle_take_dirty(leaves, STREAM_CHUNK)) > 0)
+  {
+    for (int i = 0; i < n; i++)
     {
-      cache_update(current_Disk, current_Block, buffer_array);
+      if (!stream_send(s, JBOD_SIGN_BLOCK, leaves[i] / geometry.blocks_per_disk,
+                       leaves[i] % geometry.blocks_per_disk, NULL))
+      {
+        break;
+      }
     }
+    num_signed += n;
+  }
 
-    current_addr += bytes_left_in_block;  // Updating the addr pointer
-    bytes_written += bytes_left_in_block; // Tracking the number of bytes written
+  // Which blocks went unsigned is not tracked, so a failure signs them all
+  // again next time
+  bool ok = stream_finish(s);
+  free(s);
+  if (!ok)
+  {
+    merkle_mark_all_dirty();
+    return -1;
   }
 
-  return len;
+  merkle_root(root);
+  return num_signed;
+}
+
+const char *mdadm_block_signature(uint32_t disk, uint32_t block)
+{
+  if (signatures == NULL || disk >= geometry.num_disks || block >= geometry.blocks_per_disk)
+  {
+    return NULL;
+  }
+  return signatures[disk * geometry.blocks_per_disk + block];
 }
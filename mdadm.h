@@ -4,6 +4,63 @@
 #include <stdint.h>
 #include "jbod.h"
 #include "cache.h"
+#include "merkle.h"
+
+/* How logical blocks are laid out over the disks.
+ * LINEAR:  logical block b is block b % blocks_per_disk of disk
+ *          b / blocks_per_disk, so each disk holds one contiguous range.
+ * STRIPED: the array is cut into stripe units of stripe_blocks blocks and
+ *          unit u goes to disk u % num_disks, at block
+ *          (u / num_disks) * stripe_blocks of that disk (RAID-0).
+ * MIRRORED: disks 2k and 2k+1 form a mirror holding the same data, and the
+ *          mirrors are laid out linearly, halving the capacity (RAID-1). */
+typedef enum {
+  MDADM_LAYOUT_LINEAR,
+  MDADM_LAYOUT_STRIPED,
+  MDADM_LAYOUT_MIRRORED,
+} mdadm_layout_t;
+
+/* Geometry of the mounted array. The block size is the protocol's fixed
+ * payload size, JBOD_BLOCK_SIZE; the number of disks and blocks per disk are
+ * chosen at runtime. When |blocks_per_disk| is a power of two, addresses are
+ * decoded with shifts and masks only. */
+typedef struct {
+  uint32_t num_disks;
+  uint32_t blocks_per_disk;
+  uint64_t disk_size;      // bytes per disk
+  uint64_t capacity;       // bytes in the whole array
+  int blocks_shift;        // log2(blocks_per_disk), or -1 if not a power of two
+  uint32_t blocks_mask;    // blocks_per_disk - 1 when blocks_shift != -1
+  mdadm_layout_t layout;
+  uint32_t stripe_blocks;  // blocks per stripe unit, STRIPED only
+  int stripe_shift;        // log2(stripe_blocks), or -1 if not a power of two
+  int disks_shift;         // log2(num_disks), or -1 if not a power of two
+  uint32_t reserved_blocks; // held back for snapshots, not in the capacity
+} mdadm_geometry_t;
+
+/* Sets the geometry used by the next mount. Defaults to JBOD_NUM_DISKS disks
+ * of JBOD_NUM_BLOCKS_PER_DISK blocks. Returns 1 on success and -1 on failure
+ * (mounted, or outside what the opcode format can address). */
+int mdadm_set_geometry(uint32_t num_disks, uint32_t blocks_per_disk);
+
+/* Sets the layout used by the next mount; |stripe_blocks| is the stripe unit
+ * in blocks for MDADM_LAYOUT_STRIPED and must divide blocks_per_disk. The
+ * mirrored layout needs an even number of disks.
+ * Returns 1 on success and -1 on failure. */
+int mdadm_set_layout(mdadm_layout_t layout, uint32_t stripe_blocks);
+
+/* Holds |blocks| blocks at the top of the array back from the next mount,
+ * for the copies snapshots need (see mdadm_snapshot_create); the capacity
+ * shrinks by as much. 0, the default, turns snapshots off.
+ * Returns 1 on success and -1 on failure (mounted, or no blocks left). */
+int mdadm_set_snapshot_reserve(uint32_t blocks);
+
+/* Returns the current geometry. */
+const mdadm_geometry_t *mdadm_get_geometry(void);
+
+/* Maps the array address |addr| to a disk, the block within that disk and the
+ * offset within that block according to the current layout. */
+void mdadm_map(uint64_t addr, uint32_t *disk, uint32_t *block, uint32_t *offset);
 
 /* Return 1 on success and -1 on failure */
 int mdadm_mount(void);
@@ -18,9 +75,162 @@ int mdadm_revoke_write_permission(void);
 
 
 /* Return the number of bytes read on success, -1 on failure. */
-int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf);
+int mdadm_read(uint64_t addr, uint32_t len, uint8_t *buf);
 
 /* Return the number of bytes written on success, -1 on failure. */
-int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf);
+int mdadm_write(uint64_t addr, uint32_t len, const uint8_t *buf);
+
+/* One extent of a vectored read or write: |len| bytes at |addr|, read into
+ * or written from |buf|. */
+typedef struct {
+  uint64_t addr;
+  uint32_t len;
+  void *buf;
+} mdadm_extent_t;
+
+/* Reads or writes |count| extents as one batch. The extents are split into
+ * blocks and sorted by disk and block, and every block is fetched at most
+ * once and, for a write, stored once with all the extents that touch it, so
+ * the batch needs few seeks. Writes that overlap are applied in array order,
+ * the later extent winning. Sets |status[i]| to the length of extent i when
+ * it succeeds, or to the error code mdadm_read or mdadm_write would return
+ * for it. Returns 1 if every extent succeeded and -1 otherwise, or -3 when
+ * the array is not mounted (and -5 without write permission, for
+ * mdadm_writev), leaving |status| alone; NULL |extents| or |status|, or a
+ * negative |count|, fails with -1 the same way. */
+int mdadm_readv(const mdadm_extent_t *extents, int count, int *status);
+int mdadm_writev(const mdadm_extent_t *extents, int count, int *status);
+
+/* Submission queue. With a depth set, mdadm_queue_read and mdadm_queue_write
+ * split operations into blocks and queue them instead of running them, up
+ * to |depth| blocks, merging operations on the same block into one fetch
+ * and one store. Blocks are run in elevator (C-LOOK) order of disk and block
+ * from where the connection is, so a run of them needs few seeks. When the
+ * queue is full, queueing another block first runs one; a block passed over
+ * for 8 * |depth| others runs next whatever its position.
+ *
+ * Results are the same as running the operations in order: a read after a
+ * write to the same block sees it, and one before does not. A read's |buf|
+ * is filled when its block runs, at the latest in mdadm_queue_flush, and
+ * must stay valid until then; written data is copied when queued.
+ *
+ * The queue belongs to the calling thread. Without a depth set, the queue
+ * calls run mdadm_read and mdadm_write directly. */
+#define MDADM_QUEUE_MAX_DEPTH 256
+
+/* Returns 1 on success and -1 on failure (bad depth, or blocks queued). */
+int mdadm_queue_set_depth(int depth);
+
+/* Return the number of bytes queued on success, or the error codes of
+ * mdadm_read and mdadm_write. Failures of the queued I/O are reported by
+ * mdadm_queue_flush. */
+int mdadm_queue_read(uint64_t addr, uint32_t len, uint8_t *buf);
+int mdadm_queue_write(uint64_t addr, uint32_t len, const uint8_t *buf);
+
+/* Runs every queued block. Returns 1 if every block queued since the last
+ * flush ran successfully, -1 otherwise. */
+int mdadm_queue_flush(void);
+
+/* Prints how many block reads and writes went to the server and how many
+ * seeks they needed. */
+void mdadm_print_seek_stats(void);
+
+/* Copy-on-write snapshots, for an array mounted with blocks reserved. The
+ * array's blocks are reached through a map from logical to physical blocks,
+ * the identity at mount. A snapshot freezes a copy of the map, so taking
+ * one costs a pass over the map and copies no data. A later write to a
+ * block the live array still shares with a snapshot goes to a free block
+ * from the reserve instead, and the map is pointed at it; the snapshot
+ * keeps the old one. A write fails with -1 when no free block is left.
+ *
+ * The maps live in the client's memory only: mdadm_unmount moves the live
+ * blocks back where they belong, which needs write permission, then drops
+ * the snapshots, so the disks hold the array as they would without
+ * snapshots. Moving a block home overwrites the one a snapshot kept there,
+ * so the snapshots are dropped before the first such move. Blocks move one
+ * at a time and the map follows each, so an unmount that fails can be
+ * retried. mdadm_dump copies the disks as they are and mdadm_restore
+ * refuses to run while a block is remapped or a snapshot exists.
+ *
+ * A write that runs while a snapshot is taken may or may not be in it. */
+#define MDADM_MAX_SNAPSHOTS 16
+
+/* Returns a handle to a snapshot of the array as it is, or -1 on failure
+ * (no reserve, or MDADM_MAX_SNAPSHOTS snapshots already). */
+int mdadm_snapshot_create(void);
+
+/* Reads the array as it was when snapshot |snap| was taken. Returns like
+ * mdadm_read, and -1 for a bad handle. */
+int mdadm_snapshot_read(int snap, uint64_t addr, uint32_t len, uint8_t *buf);
+
+/* Drops snapshot |snap|, freeing the blocks only it used.
+ * Returns 1 on success and -1 on failure. */
+int mdadm_snapshot_delete(int snap);
+
+/* Prints the snapshots taken, the blocks copied on write and how much of the
+ * reserve is in use. Prints nothing without a reserve. */
+void mdadm_print_snapshot_stats(void);
+
+/* Asks the server for its data generation (see JBOD_GET_GENERATION). Sets
+ * |*generation| to 0 if the server does not report one.
+ * Returns 1 on success and -1 on failure. */
+int mdadm_get_generation(uint64_t *generation);
+
+/* Keeps the cache coherent with other clients writing the same disks: every
+ * block read is cached under a read lease from the server and dropped when
+ * the server says another client wrote it, or when the lease runs out. Must
+ * be called before cache_create and jbod_connect. A server that grants no
+ * leases leaves nothing cached for long, but never anything stale. */
+void mdadm_set_leases(bool enable);
+
+/* Flags for mdadm_dump and mdadm_restore */
+#define MDADM_STREAM_SKIP_CONSTANT  0x1 // dump blocks of one repeated byte as just that byte
+#define MDADM_STREAM_SKIP_UNCHANGED 0x2 // restore only the blocks that differ from the array
+
+/* A dump is a header followed by records of consecutive blocks of one disk,
+ * all fields in native byte order:
+ *   header: MDADM_DUMP_MAGIC, u32 version, u32 num_disks, u32 blocks_per_disk
+ *   record: u32 disk, u32 first block, u32 count, u8 type, u8 fill byte, then
+ *           for MDADM_DUMP_DATA count blocks of data; MDADM_DUMP_FILL blocks
+ *           are all the fill byte. A record of type MDADM_DUMP_END ends it. */
+#define MDADM_DUMP_MAGIC "MDADMIMG"
+#define MDADM_DUMP_VERSION 1
+#define MDADM_DUMP_DATA 'D'
+#define MDADM_DUMP_FILL 'F'
+#define MDADM_DUMP_END 'E'
+
+/* Streams every block of every disk, in order, to |fd|, keeping many reads
+ * in flight. The array must be mounted; the cache is neither used nor
+ * filled. Returns 1 on success and -1 on failure. */
+int mdadm_dump(int fd, int flags);
+
+/* Writes a dump read from |fd| back to the disks, keeping many writes in
+ * flight, and updates cached copies of the blocks written. The dump must have
+ * the current geometry, and the array must be mounted and writable.
+ * Returns 1 on success and -1 on failure. */
+int mdadm_restore(int fd, int flags);
+
+/* Verifies the array against a Merkle tree of the blocks' signatures
+ * (JBOD_SIGN_BLOCK), without signing every block each time. The first call
+ * signs every block; later ones only sign the blocks written since, by this
+ * client or, under leases, by others, and rehash their paths to the root.
+ * Mounting signs every block again, and so does a call after a failed one.
+ * Blocks are signed with many requests in flight. Sets |root| to the digest
+ * of the whole array, to compare with one stored earlier. Writes by other
+ * clients without leases go unnoticed.
+ * Returns the number of blocks signed on success and -1 on failure. */
+int mdadm_verify(uint8_t root[MERKLE_DIGEST_LEN]);
+
+/* Returns the signature of |block| of |disk| as the server gave it to
+ * mdadm_verify, a line of text, or NULL if there is none. */
+const char *mdadm_block_signature(uint32_t disk, uint32_t block);
+
+/* Prints how many blocks were fetched after a cache miss, and how many
+ * misses waited for another thread's fetch of the same block instead. */
+void mdadm_print_fetch_stats(void);
+
+/* Prints how reads were spread over the members of each mirror, and how many
+ * were retried on the other member. Prints nothing for other layouts. */
+void mdadm_print_mirror_stats(void);
 
 #endif
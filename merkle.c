@@ -0,0 +1,168 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "merkle.h"
+#include "util.h"
+
+// The tree is kept in heap order: the root is node 1, the children of node
+// n are 2n and 2n + 1, and leaf i is node width + i. Leaves past num_leaves
+// pad the tree to a power of two and stay all zeroes.
+static uint8_t (*nodes)[MERKLE_DIGEST_LEN] = NULL;
+static bool *stale = NULL; // per node: a leaf below was set since it was hashed
+static uint32_t num_leaves = 0;
+static uint32_t width = 0;
+
+// Dirty leaves, flagged and listed. A stale node's parent is always stale
+// too, so marking a path stops at the first node already marked.
+static uint8_t *dirty = NULL;
+static uint32_t *dirty_list = NULL;
+static uint32_t num_dirty = 0;
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
+_Static_assert(MERKLE_DIGEST_LEN == SHA1_DIGEST_LEN, "nodes are SHA-1 digests");
+
+static uint64_t leaves_set = 0;
+static uint64_t nodes_hashed = 0;
+
+int merkle_create(uint32_t leaves)
+{
+  merkle_destroy();
+  if (leaves == 0)
+  {
+    return -1;
+  }
+
+  width = 1;
+  while (width < leaves)
+  {
+    width *= 2;
+  }
+  num_leaves = leaves;
+  nodes = calloc(2 * (size_t)width, MERKLE_DIGEST_LEN);
+  stale = calloc(2 * (size_t)width, sizeof(bool));
+  dirty = calloc(leaves, 1);
+  dirty_list = malloc(leaves * sizeof(uint32_t));
+  if (nodes == NULL || stale == NULL || dirty == NULL || dirty_list == NULL)
+  {
+    merkle_destroy();
+    return -1;
+  }
+
+  for (uint32_t n = 1; n < width; n++)
+  {
+    stale[n] = true;
+  }
+  merkle_mark_all_dirty();
+  return 1;
+}
+
+void merkle_destroy(void)
+{
+  free(nodes);
+  free(stale);
+  free(dirty);
+  free(dirty_list);
+  nodes = NULL;
+  stale = NULL;
+  dirty = NULL;
+  dirty_list = NULL;
+  num_leaves = 0;
+  width = 0;
+  num_dirty = 0;
+}
+
+uint32_t merkle_size(void)
+{
+  return num_leaves;
+}
+
+void merkle_mark_dirty(uint32_t leaf)
+{
+  if (dirty == NULL || leaf >= num_leaves)
+  {
+    return;
+  }
+
+  // Only the first mark since the leaf was taken lists it
+  if (__atomic_exchange_n(&dirty[leaf], 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    pthread_mutex_lock(&dirty_lock);
+    dirty_list[num_dirty++] = leaf;
+    pthread_mutex_unlock(&dirty_lock);
+  }
+}
+
+void merkle_mark_all_dirty(void)
+{
+  for (uint32_t leaf = 0; leaf < num_leaves; leaf++)
+  {
+    merkle_mark_dirty(leaf);
+  }
+}
+
+int merkle_take_dirty(uint32_t *leaves, int max)
+{
+  int n = 0;
+
+  pthread_mutex_lock(&dirty_lock);
+  while (n < max && num_dirty > 0)
+  {
+    uint32_t leaf = dirty_list[--num_dirty];
+    __atomic_store_n(&dirty[leaf], 0, __ATOMIC_RELEASE);
+    leaves[n++] = leaf;
+  }
+  pthread_mutex_unlock(&dirty_lock);
+  return n;
+}
+
+void merkle_set_leaf(uint32_t leaf, const uint8_t *data, uint32_t len)
+{
+  if (leaf >= num_leaves)
+  {
+    return;
+  }
+
+  sha1_digest(data, len, nodes[width + leaf]);
+  leaves_set++;
+  for (uint32_t n = (width + leaf) / 2; n >= 1 && !stale[n]; n /= 2)
+  {
+    stale[n] = true;
+  }
+}
+
+/* Rehashes node |n| and the stale nodes below it */
+static void rehash(uint32_t n)
+{
+  if (n >= width || !stale[n])
+  {
+    return;
+  }
+
+  rehash(2 * n);
+  rehash(2 * n + 1);
+  // Siblings are next to each other, so the pair is hashed in place
+  sha1_digest(nodes[2 * n], 2 * MERKLE_DIGEST_LEN, nodes[n]);
+  stale[n] = false;
+  nodes_hashed++;
+}
+
+void merkle_root(uint8_t root[MERKLE_DIGEST_LEN])
+{
+  if (nodes == NULL)
+  {
+    memset(root, 0, MERKLE_DIGEST_LEN);
+    return;
+  }
+
+  rehash(1);
+  memcpy(root, nodes[1], MERKLE_DIGEST_LEN);
+}
+
+void merkle_print_stats(void)
+{
+  fprintf(stderr, "merkle: %u leaves, %lu leaves set, %lu nodes rehashed\n", num_leaves,
+          (unsigned long)leaves_set, (unsigned long)nodes_hashed);
+}
@@ -0,0 +1,47 @@
+#ifndef MERKLE_H_
+#define MERKLE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A Merkle tree over the blocks of the array: each leaf is the SHA-1 digest
+ * of what the server signs for one block, and each node the SHA-1 digest of
+ * its two children, so the root stands for the contents of every block.
+ *
+ * Leaves are marked dirty when their block may have changed, and kept in a
+ * list, so finding them costs nothing per clean block. Setting a leaf marks
+ * its path to the root stale, and merkle_root rehashes stale nodes only:
+ * after k leaves change it does O(k log n) hashing, not O(n).
+ *
+ * Leaves may be marked dirty from any thread; the other calls must not run
+ * concurrently with each other. */
+#define MERKLE_DIGEST_LEN 20
+
+/* Makes a tree of |num_leaves| leaves, all of them dirty, replacing any
+ * previous one. Returns 1 on success and -1 on failure. */
+int merkle_create(uint32_t num_leaves);
+
+/* Frees the tree */
+void merkle_destroy(void);
+
+/* Returns the number of leaves, 0 if there is no tree */
+uint32_t merkle_size(void);
+
+/* Marks |leaf| dirty, or every leaf. Does nothing without a tree. */
+void merkle_mark_dirty(uint32_t leaf);
+void merkle_mark_all_dirty(void);
+
+/* Takes up to |max| dirty leaves, marking them clean, and stores their
+ * numbers in |leaves|. Returns how many were taken. */
+int merkle_take_dirty(uint32_t *leaves, int max);
+
+/* Sets |leaf| to the digest of the |len| bytes at |data| */
+void merkle_set_leaf(uint32_t leaf, const uint8_t *data, uint32_t len);
+
+/* Rehashes the stale nodes and copies the root digest to |root| */
+void merkle_root(uint8_t root[MERKLE_DIGEST_LEN]);
+
+/* Prints the leaves set and the nodes rehashed */
+void merkle_print_stats(void);
+
+#endif
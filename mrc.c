@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <err.h>
+
+#include "cache.h"
+#include "jbod.h"
+#include "mdadm.h"
+
+// Offline cache sizing. Reads a trace, turns its READs and WRITEs into the
+// block lookups mdadm makes for them, and prints the miss ratio of every
+// cache size from MIN_SIZE to CACHE_MAX_BLOCKS without a server:
+//  - LRU, from Mattson stack (reuse) distances, in one pass;
+//  - OPT (Belady), from Mattson's priority stack on next-use times, in one pass;
+//  - MRU, the policy cache.c implements, by replaying the real cache per size,
+//    with and without its TinyLFU admission filter.
+
+#define MRC_ARGUMENTS "hg:dS:a"
+#define USAGE                                                                          \
+  "USAGE: mrc [-h] [-g disks:blocks] [-d] [-S rate] [-a] <trace>\n"                   \
+  "\n"                                                                                \
+  "where:\n"                                                                          \
+  "    -h - help mode (display this message)\n"                                       \
+  "    -g - array geometry, number of disks and blocks per disk (default 16:256)\n"  \
+  "    -d - replay the cache with deduplication\n"                                    \
+  "    -S - SHARDS sampling: analyse only this fraction of the blocks for the LRU\n"  \
+  "         and OPT curves, for large traces (0 < rate <= 1, default 1)\n"            \
+  "    -a - print the LRU and OPT curves at every size, not only at the sizes\n"      \
+  "         the cache is replayed at\n"                                               \
+  "\n"
+
+#define MIN_SIZE 2
+#define MAX_SIZE CACHE_MAX_BLOCKS
+#define MAX_IO_SIZE 1024
+#define NEVER SIZE_MAX // next use of a block that is not looked up again
+
+// SHARDS keeps a block if hash(block) mod SAMPLE_MODULUS < rate * SAMPLE_MODULUS
+#define SAMPLE_MODULUS (1 << 24)
+
+// Reuse distance buckets: 1, 2, 3-4, 5-8, ..., 2049-4096, then deeper; a
+// lookup in bucket i hits in any cache of 2^i entries or more
+#define DISTANCE_BUCKETS 14
+
+typedef struct {
+  bool write;
+  uint64_t addr;
+  uint32_t len;
+  uint8_t ch;
+} trace_op_t;
+
+static bool dedup = false;
+static double rate = 1.0;
+static bool all_sizes = false;
+
+static trace_op_t *ops = NULL;
+static size_t num_ops = 0;
+
+// Logical blocks of every lookup, and of the lookups kept by sampling
+static uint32_t *lookups = NULL;
+static size_t num_lookups = 0;
+static uint32_t *refs = NULL;
+static size_t num_refs = 0;
+
+// Sampled lookups that hit in a cache of any size >= d, by d; index 0 is unused
+static uint64_t lru_hits[MAX_SIZE + 1];
+static uint64_t opt_hits[MAX_SIZE + 1];
+static uint64_t cold_refs = 0;
+static uint64_t distances[DISTANCE_BUCKETS];
+
+static uint64_t num_blocks(void)
+{
+  const mdadm_geometry_t *geo = mdadm_get_geometry();
+  return (uint64_t)geo->num_disks * geo->blocks_per_disk;
+}
+
+/* Appends |op| to the trace, growing the array as needed */
+static void add_op(const trace_op_t *op)
+{
+  static size_t capacity = 0;
+  if (num_ops == capacity)
+  {
+    capacity = capacity ? 2 * capacity : 1024;
+    ops = realloc(ops, capacity * sizeof(trace_op_t));
+    if (ops == NULL)
+      err(1, "cannot hold %zu operations", capacity);
+  }
+  ops[num_ops++] = *op;
+}
+
+/* Reads the trace, keeping the READs and WRITEs that mdadm would accept given
+ * the MOUNT and WRITE_PERMIT lines before them */
+static void read_trace(const char *path)
+{
+  const mdadm_geometry_t *geo = mdadm_get_geometry();
+  bool mounted = false, permitted = false;
+  char line[256], cmd[32];
+  int line_num = 0;
+
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    err(1, "cannot open trace %s", path);
+
+  while (fgets(line, sizeof(line), f))
+  {
+    line_num++;
+    line[strcspn(line, "\n")] = '\0';
+
+    if (strcmp(line, "MOUNT") == 0)
+      mounted = true;
+    else if (strcmp(line, "UNMOUNT") == 0)
+      mounted = false;
+    else if (strcmp(line, "WRITE_PERMIT") == 0)
+      permitted = true;
+    else if (strcmp(line, "WRITE_PERMIT_REVOKE") == 0)
+      permitted = false;
+    else if (strcmp(line, "SIGNALL") == 0)
+      continue; // signs blocks on the server, bypassing the cache
+    else
+    {
+      trace_op_t op;
+      uint32_t ch;
+      if (sscanf(line, "%7s %" SCNu64 " %4u %3u", cmd, &op.addr, &op.len, &ch) != 4)
+        errx(1, "cannot parse line %d [%s]", line_num, line);
+      if (strcmp(cmd, "READ") == 0)
+        op.write = false;
+      else if (strcmp(cmd, "WRITE") == 0)
+        op.write = true;
+      else
+        errx(1, "unknown command on line %d [%s]", line_num, line);
+      op.ch = ch;
+
+      // Operations mdadm rejects never reach the cache
+      if (!mounted || (op.write && !permitted) || op.len > MAX_IO_SIZE || op.addr > geo->capacity ||
+          op.len > geo->capacity - op.addr)
+        continue;
+      add_op(&op);
+    }
+  }
+  fclose(f);
+}
+
+/* Returns true if SHARDS keeps |block| in the sample */
+static bool sampled(uint32_t block)
+{
+  // murmur3's finalizer, so neighbouring blocks are sampled independently
+  uint32_t h = block;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return (h % SAMPLE_MODULUS) < rate * SAMPLE_MODULUS;
+}
+
+/* Lists the logical block of every lookup the trace makes, one per block an
+ * operation touches, and the sampled ones among them */
+static void make_refs(void)
+{
+  size_t capacity = 1024;
+  lookups = malloc(capacity * sizeof(uint32_t));
+  refs = malloc(capacity * sizeof(uint32_t));
+
+  for (size_t i = 0; i < num_ops; i++)
+  {
+    uint64_t first = ops[i].addr / JBOD_BLOCK_SIZE;
+    uint64_t last = (ops[i].addr + ops[i].len + JBOD_BLOCK_SIZE - 1) / JBOD_BLOCK_SIZE;
+    for (uint64_t b = first; b < last; b++)
+    {
+      if (num_lookups == capacity)
+      {
+        capacity *= 2;
+        lookups = realloc(lookups, capacity * sizeof(uint32_t));
+        refs = realloc(refs, capacity * sizeof(uint32_t));
+        if (lookups == NULL || refs == NULL)
+          err(1, "cannot hold %zu lookups", capacity);
+      }
+      lookups[num_lookups++] = b;
+      if (sampled(b))
+        refs[num_refs++] = b;
+    }
+  }
+}
+
+/* Scales a distance in the sample up to the whole trace. Returns 0 if it is
+ * beyond every cache size looked at. */
+static int scale_distance(uint64_t d)
+{
+  double exact = d / rate;
+  uint64_t scaled = (uint64_t)exact;
+  if (scaled < exact)
+    scaled++;
+  return scaled <= MAX_SIZE ? (int)scaled : 0;
+}
+
+/* Mattson's LRU stack distances: the distance of a lookup is the number of
+ * distinct blocks looked up since the previous lookup of its block, plus one.
+ * A Fenwick tree over lookup times marks the latest lookup of each block, so
+ * each distance is a prefix sum. */
+static void lru_pass(void)
+{
+  int *tree = calloc(num_refs + 1, sizeof(int));
+  size_t *last = malloc(num_blocks() * sizeof(size_t));
+  if (tree == NULL || last == NULL)
+    err(1, "cannot allocate the LRU stack");
+  for (uint64_t b = 0; b < num_blocks(); b++)
+    last[b] = NEVER;
+
+  for (size_t r = 0; r < num_refs; r++)
+  {
+    uint32_t b = refs[r];
+    if (last[b] == NEVER)
+    {
+      cold_refs++;
+    }
+    else
+    {
+      // Marks after the previous lookup of b, up to r - 1
+      long d = 1;
+      for (size_t i = r; i > 0; i -= i & -i)
+        d += tree[i];
+      for (size_t i = last[b] + 1; i > 0; i -= i & -i)
+        d -= tree[i];
+      for (size_t i = last[b] + 1; i <= num_refs; i += i & -i)
+        tree[i]--;
+
+      int scaled = scale_distance(d);
+      if (scaled)
+        lru_hits[scaled]++;
+      distances[scaled ? (scaled == 1 ? 0 : 64 - __builtin_clzll(scaled - 1)) : DISTANCE_BUCKETS - 1]++;
+    }
+    for (size_t i = r + 1; i <= num_refs; i += i & -i)
+      tree[i]++;
+    last[b] = r;
+  }
+
+  free(tree);
+  free(last);
+}
+
+/* Mattson's stack for Belady's OPT. The block looked up goes on top, then
+ * every depth down to where it was keeps whichever of its block and the one
+ * carried down from above is needed sooner, and passes the other on. The top k
+ * blocks are then what OPT would hold in a cache of k entries. */
+static void opt_pass(void)
+{
+  size_t *next = malloc(num_refs * sizeof(size_t));
+  size_t *seen = malloc(num_blocks() * sizeof(size_t));
+  if (next == NULL || seen == NULL)
+    err(1, "cannot allocate the OPT stack");
+  for (uint64_t b = 0; b < num_blocks(); b++)
+    seen[b] = NEVER;
+  for (size_t r = num_refs; r-- > 0;)
+  {
+    next[r] = seen[refs[r]];
+    seen[refs[r]] = r;
+  }
+
+  // Blocks below the largest sampled size never come back up without a lookup
+  int depth = (int)(MAX_SIZE * rate) + 1;
+  uint32_t *stack = malloc(depth * sizeof(uint32_t));
+  size_t *stack_next = malloc(depth * sizeof(size_t));
+  int len = 0;
+
+  for (size_t r = 0; r < num_refs; r++)
+  {
+    uint32_t x = refs[r];
+    if (len > 0 && stack[0] == x)
+    {
+      int scaled = scale_distance(1);
+      if (scaled)
+        opt_hits[scaled]++;
+      stack_next[0] = next[r];
+      continue;
+    }
+    if (len == 0)
+    {
+      stack[0] = x;
+      stack_next[0] = next[r];
+      len = 1;
+      continue;
+    }
+
+    uint32_t carry = stack[0];
+    size_t carry_next = stack_next[0];
+    stack[0] = x;
+    stack_next[0] = next[r];
+
+    int i;
+    for (i = 1; i < len && stack[i] != x; i++)
+    {
+      if (stack_next[i] > carry_next)
+      {
+        uint32_t b = stack[i];
+        size_t n = stack_next[i];
+        stack[i] = carry;
+        stack_next[i] = carry_next;
+        carry = b;
+        carry_next = n;
+      }
+    }
+
+    if (i < len)
+    {
+      int scaled = scale_distance(i + 1);
+      if (scaled)
+        opt_hits[scaled]++;
+      stack[i] = carry;
+      stack_next[i] = carry_next;
+    }
+    else if (len < depth)
+    {
+      stack[len] = carry;
+      stack_next[len] = carry_next;
+      len++;
+    }
+  }
+
+  free(stack);
+  free(stack_next);
+  free(next);
+  free(seen);
+}
+
+/* Replays the trace's lookups against the real cache with |size| entries,
+ * the way mdadm_read and mdadm_write drive it, with the admission filter if
+ * |admission|. Returns the miss ratio. */
+static double mru_miss_ratio(int size, bool admission, uint8_t *disk)
+{
+  uint64_t queries = 0, hits = 0;
+  uint8_t buf[JBOD_BLOCK_SIZE];
+
+  cache_set_dedup(dedup);
+  cache_set_admission(admission);
+  if (cache_create(size) != 1)
+    errx(1, "cannot create a cache of %d entries", size);
+  memset(disk, 0, num_blocks() * JBOD_BLOCK_SIZE);
+
+  for (size_t i = 0; i < num_ops; i++)
+  {
+    const trace_op_t *op = &ops[i];
+    uint64_t addr = op->addr, end = op->addr + op->len;
+    while (addr < end)
+    {
+      uint32_t d, b, offset;
+      mdadm_map(addr, &d, &b, &offset);
+      uint8_t *block = disk + (addr - offset);
+      uint32_t n = JBOD_BLOCK_SIZE - offset < end - addr ? JBOD_BLOCK_SIZE - offset : end - addr;
+
+      queries++;
+      bool hit = cache_lookup(d, b, buf) == 1;
+      hits += hit;
+      if (!op->write)
+      {
+        if (!hit)
+          cache_insert(d, b, block);
+      }
+      else
+      {
+        // Write misses are not cached; hits take the new contents
+        memset(block + offset, op->ch, n);
+        if (hit)
+          cache_update(d, b, block);
+      }
+      addr += n;
+    }
+  }
+
+  cache_destroy();
+  return queries ? 1.0 - (double)hits / queries : 0;
+}
+
+/* Miss ratio of a cache of |size| entries given the hits by distance */
+static double miss_ratio(const uint64_t *hits, int size)
+{
+  uint64_t n = 0;
+  for (int d = 1; d <= size; d++)
+    n += hits[d];
+  return num_refs ? 1.0 - (double)n / num_refs : 0;
+}
+
+static void print_distances(void)
+{
+  printf("%-12s %10s %8s\n", "reuse dist", "lookups", "%");
+  printf("%-12s %10" PRIu64 " %8.1f\n", "cold", cold_refs, num_refs ? 100.0 * cold_refs / num_refs : 0);
+  for (int i = 0; i < DISTANCE_BUCKETS; i++)
+  {
+    char name[32];
+    if (i == DISTANCE_BUCKETS - 1)
+      snprintf(name, sizeof(name), ">%d", MAX_SIZE);
+    else if (i < 2)
+      snprintf(name, sizeof(name), "%d", 1 << i);
+    else
+      snprintf(name, sizeof(name), "%d-%d", (1 << (i - 1)) + 1, 1 << i);
+    printf("%-12s %10" PRIu64 " %8.1f\n", name, distances[i], num_refs ? 100.0 * distances[i] / num_refs : 0);
+  }
+}
+
+static void print_curve(void)
+{
+  uint8_t *disk = calloc(num_blocks(), JBOD_BLOCK_SIZE);
+  if (disk == NULL)
+    err(1, "cannot allocate a copy of the array");
+
+  printf("\n%-8s %10s %10s %10s %10s\n", "size", "lru miss%", "opt miss%", "mru miss%", "+tinylfu%");
+
+  // The real cache is replayed at 2, 3, 4, 6, 8, 12, ... entries
+  int replay = MIN_SIZE;
+  for (int size = MIN_SIZE; size <= MAX_SIZE; size++)
+  {
+    bool replayed = size == replay;
+    if (replayed)
+      replay = (replay & (replay - 1)) == 0 ? replay + replay / 2 : replay / 3 * 4;
+    if (!replayed && !all_sizes)
+      continue;
+
+    printf("%-8d %10.1f %10.1f", size, 100 * miss_ratio(lru_hits, size), 100 * miss_ratio(opt_hits, size));
+    if (replayed)
+      printf(" %10.1f %10.1f\n", 100 * mru_miss_ratio(size, false, disk), 100 * mru_miss_ratio(size, true, disk));
+    else
+      printf(" %10s %10s\n", "-", "-");
+  }
+
+  free(disk);
+}
+
+int main(int argc, char *argv[])
+{
+  int ch;
+
+  while ((ch = getopt(argc, argv, MRC_ARGUMENTS)) != -1)
+  {
+    switch (ch)
+    {
+    case 'h':
+      fprintf(stderr, USAGE);
+      return 0;
+    case 'g': {
+      uint32_t disks, blocks;
+      if (sscanf(optarg, "%u:%u", &disks, &blocks) != 2 || mdadm_set_geometry(disks, blocks) != 1)
+        errx(1, "invalid geometry [%s]", optarg);
+      break;
+    }
+    case 'd':
+      dedup = true;
+      break;
+    case 'S':
+      rate = atof(optarg);
+      if (!(rate > 0 && rate <= 1))
+        errx(1, "invalid sampling rate [%s]", optarg);
+      break;
+    case 'a':
+      all_sizes = true;
+      break;
+    default:
+      fprintf(stderr, USAGE);
+      return -1;
+    }
+  }
+
+  if (optind >= argc)
+  {
+    fprintf(stderr, USAGE);
+    return -1;
+  }
+
+  read_trace(argv[optind]);
+  make_refs();
+  lru_pass();
+  opt_pass();
+
+  printf("%s: %zu lookups, %zu sampled (rate %g)\n\n", argv[optind], num_lookups, num_refs, rate);
+  print_distances();
+  print_curve();
+
+  return 0;
+}
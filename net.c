@@ -5,17 +5,157 @@
 #include <stdio.h>
 #include <errno.h>
 #include <err.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "net.h"
 #include "jbod.h"
+#include "util.h"
+#include "trace.h"
 
 
 // TAs Himashveta, Ashwin, Nimay, and Mustafa have guided me to debug this, and understand the logic behind this
 
-/* the client socket descriptor for the connection to the server */
-int cli_sd = -1;
+/* the client socket descriptor for the connection to the server; every
+ * thread has its own connection */
+_Thread_local int cli_sd = -1;
+
+/* payload compression: requested by the user, offered to and accepted by the
+ * server on this thread's connection; the offer goes out once, and the first
+ * reply answers it */
+static bool compress_wanted = false;
+static _Thread_local bool compress_offered = false;
+static _Thread_local bool compress_answer_due = false;
+static _Thread_local bool compress_active = false;
+// Requests sent and connections made by this thread, see jbod_client_ops
+static _Thread_local uint64_t ops_sent = 0;
+
+/* payload bytes as they would be uncompressed, and as actually put on the
+ * wire, over all connections (updated atomically) */
+static uint64_t payload_raw_bytes = 0;
+static uint64_t payload_wire_bytes = 0;
+// Connections that offered compression, and that the server accepted it on
+static uint64_t compress_offers = 0;
+static uint64_t compress_accepts = 0;
+
+/* per-operation deadline in milliseconds, 0 to wait forever; when the
+ * operation in progress on this thread must finish, in CLOCK_MONOTONIC ns;
+ * and whether waiting for the server ran past it */
+static int deadline_ms = 0;
+static _Thread_local uint64_t op_deadline = 0;
+static _Thread_local bool op_timed_out = false;
+
+/* where this thread connected, to connect again after a deadline is missed */
+static _Thread_local char server_ip[INET_ADDRSTRLEN];
+static _Thread_local uint16_t server_port = 0;
+static _Thread_local bool reconnect = false;
+
+/* hedged reads: a second connection per thread, and the replies still due
+ * on it */
+#define HEDGE_SAMPLES 256
+static bool hedging = false;
+static _Thread_local int hedge_sd = -1;
+static _Thread_local int hedge_pending = 0;
+// The last HEDGE_SAMPLES READ_BLOCK latencies, and their 95th percentile
+static _Thread_local uint64_t read_ns[HEDGE_SAMPLES];
+static _Thread_local uint64_t num_reads = 0;
+static _Thread_local uint64_t hedge_after_ns = 0;
+/* the connection's position as far as this thread's operations tell, -1 when
+ * unknown; a hedge seeks its own connection there */
+static _Thread_local int64_t at_disk = -1;
+static _Thread_local int64_t at_block = -1;
+
+/* read leases: whether to ask for them, the handler of pushed
+ * invalidations, whether the request being sent asks for one, the replies
+ * due on the main connection, and when the last lease asked for was sent
+ * and runs out */
+static bool leases_wanted = false;
+static void (*invalidate_handler)(uint32_t disk, uint32_t block) = NULL;
+static _Thread_local bool lease_asked = false;
+static _Thread_local int replies_due = 0;
+static _Thread_local uint64_t lease_sent_ns = 0;
+static _Thread_local uint64_t lease_expiry = 0;
+
+/* over all threads (updated atomically): READ_BLOCK round trips in buckets
+ * of 10 us, the last bucket holding every one of 100 ms or more */
+#define READ_BUCKET_NS 10000
+#define READ_BUCKETS 10000
+static uint64_t read_hist[READ_BUCKETS];
+/* capture and replay: the requests sent and the replies received, in a
+ * capture file (see jbod_capture). A replay serves the replies from memory,
+ * in order, to one connection. */
+#define CAPTURE_MAGIC "JBODCAP1"
+#define CAPTURE_REQUEST 'Q'
+#define CAPTURE_REPLY 'A'
+#define CAPTURE_HEADER_LEN (1 + HEADER_LEN) // kind, then op and info code
+
+static FILE *capture = NULL;
+static bool replaying = false;
+static int replay_latency_us = 0;
+static uint8_t *replay_data = NULL;
+static size_t *replay_requests = NULL; // offset of every request record
+static size_t *replay_replies = NULL;  // and of every reply record
+static size_t num_replay_requests = 0, num_replay_replies = 0;
+static size_t replay_sent = 0, replay_received = 0;
+
+static uint64_t deadline_misses = 0;
+static uint64_t reads_hedged = 0;
+static uint64_t hedge_wins = 0;
+static uint64_t leases_granted = 0;
+static uint64_t invalidations = 0;
+static uint64_t writes_acked = 0;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Milliseconds left until the operation's deadline, rounded up, for poll;
+ * -1 when there is none */
+static int deadline_left_ms(void)
+{
+  if (op_deadline == 0)
+  {
+    return -1;
+  }
+
+  uint64_t now = now_ns();
+  return now >= op_deadline ? 0 : (int)((op_deadline - now + 999999) / 1000000);
+}
+
+/* Waits until |fd| is ready for |events|. Returns false if the operation's
+ * deadline passes first. */
+static bool wait_for_fd(int fd, short events)
+{
+  if (op_deadline == 0)
+  {
+    return true;
+  }
+
+  while (true)
+  {
+    // Data already there is taken even once the deadline has passed
+    int timeout = deadline_left_ms();
+    struct pollfd p = {fd, events, 0};
+    int n = poll(&p, 1, timeout);
+    // Errors and hangups are left for the read or write to report
+    if (n > 0 || (n < 0 && errno != EINTR))
+    {
+      return true;
+    }
+    if (n == 0 && timeout == 0)
+    {
+      op_timed_out = true;
+      return false;
+    }
+  }
+}
 
 /* attempts to read n bytes from fd; returns true on success and false on
  * failure */
@@ -29,6 +169,12 @@ bool nread(int fd, int len, uint8_t *buf)
   // Loop until the total number of bytes read = requested length 
   while (total_read < len)
   {
+    // Give up once the operation's deadline has passed
+    if (wait_for_fd(fd, POLLIN) == false)
+    {
+      return false;
+    }
+
     bytes_read = read(fd, buf + total_read, len - total_read);
 
     // Handle errors occurs while reading
@@ -42,7 +188,7 @@ bool nread(int fd, int len, uint8_t *buf)
       else
       {
         // Any other forms of error
-        printf("Error in read");
+        warnx("Error in read");
         return false;
       }
     }
@@ -70,6 +216,11 @@ bool nwrite(int fd, int len, uint8_t *buf)
   // Loop until all bytes are written
   while (remaining > 0)
   {
+    if (wait_for_fd(fd, POLLOUT) == false)
+    {
+      return false;
+    }
+
     int bytes_written = write(fd, ptr, remaining);
 
     if (bytes_written > 0)
@@ -90,7 +241,7 @@ bool nwrite(int fd, int len, uint8_t *buf)
       else
       {
         // Any other forms of error
-        printf("Error in write");
+        warnx("Error in write");
         return false;
       }
     }
@@ -99,6 +250,94 @@ bool nwrite(int fd, int len, uint8_t *buf)
   return true;
 }
 
+uint32_t jbod_encode_op(int cmd, uint32_t disk_num, uint32_t block_num)
+{
+  uint32_t op = 0;
+  op |= (uint32_t)cmd << 12;
+  op |= disk_num & 0xf;
+  op |= (block_num & 0xff) << 4;
+  op |= (block_num >> 8) << 18;
+  op |= (disk_num >> 4) << 26;
+  return op;
+}
+
+void jbod_decode_op(uint32_t op, int *cmd, uint32_t *disk_num, uint32_t *block_num)
+{
+  *cmd = (op >> 12) & 0x3f;
+  *disk_num = (op & 0xf) | ((op >> 26) << 4);
+  *block_num = ((op >> 4) & 0xff) | (((op >> 18) & 0xff) << 8);
+}
+
+int jbod_encode_block(const uint8_t *block, uint8_t *out)
+{
+  int n = 1; // out[0] is reserved for the length byte
+
+  // Constant-fill blocks, the most common case, are sent as a single byte
+  int i = 1;
+  while (i < JBOD_BLOCK_SIZE && block[i] == block[0])
+  {
+    i++;
+  }
+  if (i == JBOD_BLOCK_SIZE)
+  {
+    out[0] = 1;
+    out[1] = block[0];
+    return 2;
+  }
+
+  // Otherwise run-length encode as (run length - 1, byte) pairs
+  for (i = 0; i < JBOD_BLOCK_SIZE;)
+  {
+    int run = 1;
+    while (i + run < JBOD_BLOCK_SIZE && block[i + run] == block[i])
+    {
+      run++;
+    }
+
+    // Give up as soon as the encoding is no smaller than the raw block
+    if (n + 2 >= JBOD_BLOCK_SIZE)
+    {
+      return -1;
+    }
+
+    out[n++] = (uint8_t)(run - 1);
+    out[n++] = block[i];
+    i += run;
+  }
+
+  out[0] = (uint8_t)(n - 1);
+  return n;
+}
+
+bool jbod_decode_block(const uint8_t *in, int len, uint8_t *block)
+{
+  if (len == 1)
+  {
+    memset(block, in[0], JBOD_BLOCK_SIZE);
+    return true;
+  }
+
+  // Run data must be whole pairs that exactly fill the block
+  if (len < 2 || len % 2 != 0)
+  {
+    return false;
+  }
+
+  int filled = 0;
+  for (int i = 0; i < len; i += 2)
+  {
+    int run = in[i] + 1;
+    if (filled + run > JBOD_BLOCK_SIZE)
+    {
+      return false;
+    }
+    memset(block + filled, in[i + 1], run);
+    filled += run;
+  }
+
+  return filled == JBOD_BLOCK_SIZE;
+}
+
 /* attempts to receive a packet from fd; returns true on success and false on
  * failure */
 bool recv_packet(int fd, uint32_t *op, uint8_t *ret, uint8_t *block)
@@ -111,7 +350,7 @@ bool recv_packet(int fd, uint32_t *op, uint8_t *ret, uint8_t *block)
   // Reading the header failed
   if (nread(fd, HEADER_LEN, header) == false)
   {
-    printf("Failed to read packet header");
+    warnx("Failed to read packet header");
     return false;
   }
 
@@ -129,14 +368,36 @@ bool recv_packet(int fd, uint32_t *op, uint8_t *ret, uint8_t *block)
   *ret = header[4];
 
   // If second lowest bit of info code indicates a block
-  if ((*ret & 0x02) && block != NULL)
+  if ((*ret & JBOD_INFO_PAYLOAD) && block != NULL)
   {
+    if (*ret & JBOD_INFO_ENCODED)
+    {
+      // Encoded block: a length byte, then that many bytes of run data
+      uint8_t len;
+      uint8_t runs[JBOD_BLOCK_SIZE];
+      if (nread(fd, 1, &len) == false || len == 0 || nread(fd, len, runs) == false)
+      {
+        warnx("Failed to read encoded data block.");
+        return false;
+      }
+      if (jbod_decode_block(runs, len, block) == false)
+      {
+        warnx("Malformed encoded data block.");
+        return false;
+      }
+      __atomic_fetch_add(&payload_wire_bytes, 1 + len, __ATOMIC_RELAXED);
+    }
     // Data block present, read it from the file descriptor into the block buffer
-    if (nread(fd, JBOD_BLOCK_SIZE, block) == false)
+    else if (nread(fd, JBOD_BLOCK_SIZE, block) == false)
     {
-      printf("Failed to read data block.");
+      warnx("Failed to read data block.");
       return false;
     }
+    else
+    {
+      __atomic_fetch_add(&payload_wire_bytes, JBOD_BLOCK_SIZE, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&payload_raw_bytes, JBOD_BLOCK_SIZE, __ATOMIC_RELAXED);
   }
 
   return true;
@@ -147,50 +408,96 @@ bool recv_packet(int fd, uint32_t *op, uint8_t *ret, uint8_t *block)
  * failure */
 bool send_packet(int fd, uint32_t op, uint8_t *block)
 {
-  // Buffer for the packet header: opcode (4 bytes) + info code (1 byte)
-  uint8_t header[5]; 
+  // Buffer for the whole packet, so header and payload leave in one write:
+  // opcode (4 bytes) + info code (1 byte) + payload (up to 256 bytes)
+  uint8_t packet[HEADER_LEN + JBOD_BLOCK_SIZE];
+  int packet_len = HEADER_LEN;
 
   // Convert the opcode op from host byte order to network byte order
   uint32_t network_op = htonl(op);
 
   // Copy the network-order opcode into the header buffer
-  memcpy(header, &network_op, sizeof(network_op));
+  memcpy(packet, &network_op, sizeof(network_op));
 
   // Info code set to the 5th byte of the header
-  // If the opcode represents a write operation, set the second lowest bit of the code to 1
-  header[4] = ((op >> 12) == JBOD_WRITE_BLOCK) ? 0x02 : 0x00;
+  packet[4] = 0x00;
 
-  // Header sent to the file descriptor using nwrite
-  if (nwrite(fd, HEADER_LEN, header) == false)
+  // Ask for compression on the first request of the connection
+  if (compress_wanted && !compress_offered)
   {
-    printf("Failed to send packet header.");
-    return false;
+    packet[4] |= JBOD_INFO_COMPRESS;
+    compress_offered = true;
+    compress_answer_due = true;
+    __atomic_fetch_add(&compress_offers, 1, __ATOMIC_RELAXED);
+  }
+
+  // The lease starts no earlier than the request leaves
+  if (lease_asked && ((op >> 12) & 0x3f) == JBOD_READ_BLOCK)
+  {
+    packet[4] |= JBOD_INFO_LEASE;
+    lease_sent_ns = now_ns();
   }
 
   // Check if the operation is a write block operation
-  if ((op >> 12) == JBOD_WRITE_BLOCK)
+  // If so, set the second lowest bit of the code to 1 and append the block
+  if (((op >> 12) & 0x3f) == JBOD_WRITE_BLOCK)
   {
-    if (nwrite(fd, JBOD_BLOCK_SIZE, block) == false)
+    packet[4] |= JBOD_INFO_PAYLOAD;
+
+    int encoded_len = compress_active ? jbod_encode_block(block, packet + HEADER_LEN) : -1;
+    if (encoded_len > 0)
     {
-      printf("Failed to send data block.");
-      return false;
+      packet[4] |= JBOD_INFO_ENCODED;
+      packet_len += encoded_len;
+    }
+    else
+    {
+      memcpy(packet + HEADER_LEN, block, JBOD_BLOCK_SIZE);
+      packet_len += JBOD_BLOCK_SIZE;
     }
+
+    __atomic_fetch_add(&payload_raw_bytes, JBOD_BLOCK_SIZE, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&payload_wire_bytes, packet_len - HEADER_LEN, __ATOMIC_RELAXED);
+  }
+
+  // Packet sent to the file descriptor using nwrite
+  if (nwrite(fd, packet_len, packet) == false)
+  {
+    warnx("Failed to send packet.");
+    return false;
   }
 
   return true;
 }
 
+void jbod_set_compression(bool enable)
+{
+  compress_wanted = enable;
+}
+
+void jbod_print_net_stats(void)
+{
+  fprintf(stderr, "payload bytes: %lu raw, %lu on the wire\n",
+          (unsigned long)payload_raw_bytes, (unsigned long)payload_wire_bytes);
+  if (payload_wire_bytes > 0)
+  {
+    fprintf(stderr, "Compression ratio: %5.2f:1 (negotiated on %lu of %lu connections)\n",
+            (double)payload_raw_bytes / payload_wire_bytes, (unsigned long)compress_accepts,
+            (unsigned long)compress_offers);
+  }
+}
 
-/* connect to server and set the global client variable to the socket */
-bool jbod_connect(const char *ip, uint16_t port)
+
+/* Opens a connection to the server. Returns the socket, or -1 on failure. */
+static int open_connection(const char *ip, uint16_t port)
 {
 
   // Create a socket
-  cli_sd = socket(AF_INET, SOCK_STREAM, 0);
-  if (cli_sd == -1)
+  int sd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sd == -1)
   {
-    printf("Failed to create socket");
-    return false;
+    warnx("Failed to create socket");
+    return -1;
   }
 
   // Set up the server address structure to 0
@@ -200,30 +507,88 @@ bool jbod_connect(const char *ip, uint16_t port)
   server_addr.sin_family = AF_INET;
 
   // Convert the given port number to network byte order
-  server_addr.sin_port = htons(JBOD_PORT); 
+  server_addr.sin_port = htons(port);
 
   // Convert IP address from string to binary
   if (inet_aton(ip, &server_addr.sin_addr) <= 0)
   {
-    printf("Invalid IP address");
-    close(cli_sd);
-    cli_sd = -1;
-    return false;
+    warnx("Invalid IP address");
+    close(sd);
+    return -1;
   }
 
   // Attempt to connect to the JBOD server
-  if (connect(cli_sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+  if (connect(sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+  {
+    warnx("Failed to connect to server");
+    close(sd);
+    return -1;
+  }
+
+  return sd;
+}
+
+/* connect to server and set the global client variable to the socket */
+bool jbod_connect(const char *ip, uint16_t port)
+{
+  // A replay serves the capture in place of a server
+  if (replaying)
+  {
+    ops_sent++;
+    at_disk = -1;
+    at_block = -1;
+    compress_offered = false;
+    compress_answer_due = false;
+    compress_active = false;
+    return true;
+  }
+
+  cli_sd = open_connection(ip, port);
+  if (cli_sd == -1)
   {
-    printf("HERE %d \n", connect(cli_sd, (struct sockaddr *)&server_addr, sizeof(server_addr)));
-    printf("Failed to connect to server");
-    close(cli_sd);
-    cli_sd = -1;
     return false;
   }
 
+  // Remember the server, to connect again if an operation misses its deadline
+  if (ip != server_ip)
+  {
+    snprintf(server_ip, sizeof(server_ip), "%s", ip);
+  }
+  server_port = port;
+  reconnect = false;
+
+  // An acknowledgement of an invalidation goes out while a request may still
+  // be unanswered, which Nagle's algorithm would hold until it is
+  if (leases_wanted)
+  {
+    int one = 1;
+    setsockopt(cli_sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+
+  ops_sent++;
+  at_disk = -1;
+  at_block = -1;
+  replies_due = 0;
+
+  // Compression is negotiated again for every connection
+  compress_offered = false;
+  compress_answer_due = false;
+  compress_active = false;
+
   return true;
 }
 
+/* Closes the hedge connection, with any replies still due on it */
+static void close_hedge(void)
+{
+  if (hedge_sd >= 0)
+  {
+    close(hedge_sd);
+    hedge_sd = -1;
+  }
+  hedge_pending = 0;
+}
+
 void jbod_disconnect(void)
 {
   // Check if a connection exists
@@ -235,49 +600,746 @@ void jbod_disconnect(void)
     // Reset the client socket descriptor
     cli_sd = -1; 
   }
+  close_hedge();
+  reconnect = false;
 }
 
-int jbod_client_operation(uint32_t op, uint8_t *block)
+/* Drops the connection after an operation missed its deadline: a reply
+ * still on its way would otherwise be taken for the next operation's. The
+ * next jbod_client_operation connects again. */
+static void drop_connection(void)
 {
-  // To receive the response packet
-  uint32_t received_op;
-  uint8_t info_code;
-  uint8_t buffer[JBOD_BLOCK_SIZE];
+  __atomic_fetch_add(&deadline_misses, 1, __ATOMIC_RELAXED);
+  debug_log("deadline of %d ms missed, dropping the connection", deadline_ms);
+  jbod_disconnect();
+  reconnect = true;
+}
+
+void jbod_set_deadline(int ms)
+{
+  deadline_ms = ms > 0 ? ms : 0;
+}
+
+void jbod_set_hedging(bool enable)
+{
+  hedging = enable;
+}
+
+/* Returns the |q| quantile of the READ_BLOCK round trips in microseconds */
+static double read_quantile(double q)
+{
+  uint64_t total = 0;
+  for (int i = 0; i < READ_BUCKETS; i++)
+  {
+    total += read_hist[i];
+  }
+
+  uint64_t rank = (uint64_t)(q * total), seen = 0;
+  for (int i = 0; i < READ_BUCKETS; i++)
+  {
+    seen += read_hist[i];
+    if (seen > rank)
+    {
+      return (i + 1) * READ_BUCKET_NS / 1e3;
+    }
+  }
+  return 0;
+}
+
+void jbod_print_lease_stats(void)
+{
+  fprintf(stderr, "leases granted: %lu, invalidations received: %lu\n", (unsigned long)leases_granted,
+          (unsigned long)invalidations);
+}
+
+void jbod_print_latency_stats(void)
+{
+  fprintf(stderr, "READ_BLOCK round trips: p50 %.0f us, p99 %.0f us, p99.9 %.0f us\n",
+          read_quantile(0.5), read_quantile(0.99), read_quantile(0.999));
+  fprintf(stderr, "deadline misses: %lu, reads hedged: %lu (answered first by the hedge: %lu)\n",
+          (unsigned long)deadline_misses, (unsigned long)reads_hedged, (unsigned long)hedge_wins);
+}
+
+/* Starts the deadline of an operation, if there is one */
+static void start_deadline(void)
+{
+  op_deadline = deadline_ms > 0 ? now_ns() + (uint64_t)deadline_ms * 1000000 : 0;
+  op_timed_out = false;
+}
+
+#ifdef MDADM_TRACE
+/* Name of the command in |op|, for its span */
+static const char *op_name(uint32_t op)
+{
+  static const char *const names[JBOD_NUM_CMDS] = {
+    "MOUNT", "UNMOUNT", "SEEK_TO_DISK", "SEEK_TO_BLOCK", "READ_BLOCK",
+    "WRITE_PERMISSION", "REVOKE_WRITE_PERMISSION", "WRITE_BLOCK", "SIGN_BLOCK",
+  };
+  int cmd;
+  uint32_t disk, block;
+  jbod_decode_op(op, &cmd, &disk, &block);
+  if (cmd == JBOD_GET_GENERATION)
+  {
+    return "GET_GENERATION";
+  }
+  return cmd >= 0 && cmd < JBOD_NUM_CMDS ? names[cmd] : "UNKNOWN";
+}
+#endif
+
+/* If the packet just read from |fd| is a pushed invalidation, hands it to
+ * the handler and acknowledges it. Returns true if it was one. */
+static bool handle_push(int fd, uint32_t op, uint8_t info)
+{
+  if (!(info & JBOD_INFO_PUSH))
+  {
+    return false;
+  }
+
+  int cmd;
+  uint32_t disk, block;
+  jbod_decode_op(op, &cmd, &disk, &block);
+  __atomic_fetch_add(&invalidations, 1, __ATOMIC_RELAXED);
+  debug_log("invalidation of disk %u block %u", disk, block);
+  if (invalidate_handler != NULL)
+  {
+    invalidate_handler(disk, block);
+  }
+
+  // Only acknowledged once the block is forgotten
+  send_packet(fd, op, NULL);
+  return true;
+}
+
+/* Handles the invalidations waiting on |fd|, which must have no replies
+ * due, without blocking */
+static void drain_pushes(int fd)
+{
+  struct pollfd p = {fd, POLLIN, 0};
+  while (poll(&p, 1, 0) > 0)
+  {
+    uint32_t op;
+    uint8_t info;
+    uint8_t buffer[JBOD_BLOCK_SIZE];
+    if (recv_packet(fd, &op, &info, buffer) == false || !handle_push(fd, op, info))
+    {
+      return;
+    }
+  }
+}
+
+/* Appends a record of |kind| to the capture file: the kind, the op in
+ * network order and the info code, then the block if the info code says a
+ * payload goes with it. Payloads are kept decoded. */
+static void capture_packet(char kind, uint32_t op, uint8_t info, const uint8_t *block)
+{
+  uint8_t record[CAPTURE_HEADER_LEN + JBOD_BLOCK_SIZE];
+  int len = CAPTURE_HEADER_LEN;
+  uint32_t network_op = htonl(op);
+
+  info &= ~JBOD_INFO_ENCODED;
+  record[0] = kind;
+  memcpy(record + 1, &network_op, sizeof(network_op));
+  record[1 + sizeof(network_op)] = info;
+  if (info & JBOD_INFO_PAYLOAD)
+  {
+    memcpy(record + len, block, JBOD_BLOCK_SIZE);
+    len += JBOD_BLOCK_SIZE;
+  }
+
+  // One fwrite per record, so records of several threads do not interleave
+  if (fwrite(record, len, 1, capture) != 1)
+  {
+    warn("cannot write the capture file");
+  }
+}
+
+bool jbod_capture(const char *path)
+{
+  if (capture != NULL)
+  {
+    fclose(capture);
+    capture = NULL;
+  }
+  if (path == NULL)
+  {
+    return true;
+  }
+
+  capture = fopen(path, "w");
+  if (capture == NULL || fwrite(CAPTURE_MAGIC, strlen(CAPTURE_MAGIC), 1, capture) != 1)
+  {
+    warn("cannot create the capture file %s", path);
+    if (capture != NULL)
+    {
+      fclose(capture);
+      capture = NULL;
+    }
+    return false;
+  }
+  return true;
+}
+
+bool jbod_replay(const char *path, int latency_us)
+{
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+  {
+    warn("cannot open the capture file %s", path);
+    return false;
+  }
+
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  rewind(f);
+  uint8_t *data = size > 0 ? malloc(size) : NULL;
+  bool ok = data != NULL && fread(data, size, 1, f) == 1 && (size_t)size >= strlen(CAPTURE_MAGIC) &&
+            memcmp(data, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) == 0;
+  fclose(f);
+
+  // Index the records; none is shorter than its header
+  size_t max_records = size > 0 ? size / CAPTURE_HEADER_LEN : 0;
+  size_t *requests = ok ? malloc(max_records * sizeof(size_t)) : NULL;
+  size_t *replies = ok ? malloc(max_records * sizeof(size_t)) : NULL;
+  size_t num_requests = 0, num_replies = 0;
+  size_t at = strlen(CAPTURE_MAGIC);
+  ok = ok && requests != NULL && replies != NULL;
+  while (ok && at < (size_t)size)
+  {
+    if (at + CAPTURE_HEADER_LEN > (size_t)size)
+    {
+      ok = false;
+      break;
+    }
+    uint8_t info = data[at + CAPTURE_HEADER_LEN - 1];
+    size_t len = CAPTURE_HEADER_LEN + ((info & JBOD_INFO_PAYLOAD) ? JBOD_BLOCK_SIZE : 0);
+    if (at + len > (size_t)size || (data[at] != CAPTURE_REQUEST && data[at] != CAPTURE_REPLY))
+    {
+      ok = false;
+      break;
+    }
+    if (data[at] == CAPTURE_REQUEST)
+    {
+      requests[num_requests++] = at;
+    }
+    else
+    {
+      replies[num_replies++] = at;
+    }
+    at += len;
+  }
+
+  if (!ok)
+  {
+    warnx("%s is not a valid capture file", path);
+    free(data);
+    free(requests);
+    free(replies);
+    return false;
+  }
+
+  free(replay_data);
+  free(replay_requests);
+  free(replay_replies);
+  replay_data = data;
+  replay_requests = requests;
+  replay_replies = replies;
+  num_replay_requests = num_requests;
+  num_replay_replies = num_replies;
+  replay_sent = 0;
+  replay_received = 0;
+  replay_latency_us = latency_us;
+  replaying = true;
+  return true;
+}
+
+/* Returns the op of the capture record at |at| */
+static uint32_t replay_op(size_t at)
+{
+  uint32_t network_op;
+  memcpy(&network_op, replay_data + at + 1, sizeof(network_op));
+  return ntohl(network_op);
+}
+
+/* Stands in for sending |op|: the next request captured must be the same */
+static bool replay_send(uint32_t op)
+{
+  if (replay_sent == num_replay_requests)
+  {
+    warnx("Replay ran past the end of the capture.");
+    return false;
+  }
+  uint32_t captured = replay_op(replay_requests[replay_sent]);
+  if (captured != op)
+  {
+    warnx("Replay diverged from the capture: sent op 0x%08x, captured 0x%08x.", op, captured);
+    return false;
+  }
+  replay_sent++;
+  lease_sent_ns = now_ns();
+  return true;
+}
+
+/* Stands in for receiving the reply to |op|: returns the next reply
+ * captured, after the latency injected, if any */
+static bool replay_recv(uint32_t *op, uint8_t *info, uint8_t *block)
+{
+  if (replay_received == replay_sent)
+  {
+    warnx("Replay has no request waiting for a reply.");
+    return false;
+  }
+  if (replay_received == num_replay_replies)
+  {
+    warnx("Replay ran past the end of the capture.");
+    return false;
+  }
+
+  if (replay_latency_us > 0)
+  {
+    struct timespec ts = {replay_latency_us / 1000000, replay_latency_us % 1000000 * 1000L};
+    nanosleep(&ts, NULL);
+  }
+
+  size_t at = replay_replies[replay_received++];
+  *op = replay_op(at);
+  *info = replay_data[at + CAPTURE_HEADER_LEN - 1];
+  if (*info & JBOD_INFO_PAYLOAD)
+  {
+    memcpy(block, replay_data + at + CAPTURE_HEADER_LEN, JBOD_BLOCK_SIZE);
+  }
+  return true;
+}
+
+static bool client_send(uint32_t op, uint8_t *block)
+{
+  ops_sent++;
+
+  if (replaying)
+  {
+    return replay_send(op);
+  }
 
   // Check if the connection exists
   if (cli_sd == -1)
   {
-    printf("Not connected to the server");
-    return -1;
+    warnx("Not connected to the server");
+    return false;
   }
 
   // Check if the packet was sent
   if (send_packet(cli_sd, op, block) == false)
   {
-    printf("Packet couldn't be sent to the server");
-    return -1;
+    warnx("Packet couldn't be sent to the server");
+    if (op_timed_out)
+    {
+      drop_connection();
+    }
+    return false;
   }
 
-  // Check if the packet couldn't be received
-  if (recv_packet(cli_sd, &received_op, &info_code, buffer) == false)
+  if (capture != NULL)
   {
-    printf("Packet couldn't be received from the server");
-    return -1;
+    bool write = ((op >> 12) & 0x3f) == JBOD_WRITE_BLOCK;
+    capture_packet(CAPTURE_REQUEST, op, write ? JBOD_INFO_PAYLOAD : 0, block);
+  }
+
+  replies_due++;
+  return true;
+}
+
+static int client_recv(uint32_t op, uint8_t *block)
+{
+  // To receive the response packet
+  uint32_t received_op;
+  uint8_t info_code;
+  uint8_t buffer[JBOD_BLOCK_SIZE];
+
+  // Check if the packet couldn't be received; invalidations pushed ahead of
+  // the reply are handled on the way
+  if (replaying)
+  {
+    if (!replay_recv(&received_op, &info_code, buffer))
+    {
+      return -1;
+    }
+  }
+  else
+  {
+    do
+    {
+      if (recv_packet(cli_sd, &received_op, &info_code, buffer) == false)
+      {
+        warnx("Packet couldn't be received from the server");
+        if (op_timed_out)
+        {
+          drop_connection();
+        }
+        return -1;
+      }
+    } while (handle_push(cli_sd, received_op, info_code));
+    replies_due--;
+
+    if (capture != NULL)
+    {
+      capture_packet(CAPTURE_REPLY, received_op, info_code, buffer);
+    }
   }
 
   // Validate the response
   if (received_op != op)
   {
-    printf("Received opcode does not match the sent opcode.\n");
+    warnx("Received opcode does not match the sent opcode.");
     return -1;
   }
 
+  // The reply to our first request tells whether the server accepted compression
+  if (compress_answer_due)
+  {
+    compress_answer_due = false;
+    compress_active = (info_code & JBOD_INFO_COMPRESS) != 0;
+    if (compress_active)
+    {
+      __atomic_fetch_add(&compress_accepts, 1, __ATOMIC_RELAXED);
+    }
+  }
+
   // Handle data block (if present)
-  if ((info_code & 0x02) && block != NULL)
+  if ((info_code & JBOD_INFO_PAYLOAD) && block != NULL)
   {
     memcpy(block, buffer, JBOD_BLOCK_SIZE);
   }
 
+  if (((op >> 12) & 0x3f) == JBOD_READ_BLOCK)
+  {
+    bool granted = lease_asked && (info_code & JBOD_INFO_LEASE);
+    lease_expiry = granted ? lease_sent_ns + (uint64_t)JBOD_LEASE_MS * 1000000 : 0;
+    if (granted)
+    {
+      __atomic_fetch_add(&leases_granted, 1, __ATOMIC_RELAXED);
+    }
+  }
+
   // Return the result (lowest bit of the info code)
-  return (info_code & 0x01) ? -1 : 0;
+  int rc = (info_code & JBOD_INFO_RET) ? -1 : 0;
+  if (rc == 0 && ((op >> 12) & 0x3f) == JBOD_WRITE_BLOCK)
+  {
+    __atomic_fetch_add(&writes_acked, 1, __ATOMIC_RELAXED);
+  }
+  debug_log("op 0x%08x info 0x%02x rc %d", op, info_code, rc);
+  return rc;
+}
+
+bool jbod_client_send(uint32_t op, uint8_t *block)
+{
+  // Pipelined requests may leave the connection anywhere
+  at_disk = -1;
+  at_block = -1;
+
+  start_deadline();
+  bool sent = client_send(op, block);
+  op_deadline = 0;
+  return sent;
+}
+
+int jbod_client_recv(uint32_t op, uint8_t *block)
+{
+  start_deadline();
+  int rc = client_recv(op, block);
+  op_deadline = 0;
+  return rc;
+}
+
+void jbod_set_leases(bool enable, void (*handler)(uint32_t disk, uint32_t block))
+{
+  leases_wanted = enable;
+  invalidate_handler = handler;
+}
+
+uint64_t jbod_client_lease(void)
+{
+  return lease_expiry;
+}
+
+void jbod_client_poll(void)
+{
+  if (cli_sd >= 0 && replies_due == 0)
+  {
+    drain_pushes(cli_sd);
+  }
+  if (hedge_sd >= 0 && hedge_pending == 0)
+  {
+    drain_pushes(hedge_sd);
+  }
+}
+
+uint64_t jbod_client_ops(void)
+{
+  return ops_sent;
+}
+
+uint64_t jbod_client_writes(void)
+{
+  return __atomic_load_n(&writes_acked, __ATOMIC_RELAXED);
+}
+
+static void quickack(int fd)
+{
+  // Linux drops out of quick acknowledgement mode again by itself, so this
+  // is set for every drain rather than once per connection
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+}
+
+void jbod_client_quickack(void)
+{
+  quickack(cli_sd);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Adds a READ_BLOCK latency to the samples, and every 64 reads recomputes
+ * their 95th percentile, after which a read is hedged */
+static void record_read(uint64_t ns)
+{
+  read_ns[num_reads++ % HEDGE_SAMPLES] = ns;
+  if (num_reads % 64 != 0)
+  {
+    return;
+  }
+
+  uint64_t sorted[HEDGE_SAMPLES];
+  int n = num_reads < HEDGE_SAMPLES ? (int)num_reads : HEDGE_SAMPLES;
+  memcpy(sorted, read_ns, n * sizeof(uint64_t));
+  qsort(sorted, n, sizeof(uint64_t), compare_u64);
+  hedge_after_ns = sorted[n * 95 / 100];
+}
+
+/* Returns true if the hedge connection can take a hedge: it is connected, or
+ * can be, and has answered every earlier one. Replies that have arrived are
+ * read without waiting; a server that has not served the connection at all,
+ * like one serving a single client at a time, gets no more hedges. */
+static bool hedge_ready(void)
+{
+  if (hedge_sd == -1)
+  {
+    hedge_sd = open_connection(server_ip, server_port);
+    hedge_pending = 0;
+    if (hedge_sd == -1)
+    {
+      return false;
+    }
+    // A hedge sends its seeks and read back to back, which Nagle's
+    // algorithm would hold until the first is answered
+    int one = 1;
+    setsockopt(hedge_sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return true;
+  }
+
+  while (hedge_pending > 0)
+  {
+    struct pollfd p = {hedge_sd, POLLIN, 0};
+    uint32_t op;
+    uint8_t info;
+    uint8_t buffer[JBOD_BLOCK_SIZE];
+    if (poll(&p, 1, 0) <= 0)
+    {
+      return false;
+    }
+    if (recv_packet(hedge_sd, &op, &info, buffer) == false)
+    {
+      close_hedge();
+      return false;
+    }
+    if (!handle_push(hedge_sd, op, info))
+    {
+      hedge_pending--;
+    }
+  }
+  drain_pushes(hedge_sd);
+  return true;
+}
+
+/* Sends a READ_BLOCK and, if no reply comes within the 95th percentile of
+ * recent reads (at least a millisecond, poll's resolution), the same read on
+ * the hedge connection, seeking it to the main connection's position first.
+ * The first good reply is returned. When the hedge wins, it is left where
+ * the read would have left the main connection, so the two swap: the next
+ * requests are not held up behind the slow reply, which is read when the old
+ * main connection is next used as the hedge. */
+static int hedged_read(uint32_t op, uint8_t *block)
+{
+  uint64_t start = now_ns();
+  if (!client_send(op, block))
+  {
+    return -1;
+  }
+
+  bool hedge = hedge_after_ns > 0 && at_disk >= 0 && at_block >= 0;
+  if (hedge)
+  {
+    int wait_ms = (int)((hedge_after_ns + 999999) / 1000000);
+    int left_ms = deadline_left_ms();
+    struct pollfd p = {cli_sd, POLLIN, 0};
+    hedge = poll(&p, 1, left_ms >= 0 && left_ms < wait_ms ? left_ms : wait_ms) == 0 &&
+            hedge_ready();
+  }
+  if (!hedge)
+  {
+    int rc = client_recv(op, block);
+    record_read(now_ns() - start);
+    return rc;
+  }
+
+  uint32_t ops[3] = {
+    jbod_encode_op(JBOD_SEEK_TO_DISK, at_disk, 0),
+    jbod_encode_op(JBOD_SEEK_TO_BLOCK, 0, at_block),
+    op,
+  };
+  // The hedge holds no leases, so a read it answers comes without one
+  lease_asked = false;
+  for (int i = 0; i < 3; i++)
+  {
+    if (send_packet(hedge_sd, ops[i], NULL) == false)
+    {
+      close_hedge();
+      break;
+    }
+    hedge_pending++;
+  }
+  __atomic_fetch_add(&reads_hedged, 1, __ATOMIC_RELAXED);
+  // The hedge's replies are drained with nothing more to send
+  quickack(hedge_sd);
+
+  // Wait for whichever answers first; a hedge that fails is left to the
+  // main connection
+  bool hedge_good = hedge_pending == 3;
+  while (true)
+  {
+    struct pollfd fds[2] = {
+      {cli_sd, POLLIN, 0},
+      {hedge_sd, hedge_good ? POLLIN : 0, 0},
+    };
+    int n = poll(fds, 2, deadline_left_ms());
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n == 0)
+    {
+      op_timed_out = true;
+      drop_connection();
+      return -1;
+    }
+    if (n < 0 || fds[0].revents)
+    {
+      int rc = client_recv(op, block);
+      record_read(now_ns() - start);
+      return rc;
+    }
+
+    uint32_t received_op;
+    uint8_t info;
+    uint8_t buffer[JBOD_BLOCK_SIZE];
+    if (recv_packet(hedge_sd, &received_op, &info, buffer) == false)
+    {
+      close_hedge();
+      hedge_good = false;
+      continue;
+    }
+    if (handle_push(hedge_sd, received_op, info))
+    {
+      continue;
+    }
+    hedge_pending--;
+    if (info & JBOD_INFO_RET)
+    {
+      hedge_good = false;
+    }
+    else if (hedge_pending == 0 && received_op == op)
+    {
+      memcpy(block, buffer, JBOD_BLOCK_SIZE);
+      int sd = cli_sd;
+      cli_sd = hedge_sd;
+      hedge_sd = sd;
+      hedge_pending = 1;
+      replies_due = 0;
+      lease_expiry = 0;
+      // Compression was never negotiated on the hedge; sending uncompressed
+      // is always understood
+      compress_active = false;
+      __atomic_fetch_add(&hedge_wins, 1, __ATOMIC_RELAXED);
+      record_read(now_ns() - start);
+      return 0;
+    }
+  }
+}
+
+/* Follows the position of the main connection through the operation |op|
+ * that returned |rc| */
+static void track_position(uint32_t op, int rc)
+{
+  int cmd;
+  uint32_t disk, block;
+  jbod_decode_op(op, &cmd, &disk, &block);
+
+  if (rc != 0)
+  {
+    at_disk = -1;
+    at_block = -1;
+  }
+  else if (cmd == JBOD_SEEK_TO_DISK)
+  {
+    at_disk = disk;
+    at_block = -1;
+  }
+  else if (cmd == JBOD_SEEK_TO_BLOCK)
+  {
+    at_block = block;
+  }
+  else if ((cmd == JBOD_READ_BLOCK || cmd == JBOD_WRITE_BLOCK) && at_block >= 0)
+  {
+    at_block++;
+  }
+}
+
+int jbod_client_operation(uint32_t op, uint8_t *block)
+{
+  // One span per round trip to the server
+  TRACE_SCOPE("net", op_name(op));
+
+  // A connection dropped for a missed deadline is made again on first use
+  if (cli_sd == -1 && reconnect && !jbod_connect(server_ip, server_port))
+  {
+    return -1;
+  }
+
+  uint64_t start = now_ns();
+  start_deadline();
+  bool read = ((op >> 12) & 0x3f) == JBOD_READ_BLOCK;
+  lease_asked = leases_wanted && read;
+  int rc;
+  // A hedge's replies would not reach the capture
+  if (hedging && read && capture == NULL && !replaying)
+  {
+    rc = hedged_read(op, block);
+  }
+  else
+  {
+    rc = client_send(op, block) ? client_recv(op, block) : -1;
+  }
+  op_deadline = 0;
+  lease_asked = false;
+
+  if (read)
+  {
+    uint64_t bucket = (now_ns() - start) / READ_BUCKET_NS;
+    __atomic_fetch_add(&read_hist[bucket < READ_BUCKETS ? bucket : READ_BUCKETS - 1], 1, __ATOMIC_RELAXED);
+  }
+
+  track_position(op, rc);
+  return rc;
 }
@@ -6,10 +6,144 @@
 
 #define HEADER_LEN (sizeof(uint32_t) + sizeof(uint8_t))
 #define JBOD_SERVER "127.0.0.1"
-#define JBOD_PORT 3000     // The port number needs to be changed everytime we check for a trace file 
+#define JBOD_PORT 3000     // The port number needs to be changed everytime we check for a trace file
+
+/* Bits of the info code (5th byte of every packet) */
+#define JBOD_INFO_RET      0x01  // return code: set means -1
+#define JBOD_INFO_PAYLOAD  0x02  // a block payload follows the header
+#define JBOD_INFO_ENCODED  0x04  // the payload is an encoded block (see jbod_encode_block)
+#define JBOD_INFO_COMPRESS 0x08  // request: client offers compression, response: server accepted
+#define JBOD_INFO_LEASE    0x10  // READ_BLOCK request: client asks for a read lease, response: granted
+#define JBOD_INFO_PUSH     0x20  // sent by the server unasked, not a reply (see JBOD_INVALIDATE)
+
+/* Opcode layout. The low 18 bits are the original format (disk in bits 0-3,
+ * block in bits 4-11, command in bits 12-17); larger arrays put the high bits
+ * of the block number in bits 18-25 and of the disk number in bits 26-31. */
+#define JBOD_OP_MAX_DISKS 1024
+#define JBOD_OP_MAX_BLOCKS 65536
+
+/* Extension command: the server replies with its data generation, a 64-bit
+ * big-endian number in the first bytes of the payload that changes whenever
+ * the disks' contents may have changed (a write, or a server restart). The
+ * reference server rejects it, which reads as "generation unknown". */
+#define JBOD_GET_GENERATION 16
+
+/* Extension for cache coherence between clients. A READ_BLOCK sent with
+ * JBOD_INFO_LEASE asks for a read lease on the block read: until it runs
+ * out, JBOD_LEASE_MS after the server grants it, the server tells the
+ * client before the block changes. When another connection writes the
+ * block, the server pushes a JBOD_INVALIDATE packet for it (op with the
+ * disk and block, info JBOD_INFO_PUSH) to every connection holding a lease,
+ * and only answers the write once each has sent the same packet back as an
+ * acknowledgement, which gets no reply, or its lease has run out. The
+ * reference server grants no leases. */
+#define JBOD_INVALIDATE 17
+#define JBOD_LEASE_MS 1000
+
+uint32_t jbod_encode_op(int cmd, uint32_t disk_num, uint32_t block_num);
+void jbod_decode_op(uint32_t op, int *cmd, uint32_t *disk_num, uint32_t *block_num);
 
 int jbod_client_operation(uint32_t op, uint8_t *block);
+
+/* jbod_client_operation in two halves, so several requests can be in flight
+ * on the connection. The server answers requests in the order they were
+ * sent, and every jbod_client_send must be matched by a jbod_client_recv of
+ * the same |op|, in order. Keep the number in flight bounded: a client that
+ * sends without reading can fill both socket buffers and deadlock.
+ * jbod_client_send returns true if the request was sent; jbod_client_recv
+ * returns 0 or -1 like jbod_client_operation and copies any payload to
+ * |block|. */
+bool jbod_client_send(uint32_t op, uint8_t *block);
+int jbod_client_recv(uint32_t op, uint8_t *block);
+
+/* Returns a count that changes whenever the calling thread sends a request
+ * or connects, so a caller can tell whether the connection may have moved
+ * since it last used it. */
+uint64_t jbod_client_ops(void);
+
+/* Returns the WRITE_BLOCKs the server has acknowledged, over all threads. */
+uint64_t jbod_client_writes(void);
+
+/* Acknowledges the next replies as soon as they arrive. Call it before
+ * draining replies with nothing more to send: the server holds a small reply
+ * back until the previous one is acknowledged, and a delayed acknowledgement
+ * would stall the drain for about 40 ms. */
+void jbod_client_quickack(void);
 bool jbod_connect(const char *ip, uint16_t port);
 void jbod_disconnect(void);
 
+/* Offer payload compression on the next connection. Must be called before
+ * jbod_connect; the server may still refuse it. */
+void jbod_set_compression(bool enable);
+
+/* Prints the number of payload bytes sent and received on the wire against
+ * their uncompressed size, and on how many of the connections that offered
+ * compression, over all threads, the server accepted it. */
+void jbod_print_net_stats(void);
+
+/* Gives every request to the server |ms| milliseconds to complete, sending
+ * and receiving included; 0 (the default) waits forever. An operation that
+ * misses its deadline fails with -1, and its connection is closed, as a late
+ * reply would be taken for the next request's; the next
+ * jbod_client_operation connects again. */
+void jbod_set_deadline(int ms);
+
+/* Hedges READ_BLOCKs sent with jbod_client_operation: a read still
+ * unanswered after the 95th percentile of the thread's recent reads is sent
+ * again on a second connection, and the first reply wins. Needs a server
+ * that serves connections concurrently, each with its own position, like
+ * stub_server; a server that serves one client at a time gets one hedge,
+ * which never answers. */
+void jbod_set_hedging(bool enable);
+
+/* Prints the deadlines missed and the reads hedged, over all threads. */
+void jbod_print_latency_stats(void);
+
+/* Asks for a read lease with every READ_BLOCK sent with
+ * jbod_client_operation, and calls |handler| with the disk and block of
+ * every invalidation the server pushes, on the thread whose connection it
+ * arrived on, before acknowledging it. Pass false to stop asking. */
+void jbod_set_leases(bool enable, void (*handler)(uint32_t disk, uint32_t block));
+
+/* Returns when the lease that came with the calling thread's last
+ * READ_BLOCK runs out, in CLOCK_MONOTONIC nanoseconds, counted from when
+ * the read was sent; 0 if it came without one. */
+uint64_t jbod_client_lease(void);
+
+/* Handles the invalidations that have arrived on the calling thread's
+ * connections without waiting for more. Call it before trusting a leased
+ * block; it does nothing while replies are due on the connection. */
+void jbod_client_poll(void);
+
+/* Prints the leases granted and the invalidations received, over all
+ * threads. */
+void jbod_print_lease_stats(void);
+
+/* Records every request sent and every reply received to the capture file
+ * at |path|, until jbod_capture(NULL) closes it. Pushed invalidations are
+ * not recorded, and hedging is off while capturing. Returns true on success
+ * and false on failure. */
+bool jbod_capture(const char *path);
+
+/* Replaces the server with the capture file at |path|: jbod_connect opens
+ * no connection, every request sent must be the next one captured, and
+ * every reply is the next one captured, after |latency_us| microseconds.
+ * The capture must come from a run of the same operations on one
+ * connection; a request that differs fails with -1. Returns true on success
+ * and false on failure. */
+bool jbod_replay(const char *path, int latency_us);
+
+/* Encodes a JBOD_BLOCK_SIZE block into |out| as a length byte followed by
+ * either a single fill byte (constant block) or (run length - 1, byte) pairs.
+ * Returns the total encoded length, or -1 if encoding would not save space. */
+int jbod_encode_block(const uint8_t *block, uint8_t *out);
+
+/* Decodes |len| bytes of run data produced by jbod_encode_block (without the
+ * length byte) into |block|. Returns true on success and false on failure. */
+bool jbod_decode_block(const uint8_t *in, int len, uint8_t *block);
+
+bool nread(int fd, int len, uint8_t *buf);
+bool nwrite(int fd, int len, uint8_t *buf);
+bool recv_packet(int fd, uint32_t *op, uint8_t *ret, uint8_t *block);
+
 #endif
@@ -0,0 +1,787 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "jbod.h"
+#include "net.h"
+#include "util.h"
+
+// A local stand-in for jbod_server. It speaks the same protocol and keeps the
+// same disk semantics, but also understands the protocol extensions of the
+// client (compression, the data generation, read leases) and can emulate a
+// slow link or a straggling server, so client features can be tested without
+// the reference binary.
+
+#define STUB_ARGUMENTS "hvp:r:ng:f:j:"
+#define USAGE                                                                         \
+  "USAGE: stub_server [-h] [-v] [-n] [-p port] [-r bytes_per_sec] [-g disks:blocks]\n" \
+  "                   [-f disk] [-j percent:ms]\n"                                      \
+  "\n"                                                                                \
+  "where:\n"                                                                          \
+  "    -h - help mode (display this message)\n"                                       \
+  "    -v - verbose, print every command\n"                                           \
+  "    -n - refuse payload compression\n"                                             \
+  "    -p - port to listen on (default 3000)\n"                                       \
+  "    -r - emulate a link of the given bandwidth in bytes per second\n"               \
+  "    -g - number of disks and blocks per disk (default 16:256)\n"                   \
+  "    -f - fail every read from the given disk\n"                                     \
+  "    -j - hold back the given percentage of replies for ms milliseconds, to\n"       \
+  "         emulate a server with stragglers\n"                                         \
+  "\n"
+
+/* state of the disks, shared by every connection */
+static uint8_t *disks = NULL;
+static uint32_t num_disks = JBOD_NUM_DISKS;
+static uint32_t blocks_per_disk = JBOD_NUM_BLOCKS_PER_DISK;
+static bool mounted = false;
+static bool write_permitted = false;
+static uint64_t generation = 0; // changes with every write and every restart
+static pthread_mutex_t disks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool verbose = false;
+static bool allow_compression = true;
+static long link_rate = 0; // bytes per second, 0 for unlimited
+static long failed_disk = -1; // reads from this disk fail, to test redundancy
+static int slow_percent = 0;  // replies held back to emulate stragglers, and for how long
+static int slow_ms = 0;
+
+/* A read lease in a connection's lease table */
+typedef struct {
+  uint64_t key;    // disk * blocks_per_disk + block + 1; 0 for a free slot
+  uint64_t expiry; // CLOCK_MONOTONIC ns; 0 once taken back
+} stub_lease_t;
+
+/* A request that arrived while a write waited for acknowledgements */
+typedef struct {
+  uint32_t op;
+  uint8_t info;
+  uint8_t block[JBOD_BLOCK_SIZE];
+} stub_request_t;
+
+/* per connection state: every client has its own seek position */
+typedef struct stub_conn {
+  int fd;
+  uint32_t disk;
+  uint32_t block;
+  bool compress;
+  bool nodelay;
+  unsigned int seed; // picks the replies held back
+  pthread_mutex_t send_lock; // one packet at a time: replies and pushes share fd
+  int wake[2];               // a byte is written when an invalidation is acknowledged
+  stub_request_t *stash;     // requests to serve before reading more from fd
+  int num_stashed, stash_next, stash_capacity;
+
+  // Protected by lease_lock
+  stub_lease_t *leases; // open addressing, linear probing
+  size_t lease_capacity, lease_used;
+  uint64_t pushed, acked; // invalidations sent to the client and acknowledged
+  int refs;               // writes waiting on this connection's acknowledgements
+  bool waiting, closed;
+  struct stub_conn *next;
+} stub_conn_t;
+
+/* An invalidation a write waits on */
+typedef struct {
+  stub_conn_t *holder;
+  uint64_t ticket; // done once the holder has acknowledged this many
+  uint64_t expiry;
+} stub_wait_t;
+
+/* every open connection, with the leases it holds */
+static stub_conn_t *conns = NULL;
+static int num_conns = 0;
+static pthread_mutex_t lease_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lease_cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Returns the contents of |block| on |disk| */
+static uint8_t *disk_block(uint32_t disk, uint32_t block)
+{
+  return disks + ((uint64_t)disk * blocks_per_disk + block) * JBOD_BLOCK_SIZE;
+}
+
+/* Sleeps for as long as |len| bytes take to cross the emulated link. */
+static void link_delay(int len)
+{
+  if (link_rate <= 0)
+  {
+    return;
+  }
+
+  long ns = (long)((double)len * 1e9 / link_rate);
+  struct timespec ts = {ns / 1000000000L, ns % 1000000000L};
+  nanosleep(&ts, NULL);
+}
+
+/* Sends a response; READ_BLOCK and SIGN_BLOCK carry |block| as payload. */
+static bool send_response(stub_conn_t *conn, uint32_t op, uint8_t info, uint8_t *block)
+{
+  uint8_t packet[HEADER_LEN + JBOD_BLOCK_SIZE];
+  int packet_len = HEADER_LEN;
+
+  uint32_t network_op = htonl(op);
+  memcpy(packet, &network_op, sizeof(network_op));
+
+  if (block != NULL)
+  {
+    info |= JBOD_INFO_PAYLOAD;
+
+    int encoded_len = conn->compress ? jbod_encode_block(block, packet + HEADER_LEN) : -1;
+    if (encoded_len > 0)
+    {
+      info |= JBOD_INFO_ENCODED;
+      packet_len += encoded_len;
+    }
+    else
+    {
+      memcpy(packet + HEADER_LEN, block, JBOD_BLOCK_SIZE);
+      packet_len += JBOD_BLOCK_SIZE;
+    }
+  }
+  packet[4] = info;
+
+  link_delay(packet_len);
+  return nwrite(conn->fd, packet_len, packet);
+}
+
+/* Returns the slot of |key| in |conn|'s lease table, or the free slot it
+ * would go in. The table must have a free slot. */
+static stub_lease_t *lease_slot(stub_conn_t *conn, uint64_t key)
+{
+  size_t i = key & (conn->lease_capacity - 1);
+  while (conn->leases[i].key != 0 && conn->leases[i].key != key)
+  {
+    i = (i + 1) & (conn->lease_capacity - 1);
+  }
+  return &conn->leases[i];
+}
+
+/* Grants |conn| a lease on |key| until |expiry|. Leases taken back keep
+ * their slot until the table is rebuilt, without them, when it fills up. */
+static void grant_lease(stub_conn_t *conn, uint64_t key, uint64_t expiry)
+{
+  if (2 * (conn->lease_used + 1) > conn->lease_capacity)
+  {
+    uint64_t now = now_ns();
+    size_t live = 0;
+    for (size_t i = 0; i < conn->lease_capacity; i++)
+    {
+      live += conn->leases[i].expiry > now;
+    }
+
+    size_t capacity = 64;
+    while (capacity < 4 * (live + 1))
+    {
+      capacity *= 2;
+    }
+    stub_lease_t *old = conn->leases;
+    size_t old_capacity = conn->lease_capacity;
+    conn->leases = calloc(capacity, sizeof(stub_lease_t));
+    if (conn->leases == NULL)
+      err(1, "cannot allocate %zu leases", capacity);
+    conn->lease_capacity = capacity;
+    conn->lease_used = 0;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+      if (old[i].expiry > now)
+      {
+        *lease_slot(conn, old[i].key) = old[i];
+        conn->lease_used++;
+      }
+    }
+    free(old);
+  }
+
+  stub_lease_t *l = lease_slot(conn, key);
+  if (l->key == 0)
+  {
+    l->key = key;
+    conn->lease_used++;
+  }
+  l->expiry = expiry;
+}
+
+/* Takes back |conn|'s lease on |key|. Returns when it would have run out, or
+ * 0 if it had none. */
+static uint64_t take_lease(stub_conn_t *conn, uint64_t key)
+{
+  if (conn->lease_capacity == 0)
+  {
+    return 0;
+  }
+
+  stub_lease_t *l = lease_slot(conn, key);
+  uint64_t expiry = l->expiry;
+  l->expiry = 0;
+  return expiry;
+}
+
+/* Takes back the unexpired leases other connections than |conn| hold on
+ * |block| of |disk|, which was just written, and takes a reference on each
+ * holder. Returns how many were set in |*waits|, which the caller frees. */
+static int take_leases(stub_conn_t *conn, uint32_t disk, uint32_t block, stub_wait_t **waits)
+{
+  uint64_t key = (uint64_t)disk * blocks_per_disk + block + 1;
+  uint64_t now = now_ns();
+  int n = 0;
+
+  pthread_mutex_lock(&lease_lock);
+  *waits = malloc(num_conns * sizeof(stub_wait_t));
+  for (stub_conn_t *c = conns; c != NULL && *waits != NULL; c = c->next)
+  {
+    uint64_t expiry = c != conn ? take_lease(c, key) : 0;
+    if (expiry > now)
+    {
+      c->refs++;
+      (*waits)[n++] = (stub_wait_t){c, 0, expiry};
+    }
+  }
+  pthread_mutex_unlock(&lease_lock);
+
+  return n;
+}
+
+/* Pushes the invalidation of |block| of |disk| to every holder in |waits|.
+ * Pushes to a connection go out in the order they were ticketed, and its
+ * client acknowledges them in that order. */
+static void push_invalidations(stub_wait_t *waits, int n, uint32_t disk, uint32_t block)
+{
+  uint32_t op = jbod_encode_op(JBOD_INVALIDATE, disk, block);
+  for (int i = 0; i < n; i++)
+  {
+    stub_conn_t *c = waits[i].holder;
+    pthread_mutex_lock(&c->send_lock);
+    if (send_response(c, op, JBOD_INFO_PUSH, NULL))
+    {
+      pthread_mutex_lock(&lease_lock);
+      waits[i].ticket = ++c->pushed;
+      pthread_mutex_unlock(&lease_lock);
+    }
+    pthread_mutex_unlock(&c->send_lock);
+
+    if (verbose)
+    {
+      printf("invalidate [disk %u block %u] on fd %d\n", disk, block, c->fd);
+    }
+  }
+}
+
+/* Records an acknowledgement from |conn|'s client, and wakes the writes
+ * waiting for acknowledgements. */
+static void ack_received(stub_conn_t *conn)
+{
+  pthread_mutex_lock(&lease_lock);
+  conn->acked++;
+  for (stub_conn_t *c = conns; c != NULL; c = c->next)
+  {
+    if (c->waiting)
+    {
+      (void)!write(c->wake[1], "", 1);
+    }
+  }
+  pthread_mutex_unlock(&lease_lock);
+}
+
+/* Keeps a request that arrived while waiting, to be served in order later */
+static bool stash_request(stub_conn_t *conn, uint32_t op, uint8_t info, const uint8_t *block)
+{
+  if (conn->num_stashed == conn->stash_capacity)
+  {
+    int capacity = conn->stash_capacity ? 2 * conn->stash_capacity : 16;
+    stub_request_t *stash = realloc(conn->stash, capacity * sizeof(stub_request_t));
+    if (stash == NULL)
+    {
+      return false;
+    }
+    conn->stash = stash;
+    conn->stash_capacity = capacity;
+  }
+
+  stub_request_t *r = &conn->stash[conn->num_stashed++];
+  r->op = op;
+  r->info = info;
+  memcpy(r->block, block, JBOD_BLOCK_SIZE);
+  return true;
+}
+
+/* Reads the next request of |conn|'s client, stashed ones first. Returns
+ * false once the client is gone. */
+static bool next_request(stub_conn_t *conn, uint32_t *op, uint8_t *info, uint8_t *block)
+{
+  if (conn->stash_next < conn->num_stashed)
+  {
+    stub_request_t *r = &conn->stash[conn->stash_next++];
+    *op = r->op;
+    *info = r->info;
+    memcpy(block, r->block, JBOD_BLOCK_SIZE);
+    if (conn->stash_next == conn->num_stashed)
+    {
+      conn->stash_next = conn->num_stashed = 0;
+    }
+    return true;
+  }
+  return recv_packet(conn->fd, op, info, block);
+}
+
+/* Waits until every holder in |waits| has acknowledged its invalidation, has
+ * closed, or its lease has run out, then drops the references on them. The
+ * client may acknowledge invalidations pushed to it meanwhile, so its
+ * requests are read while waiting: acknowledgements are recorded, and the
+ * rest stashed. Returns false if the client is gone. */
+static bool wait_for_acks(stub_conn_t *conn, stub_wait_t *waits, int n)
+{
+  bool connected = true;
+
+  pthread_mutex_lock(&lease_lock);
+  conn->waiting = true;
+  while (connected)
+  {
+    uint64_t now = now_ns(), next = 0;
+    for (int i = 0; i < n; i++)
+    {
+      stub_conn_t *c = waits[i].holder;
+      bool done = c->closed || waits[i].ticket == 0 || c->acked >= waits[i].ticket ||
+                  waits[i].expiry <= now;
+      if (!done && (next == 0 || waits[i].expiry < next))
+      {
+        next = waits[i].expiry;
+      }
+    }
+    if (next == 0)
+    {
+      break;
+    }
+    pthread_mutex_unlock(&lease_lock);
+
+    struct pollfd p[2] = {{conn->fd, POLLIN, 0}, {conn->wake[0], POLLIN, 0}};
+    poll(p, 2, (next - now + 999999) / 1000000);
+    if (p[1].revents & POLLIN)
+    {
+      uint8_t drain[64];
+      while (read(conn->wake[0], drain, sizeof(drain)) > 0)
+        ;
+    }
+    if (p[0].revents & (POLLIN | POLLHUP | POLLERR))
+    {
+      uint32_t op, disk, blk;
+      uint8_t info, block[JBOD_BLOCK_SIZE];
+      int cmd = -1;
+      connected = recv_packet(conn->fd, &op, &info, block);
+      if (connected)
+      {
+        jbod_decode_op(op, &cmd, &disk, &blk);
+      }
+      if (cmd == JBOD_INVALIDATE)
+      {
+        ack_received(conn);
+      }
+      else if (connected)
+      {
+        connected = stash_request(conn, op, info, block);
+      }
+    }
+
+    pthread_mutex_lock(&lease_lock);
+  }
+  conn->waiting = false;
+  for (int i = 0; i < n; i++)
+  {
+    waits[i].holder->refs--;
+  }
+  pthread_cond_broadcast(&lease_cond);
+  pthread_mutex_unlock(&lease_lock);
+
+  return connected;
+}
+
+/* Executes one command against the disks. Returns 0 on success and -1 on
+ * failure, and sets |*reply| to the payload to send back, if any. */
+static int execute(stub_conn_t *conn, uint32_t op, uint8_t *block, uint8_t **reply)
+{
+  int cmd;
+  uint32_t disk, blk;
+  int rc = 0;
+
+  jbod_decode_op(op, &cmd, &disk, &blk);
+
+  *reply = NULL;
+
+  pthread_mutex_lock(&disks_lock);
+  switch (cmd)
+  {
+  case JBOD_MOUNT:
+    rc = mounted ? -1 : 0;
+    mounted = true;
+    break;
+  case JBOD_UNMOUNT:
+    rc = mounted ? 0 : -1;
+    mounted = false;
+    break;
+  case JBOD_SEEK_TO_DISK:
+    rc = mounted && disk < num_disks ? 0 : -1;
+    if (rc == 0)
+    {
+      conn->disk = disk;
+      conn->block = 0;
+    }
+    break;
+  case JBOD_SEEK_TO_BLOCK:
+    rc = mounted && blk < blocks_per_disk ? 0 : -1;
+    if (rc == 0)
+    {
+      conn->block = blk;
+    }
+    break;
+  case JBOD_READ_BLOCK:
+    if (!mounted || conn->block >= blocks_per_disk || conn->disk == failed_disk)
+    {
+      rc = -1;
+      break;
+    }
+    memcpy(block, disk_block(conn->disk, conn->block), JBOD_BLOCK_SIZE);
+    conn->block++;
+    *reply = block;
+    break;
+  case JBOD_WRITE_PERMISSION:
+    rc = write_permitted ? -1 : 0;
+    write_permitted = true;
+    break;
+  case JBOD_REVOKE_WRITE_PERMISSION:
+    rc = write_permitted ? 0 : -1;
+    write_permitted = false;
+    break;
+  case JBOD_WRITE_BLOCK:
+    if (!mounted || !write_permitted || conn->block >= blocks_per_disk)
+    {
+      rc = -1;
+      break;
+    }
+    memcpy(disk_block(conn->disk, conn->block), block, JBOD_BLOCK_SIZE);
+    conn->block++;
+    generation++;
+    break;
+  case JBOD_SIGN_BLOCK: {
+    // Connections are served concurrently, so the signature needs its own buffer
+    char sig[SHA1_SIG_LEN];
+    if (!mounted || disk >= num_disks || blk >= blocks_per_disk)
+    {
+      rc = -1;
+      break;
+    }
+    memset(block, 0, JBOD_BLOCK_SIZE);
+    snprintf((char *)block, JBOD_BLOCK_SIZE, "SIG(disk,block) %2u %3u : %s\n",
+             disk, blk, sha1_sig_r(disk_block(disk, blk), JBOD_BLOCK_SIZE, sig));
+    *reply = block;
+    break;
+  }
+  case JBOD_GET_GENERATION:
+    memset(block, 0, JBOD_BLOCK_SIZE);
+    for (int i = 0; i < 8; i++)
+    {
+      block[i] = generation >> (56 - 8 * i);
+    }
+    *reply = block;
+    break;
+  default:
+    rc = -1;
+    break;
+  }
+  pthread_mutex_unlock(&disks_lock);
+
+  if (verbose)
+  {
+    printf("cmd %d [disk %u block %u] result %d\n", cmd, disk, blk, rc);
+  }
+
+  return rc;
+}
+
+static void *serve_client(void *arg)
+{
+  stub_conn_t *conn = (stub_conn_t *)arg;
+  uint8_t block[JBOD_BLOCK_SIZE];
+  uint32_t op;
+  uint8_t info;
+
+  while (next_request(conn, &op, &info, block))
+  {
+    // Account for what the request cost on the emulated link; encoding is
+    // deterministic, so re-encoding gives back the size it had on the wire
+    int request_len = HEADER_LEN;
+    if (info & JBOD_INFO_PAYLOAD)
+    {
+      uint8_t encoded[JBOD_BLOCK_SIZE];
+      int encoded_len = (info & JBOD_INFO_ENCODED) ? jbod_encode_block(block, encoded) : -1;
+      request_len += encoded_len > 0 ? encoded_len : JBOD_BLOCK_SIZE;
+    }
+    link_delay(request_len);
+
+    int cmd;
+    uint32_t op_disk, op_block;
+    jbod_decode_op(op, &cmd, &op_disk, &op_block);
+    if (cmd == JBOD_INVALIDATE)
+    {
+      // An acknowledgement, which gets no reply
+      ack_received(conn);
+      continue;
+    }
+
+    uint8_t reply_info = 0;
+    if ((info & JBOD_INFO_COMPRESS) && allow_compression)
+    {
+      conn->compress = true;
+      reply_info |= JBOD_INFO_COMPRESS;
+    }
+
+    // A write is answered once the clients caching the block have forgotten
+    // it, so it does not hold the connection's send lock meanwhile: the
+    // write of another connection may be pushing an invalidation to it. Any
+    // other reply goes out under the lock taken before executing, so an
+    // invalidation of a block read never overtakes the read's reply.
+    bool write = cmd == JBOD_WRITE_BLOCK;
+    if (!write)
+    {
+      pthread_mutex_lock(&conn->send_lock);
+    }
+
+    // A lease is granted before reading, so a write that misses it has
+    // already changed the block read
+    uint32_t disk = conn->disk, blk = conn->block;
+    uint64_t key = (uint64_t)disk * blocks_per_disk + blk + 1;
+    bool lease = cmd == JBOD_READ_BLOCK && (info & JBOD_INFO_LEASE);
+    if (lease)
+    {
+      // Invalidations go out right behind replies, so Nagle's algorithm
+      // would hold them until the client acknowledged the reply
+      if (!conn->nodelay)
+      {
+        int one = 1;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        conn->nodelay = true;
+      }
+      pthread_mutex_lock(&lease_lock);
+      grant_lease(conn, key, now_ns() + JBOD_LEASE_MS * 1000000ULL);
+      pthread_mutex_unlock(&lease_lock);
+    }
+
+    uint8_t *reply;
+    int rc = execute(conn, op, block, &reply);
+    if (rc != 0)
+    {
+      reply_info |= JBOD_INFO_RET;
+    }
+
+    if (lease && rc == 0)
+    {
+      reply_info |= JBOD_INFO_LEASE;
+    }
+    else if (lease)
+    {
+      pthread_mutex_lock(&lease_lock);
+      take_lease(conn, key);
+      pthread_mutex_unlock(&lease_lock);
+    }
+
+    if (write && rc == 0)
+    {
+      stub_wait_t *waits;
+      int n = take_leases(conn, disk, blk, &waits);
+      push_invalidations(waits, n, disk, blk);
+      bool connected = wait_for_acks(conn, waits, n);
+      free(waits);
+      if (!connected)
+      {
+        break;
+      }
+    }
+
+    if (slow_percent > 0 && rand_r(&conn->seed) % 100 < (unsigned int)slow_percent)
+    {
+      struct timespec ts = {slow_ms / 1000, slow_ms % 1000 * 1000000L};
+      nanosleep(&ts, NULL);
+    }
+
+    if (write)
+    {
+      pthread_mutex_lock(&conn->send_lock);
+    }
+    bool sent = send_response(conn, op, reply_info, reply);
+    pthread_mutex_unlock(&conn->send_lock);
+    if (!sent)
+    {
+      break;
+    }
+  }
+
+  // Leave the registry, then wait for the writes still pushing to us
+  pthread_mutex_lock(&lease_lock);
+  for (stub_conn_t **c = &conns; *c != NULL; c = &(*c)->next)
+  {
+    if (*c == conn)
+    {
+      *c = conn->next;
+      break;
+    }
+  }
+  num_conns--;
+  conn->closed = true;
+  while (conn->refs > 0)
+  {
+    pthread_cond_wait(&lease_cond, &lease_lock);
+  }
+  pthread_mutex_unlock(&lease_lock);
+
+  close(conn->fd);
+  close(conn->wake[0]);
+  close(conn->wake[1]);
+  pthread_mutex_destroy(&conn->send_lock);
+  free(conn->leases);
+  free(conn->stash);
+  free(conn);
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  int ch, port = JBOD_PORT;
+
+  while ((ch = getopt(argc, argv, STUB_ARGUMENTS)) != -1)
+  {
+    switch (ch)
+    {
+    case 'h':
+      fprintf(stderr, USAGE);
+      return 0;
+    case 'v':
+      verbose = true;
+      break;
+    case 'n':
+      allow_compression = false;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'r':
+      link_rate = atol(optarg);
+      break;
+    case 'f':
+      failed_disk = atol(optarg);
+      break;
+    case 'j':
+      if (sscanf(optarg, "%d:%d", &slow_percent, &slow_ms) != 2 || slow_percent < 0 ||
+          slow_percent > 100 || slow_ms < 0)
+      {
+        errx(1, "invalid straggler setting %s", optarg);
+      }
+      break;
+    case 'g':
+      if (sscanf(optarg, "%u:%u", &num_disks, &blocks_per_disk) != 2 || num_disks == 0 ||
+          num_disks > JBOD_OP_MAX_DISKS || blocks_per_disk == 0 || blocks_per_disk > JBOD_OP_MAX_BLOCKS)
+      {
+        errx(1, "invalid geometry %s", optarg);
+      }
+      break;
+    default:
+      fprintf(stderr, USAGE);
+      return -1;
+    }
+  }
+
+  // Start from the clock, so a restarted server with fresh disks never
+  // reports a generation a client cached against the previous one
+  struct timespec boot;
+  clock_gettime(CLOCK_REALTIME, &boot);
+  generation = (uint64_t)boot.tv_sec * 1000000000ULL + boot.tv_nsec;
+
+  // A client may go away with a push on the way to it
+  signal(SIGPIPE, SIG_IGN);
+
+  disks = calloc((uint64_t)num_disks * blocks_per_disk, JBOD_BLOCK_SIZE);
+  if (disks == NULL)
+    err(1, "cannot allocate %u disks of %u blocks", num_disks, blocks_per_disk);
+
+  int sd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sd == -1)
+    err(1, "socket");
+
+  int one = 1;
+  setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    err(1, "bind");
+  if (listen(sd, 16) < 0)
+    err(1, "listen");
+
+  printf("stub server listening on port %d...\n", port);
+  fflush(stdout);
+
+  while (1)
+  {
+    int fd = accept(sd, NULL, NULL);
+    if (fd < 0)
+    {
+      continue;
+    }
+
+    stub_conn_t *conn = calloc(1, sizeof(stub_conn_t));
+    if (conn == NULL || pipe(conn->wake) != 0)
+    {
+      close(fd);
+      free(conn);
+      continue;
+    }
+    conn->fd = fd;
+    conn->seed = fd;
+    pthread_mutex_init(&conn->send_lock, NULL);
+    fcntl(conn->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(conn->wake[1], F_SETFL, O_NONBLOCK);
+
+    pthread_mutex_lock(&lease_lock);
+    conn->next = conns;
+    conns = conn;
+    num_conns++;
+    pthread_mutex_unlock(&lease_lock);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, serve_client, conn) != 0)
+    {
+      pthread_mutex_lock(&lease_lock);
+      conns = conn->next;
+      num_conns--;
+      pthread_mutex_unlock(&lease_lock);
+      close(fd);
+      close(conn->wake[0]);
+      close(conn->wake[1]);
+      free(conn);
+      continue;
+    }
+    pthread_detach(tid);
+  }
+
+  return 0;
+}
@@ -10,6 +10,9 @@
 #include <fcntl.h>
 #include <err.h>
 #include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "cache.h"
 #include "jbod.h"
@@ -17,21 +20,79 @@
 #include "util.h"
 #include "tester.h"
 #include "net.h"
+#include "trace.h"
 
-#define TESTER_ARGUMENTS "hw:s:"
-#define USAGE                                               \
-  "USAGE: test [-h] [-w workload-file] [-s cache_size] \n"  \
-  "\n"                                                      \
-  "where:\n"                                                \
-  "    -h - help mode (display this message)\n"             \
-  "\n"                                                      \
+#define TESTER_ARGUMENTS "hw:s:zdag:l:c:t:P:xoq:D:HCK:Y:y:L:T:V"
+#define USAGE                                                                      \
+  "USAGE: test [-h] [-z] [-d] [-a] [-g disks:blocks] [-l layout] [-w workload-file]\n" \
+  "            [-s cache_size] [-c cache-file] [-t threads [-P rr|range] [-x] [-o]]\n" \
+  "            [-q depth] [-D ms] [-H] [-C] [-V] [-K capture-file]\n"            \
+  "            [-Y capture-file [-y us]] [-L log-file] [-T trace-file]\n"         \
+  "\n"                                                                             \
+  "where:\n"                                                                       \
+  "    -h - help mode (display this message)\n"                                    \
+  "    -z - offer payload compression to the server\n"                             \
+  "    -d - deduplicate identical blocks in the cache\n"                           \
+  "    -a - only admit a missed block to a full cache if it is looked up more\n"   \
+  "         often than the entry it would evict (TinyLFU)\n"                      \
+  "    -g - array geometry, number of disks and blocks per disk (default 16:256)\n" \
+  "    -l - block layout: linear (default), striped:<stripe unit in blocks>\n"     \
+  "         or mirrored\n"                                                         \
+  "    -c - keep the cache in the given file and re-attach it on the next run\n"   \
+  "    -t - replay READs and WRITEs on this many threads, each with its own\n"     \
+  "         connection (needs a server that serves clients concurrently)\n"      \
+  "    -P - share lines out round-robin (rr, default) or by address range\n"     \
+  "    -x - split ops at range boundaries so threads never share a block, which\n" \
+  "         keeps the result identical to a single-threaded replay\n"            \
+  "    -o - give every thread its own cache of cache_size entries\n"             \
+  "    -q - queue up to this many blocks of READs and WRITEs and run them in\n"   \
+  "         elevator order (single-threaded replay only)\n"                      \
+  "    -D - fail any server operation not done within this many milliseconds\n"  \
+  "    -H - hedge slow reads on a second connection (needs a server that\n"      \
+  "         serves clients concurrently)\n"                                      \
+  "    -C - keep cached blocks only under read leases from the server, which\n"  \
+  "         invalidates them when another client writes them\n"                  \
+  "    -V - run SIGNALL from a Merkle tree of the blocks' signatures, signing\n" \
+  "         only the blocks written since the last SIGNALL\n"                     \
+  "    -K - record every request and reply exchanged with the server to the\n"   \
+  "         given file\n"                                                        \
+  "    -Y - replay a file recorded with -K in place of the server, which must\n" \
+  "         come from a run with the same options (single-threaded only)\n"     \
+  "    -y - with -Y, delay every reply by this many microseconds\n"              \
+  "    -L - write a binary debug log of every server operation to the given\n"   \
+  "         file (read it with logdecode)\n"                                     \
+  "    -T - write a timeline of every operation's spans to the given file, in\n" \
+  "         Chrome trace-event JSON (needs a build with make TRACE=1)\n"          \
+  "\n"                                                                             \
 
 int run_workload(char *workload, int cache_size);
+int run_workload_threaded(char *workload, int cache_size);
+int equals(const char *s1, const char *s2);
+
+static char *cache_file = NULL;
+static uint64_t cache_generation = 0; // server generation the cache file was opened at
+static uint64_t cache_writes = 0;     // WRITE_BLOCKs acknowledged by then
+
+/* How the multi-threaded replay shares a trace's READs and WRITEs out */
+typedef enum {
+  PARTITION_ROUND_ROBIN, // line i of a phase goes to thread i % N
+  PARTITION_RANGE,       // thread k gets the k-th slice of the address space
+} partition_t;
+
+static int num_threads = 1;
+static partition_t partition = PARTITION_ROUND_ROBIN;
+static bool exclusive = false;      // split ops so no two threads share a block
+static bool private_caches = false; // a cache per thread instead of a shared one
+static int queue_depth = 0;         // blocks to queue before running them, 0 for none
+static bool incremental = false;    // SIGNALL through mdadm_verify
+static int verifies = 0;
+static uint64_t blocks_signed = 0;
 
 int main(int argc, char *argv[])
 {
-  int ch, cache_size = 0;
-  char *workload = NULL;
+  int ch, cache_size = 0, deadline = 0, replay_latency = 0;
+  bool compress = false, hedge = false, leases = false;
+  char *workload = NULL, *capture_file = NULL, *replay_file = NULL;
 
   while ((ch = getopt(argc, argv, TESTER_ARGUMENTS)) != -1) {
     switch (ch) {
@@ -44,6 +105,112 @@ int main(int argc, char *argv[])
       case 'w':
         workload = optarg;
         break;
+      case 'z':
+        compress = true;
+        break;
+      case 'd':
+        cache_set_dedup(true);
+        break;
+      case 'a':
+        cache_set_admission(true);
+        break;
+      case 'c':
+        cache_file = optarg;
+        break;
+      case 't':
+        num_threads = atoi(optarg);
+        if (num_threads < 1) {
+          fprintf(stderr, "Invalid number of threads [%s], aborting.\n", optarg);
+          return -1;
+        }
+        break;
+      case 'P':
+        if (equals(optarg, "rr")) {
+          partition = PARTITION_ROUND_ROBIN;
+        } else if (equals(optarg, "range")) {
+          partition = PARTITION_RANGE;
+        } else {
+          fprintf(stderr, "Invalid partitioning [%s], aborting.\n", optarg);
+          return -1;
+        }
+        break;
+      case 'x':
+        exclusive = true;
+        partition = PARTITION_RANGE;
+        break;
+      case 'o':
+        private_caches = true;
+        break;
+      case 'q':
+        queue_depth = atoi(optarg);
+        if (mdadm_queue_set_depth(queue_depth) != 1) {
+          fprintf(stderr, "Invalid queue depth [%s], aborting.\n", optarg);
+          return -1;
+        }
+        break;
+      case 'D':
+        deadline = atoi(optarg);
+        if (deadline < 1) {
+          fprintf(stderr, "Invalid deadline [%s], aborting.\n", optarg);
+          return -1;
+        }
+        break;
+      case 'H':
+        hedge = true;
+        break;
+      case 'C':
+        leases = true;
+        break;
+      case 'V':
+        incremental = true;
+        break;
+      case 'K':
+        capture_file = optarg;
+        break;
+      case 'Y':
+        replay_file = optarg;
+        break;
+      case 'y':
+        replay_latency = atoi(optarg);
+        if (replay_latency < 0) {
+          fprintf(stderr, "Invalid replay latency [%s], aborting.\n", optarg);
+          return -1;
+        }
+        break;
+      case 'T':
+        if (!trace_set_output(optarg)) {
+          fprintf(stderr, "Tracing is not compiled in, rebuild with make TRACE=1.\n");
+          return -1;
+        }
+        break;
+      case 'L':
+        set_debug_logfile(optarg);
+        set_debug_log_binary();
+        enable_debug_log();
+        break;
+      case 'g': {
+        uint32_t disks, blocks;
+        if (sscanf(optarg, "%u:%u", &disks, &blocks) != 2 || mdadm_set_geometry(disks, blocks) != 1) {
+          fprintf(stderr, "Invalid geometry [%s], aborting.\n", optarg);
+          return -1;
+        }
+        break;
+      }
+      case 'l': {
+        uint32_t unit = 0;
+        int rc = -1;
+        if (equals(optarg, "linear"))
+          rc = mdadm_set_layout(MDADM_LAYOUT_LINEAR, 1);
+        else if (sscanf(optarg, "striped:%u", &unit) == 1)
+          rc = mdadm_set_layout(MDADM_LAYOUT_STRIPED, unit);
+        else if (equals(optarg, "mirrored"))
+          rc = mdadm_set_layout(MDADM_LAYOUT_MIRRORED, 1);
+        if (rc != 1) {
+          fprintf(stderr, "Invalid layout [%s], aborting.\n", optarg);
+          return -1;
+        }
+        break;
+      }
       default:
         fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
         return -1;
@@ -55,11 +222,45 @@ int main(int argc, char *argv[])
     return -1;
   }
 
+  if (queue_depth && num_threads > 1) {
+    fprintf(stderr, "The queue (-q) only works with a single-threaded replay, aborting.\n");
+    return -1;
+  }
+
+  if (replay_file && num_threads > 1) {
+    fprintf(stderr, "A capture (-Y) can only be replayed single-threaded, aborting.\n");
+    return -1;
+  }
+
+  if (capture_file && !jbod_capture(capture_file))
+    return -1;
+  if (replay_file && !jbod_replay(replay_file, replay_latency))
+    return -1;
+
+  jbod_set_compression(compress);
+  jbod_set_deadline(deadline);
+  jbod_set_hedging(hedge);
+  mdadm_set_leases(leases);
   if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
     return -1;
   
-  run_workload(workload, cache_size);
+  if (num_threads > 1)
+    run_workload_threaded(workload, cache_size);
+  else
+    run_workload(workload, cache_size);
   jbod_disconnect();
+  jbod_capture(NULL);
+
+  if (compress)
+    jbod_print_net_stats();
+  if (deadline || hedge)
+    jbod_print_latency_stats();
+  if (leases)
+    jbod_print_lease_stats();
+  if (incremental) {
+    fprintf(stderr, "verify: %d SIGNALLs, %lu blocks signed\n", verifies, (unsigned long)blocks_signed);
+    merkle_print_stats();
+  }
 
   return 0;
 }
@@ -70,21 +271,93 @@ int equals(const char *s1, const char *s2) {
 
 static uint32_t encode_op(jbod_cmd_t cmd, int disk_num, int block_num) {
   assert(cmd >= 0 && cmd < JBOD_NUM_CMDS);
-  assert(block_num >= 0 && block_num < JBOD_NUM_BLOCKS_PER_DISK);
+  assert(block_num >= 0 && block_num < (int)mdadm_get_geometry()->blocks_per_disk);
+
+  return jbod_encode_op(cmd, disk_num, block_num);
+}
 
-  uint32_t op = 0;
-  op |= cmd << 12;
-  op |= disk_num;
-  op |= block_num << 4;
+/* Creates the cache of |cache_size| entries, if any, re-attaching the cache
+ * file when one was given and it is still valid */
+static void open_cache(int cache_size) {
+  if (!cache_size)
+    return;
 
-  return op;
+  // A cache file is only re-attached if the server's data has not changed
+  if (cache_file) {
+    mdadm_get_generation(&cache_generation);
+    cache_writes = jbod_client_writes();
+    cache_set_backing_file(cache_file, cache_generation);
+  }
+  if (cache_create(cache_size) != 1)
+    errx(1, "Failed to create cache.");
+  if (cache_file)
+    fprintf(stderr, "Cache file %s: %s\n", cache_file, cache_reattached() ? "re-attached" : "starting cold");
+}
+
+static void close_cache(int cache_size) {
+  if (!cache_size)
+    return;
+
+  // Our own writes went through the cache, and each moved the server one
+  // generation on. If it moved further, another client wrote too, and the
+  // contents are left valid for no generation.
+  if (cache_file) {
+    uint64_t generation;
+    mdadm_get_generation(&generation);
+    uint64_t own = jbod_client_writes() - cache_writes;
+    cache_set_generation(cache_generation != 0 && generation - cache_generation == own ? generation : 0);
+  }
+  cache_destroy();
+}
+
+/* Returns true if |line| is a command on the whole array rather than a READ
+ * or a WRITE */
+static bool is_control(const char *line) {
+  // WRITE_PERMIT also matches WRITE_PERMIT_REVOKE
+  return equals(line, "MOUNT") || equals(line, "UNMOUNT") || equals(line, "WRITE_PERMIT") || equals(line, "SIGNALL");
+}
+
+/* Runs |line| if it is a command on the whole array rather than a READ or a
+ * WRITE. Returns true if it was. */
+static bool run_control(const char *line) {
+  if (equals(line, "MOUNT")) {
+    mdadm_mount();
+  } else if (equals(line, "UNMOUNT")) {
+    mdadm_unmount();
+  } else if (equals(line, "WRITE_PERMIT")) {
+    mdadm_write_permission();
+  } else if (equals(line, "WRITE_PERMIT_REVOKE")) {
+    mdadm_revoke_write_permission();
+  } else if (equals(line, "SIGNALL") && incremental) {
+    const mdadm_geometry_t *geo = mdadm_get_geometry();
+    uint8_t root[MERKLE_DIGEST_LEN];
+    int n = mdadm_verify(root);
+    if (n < 0)
+      return true;
+    verifies++;
+    blocks_signed += n;
+    for (uint32_t i = 0; i < geo->num_disks; ++i)
+      for (uint32_t j = 0; j < geo->blocks_per_disk; ++j)
+        fputs(mdadm_block_signature(i, j), stdout);
+  } else if (equals(line, "SIGNALL")) {
+    const mdadm_geometry_t *geo = mdadm_get_geometry();
+    for (int i = 0; i < (int)geo->num_disks; ++i)
+      for (int j = 0; j < (int)geo->blocks_per_disk; ++j) {
+        uint8_t b[JBOD_BLOCK_SIZE];
+        jbod_client_operation(encode_op(JBOD_SIGN_BLOCK, i, j), b);
+        fprintf(stdout, "%s", b);
+      }
+  } else {
+    return false;
+  }
+  return true;
 }
 
 int run_workload(char *workload, int cache_size) {
   char line[256], cmd[32];
   uint8_t buf[MAX_IO_SIZE];
-  uint32_t addr, len, ch;
-  int rc;
+  uint64_t addr;
+  uint32_t len, ch;
 
   memset(buf, 0, MAX_IO_SIZE);
 
@@ -92,50 +365,286 @@ int run_workload(char *workload, int cache_size) {
   if (!f)
     err(1, "Cannot open workload file %s", workload);
 
-  if (cache_size) {
-    rc = cache_create(cache_size);
-    if (rc != 1)
-      errx(1, "Failed to create cache.");
-  }
+  open_cache(cache_size);
 
   int line_num = 0;
   while (fgets(line, 256, f)) {
     ++line_num;
     line[strlen(line)-1] = '\0';
-    if (equals(line, "MOUNT")) {
-      rc = mdadm_mount();
-    } else if (equals(line, "UNMOUNT")) {
-      rc = mdadm_unmount();
-    } else if (equals(line, "WRITE_PERMIT")) {
-      rc = mdadm_write_permission();
-    } else if (equals(line, "WRITE_PERMIT_REVOKE")) {
-      rc = mdadm_revoke_write_permission();
-    } else if (equals(line, "SIGNALL")) {
-      for (int i = 0; i < JBOD_NUM_DISKS; ++i)
-        for (int j = 0; j < JBOD_NUM_BLOCKS_PER_DISK; ++j) {
-          uint8_t b[JBOD_BLOCK_SIZE];
-          jbod_client_operation(encode_op(JBOD_SIGN_BLOCK, i, j), b);
-          fprintf(stdout, "%s", b);
-        }
+    // Commands on the whole array wait for the queued blocks
+    if (is_control(line))
+      mdadm_queue_flush();
+    if (run_control(line))
+      continue;
+
+    if (sscanf(line, "%7s %" SCNu64 " %4u %3u", cmd, &addr, &len, &ch) != 4)
+      errx(1, "Failed to parse command: [%s\n], aborting.", line);
+    if (equals(cmd, "READ")) {
+      mdadm_queue_read(addr, len, buf);
+    } else if (equals(cmd, "WRITE")) {
+      memset(buf, ch, len);
+      mdadm_queue_write(addr, len, buf);
     } else {
-      if (sscanf(line, "%7s %7u %4u %3u", cmd, &addr, &len, &ch) != 4)
-        errx(1, "Failed to parse command: [%s\n], aborting.", line);
-      if (equals(cmd, "READ")) {
-        rc = mdadm_read(addr, len, buf);
-      } else if (equals(cmd, "WRITE")) {
-        memset(buf, ch, len);
-        rc = mdadm_write(addr, len, buf);
+      errx(1, "Unknown command [%s] on line %d, aborting.", line, line_num);
+    }
+  }
+  fclose(f);
+  mdadm_queue_flush();
+
+  close_cache(cache_size);
+
+  cache_print_hit_rate();
+  mdadm_print_mirror_stats();
+  if (queue_depth)
+    mdadm_print_seek_stats();
+
+  return 0;
+}
+
+/* Multi-threaded replay. The trace is cut into phases at every command on
+ * the whole array (MOUNT, WRITE_PERMIT, SIGNALL...), which the main thread
+ * runs on its own connection. The READs and WRITEs of a phase are shared out
+ * to the replay threads, each with its own connection, and the next phase
+ * starts when all of them are done. */
+
+typedef struct {
+  bool write;
+  uint64_t addr;
+  uint32_t len;
+  uint8_t ch;
+} replay_op_t;
+
+typedef struct {
+  int id;
+  pthread_t tid;
+  int cache_size;
+  replay_op_t *ops; // this thread's share of the current phase
+  int num_ops, max_ops;
+  double *lat;      // latency of every op replayed so far, in microseconds
+  int num_lat, max_lat;
+  int failed;       // ops that returned an error
+} replay_thread_t;
+
+static replay_thread_t *threads = NULL;
+static pthread_barrier_t phase_start, phase_end;
+static bool replay_done = false;
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void add_op(replay_thread_t *t, bool write, uint64_t addr, uint32_t len, uint8_t ch) {
+  if (t->num_ops == t->max_ops) {
+    t->max_ops = t->max_ops ? 2 * t->max_ops : 256;
+    t->ops = realloc(t->ops, t->max_ops * sizeof(replay_op_t));
+    if (!t->ops)
+      err(1, "Cannot allocate the replay ops");
+  }
+  t->ops[t->num_ops++] = (replay_op_t){write, addr, len, ch};
+}
+
+/* Hands the |seq|-th op of the current phase to a thread */
+static void assign_op(int seq, bool write, uint64_t addr, uint32_t len, uint8_t ch) {
+  if (partition == PARTITION_ROUND_ROBIN) {
+    add_op(&threads[seq % num_threads], write, addr, len, ch);
+    return;
+  }
+
+  // Slices are whole blocks, so threads with disjoint slices never share one
+  uint64_t capacity = mdadm_get_geometry()->capacity;
+  uint64_t slice = capacity / num_threads / JBOD_BLOCK_SIZE * JBOD_BLOCK_SIZE;
+  if (slice == 0)
+    slice = JBOD_BLOCK_SIZE;
+  uint64_t owner = addr / slice < (uint64_t)num_threads ? addr / slice : num_threads - 1;
+
+  // An op past the end is left whole, to fail as it would on one thread
+  if (!exclusive || addr >= capacity || len > capacity - addr) {
+    add_op(&threads[owner], write, addr, len, ch);
+    return;
+  }
+
+  // Split the op where it crosses into another thread's slice
+  while (len > 0) {
+    owner = addr / slice < (uint64_t)num_threads ? addr / slice : num_threads - 1;
+    uint64_t end = owner == (uint64_t)num_threads - 1 ? capacity : (owner + 1) * slice;
+    uint32_t piece = end - addr < len ? end - addr : len;
+    add_op(&threads[owner], write, addr, piece, ch);
+    addr += piece;
+    len -= piece;
+  }
+}
+
+static void *replay_worker(void *arg) {
+  replay_thread_t *t = (replay_thread_t *)arg;
+  uint8_t buf[MAX_IO_SIZE];
+
+  char name[32];
+  snprintf(name, sizeof(name), "replay %d", t->id);
+  trace_set_thread_name(name);
+
+  if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
+    errx(1, "Replay thread %d cannot connect to the server.", t->id);
+  if (private_caches && t->cache_size) {
+    cache_use_private(true);
+    if (cache_create(t->cache_size) != 1)
+      errx(1, "Failed to create the cache of replay thread %d.", t->id);
+  }
+
+  while (true) {
+    pthread_barrier_wait(&phase_start);
+    if (replay_done)
+      break;
+
+    for (int i = 0; i < t->num_ops; i++) {
+      replay_op_t *op = &t->ops[i];
+      double start = now_us();
+      int rc;
+      if (op->write) {
+        memset(buf, op->ch, op->len);
+        rc = mdadm_write(op->addr, op->len, buf);
       } else {
-        errx(1, "Unknown command [%s] on line %d, aborting.", line, line_num);
+        rc = mdadm_read(op->addr, op->len, buf);
+      }
+
+      if (rc < 0)
+        t->failed++;
+      if (t->num_lat == t->max_lat) {
+        t->max_lat = t->max_lat ? 2 * t->max_lat : 1024;
+        t->lat = realloc(t->lat, t->max_lat * sizeof(double));
+        if (!t->lat)
+          err(1, "Cannot allocate the latency samples");
       }
+      t->lat[t->num_lat++] = now_us() - start;
     }
+
+    pthread_barrier_wait(&phase_end);
   }
-  fclose(f);
 
-  if (cache_size)
+  if (private_caches && t->cache_size) {
+    pthread_mutex_lock(&print_lock);
+    fprintf(stderr, "thread %d cache: ", t->id);
+    cache_print_hit_rate();
+    pthread_mutex_unlock(&print_lock);
     cache_destroy();
+    cache_use_private(false);
+  }
+  jbod_disconnect();
+  return NULL;
+}
 
-  cache_print_hit_rate();
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Prints ops/sec over all threads and the latency of each thread */
+static void print_replay_report(double elapsed_us) {
+  long total = 0;
+
+  fprintf(stderr, "%-7s %8s %7s %10s %10s %10s %10s\n", "thread", "ops", "failed", "mean us", "p50 us", "p99 us", "max us");
+  for (int k = 0; k < num_threads; k++) {
+    replay_thread_t *t = &threads[k];
+    double sum = 0;
+    qsort(t->lat, t->num_lat, sizeof(double), compare_doubles);
+    for (int i = 0; i < t->num_lat; i++)
+      sum += t->lat[i];
+
+    int n = t->num_lat;
+    fprintf(stderr, "%-7d %8d %7d %10.1f %10.1f %10.1f %10.1f\n", k, n, t->failed, n ? sum / n : 0,
+            n ? t->lat[n / 2] : 0, n ? t->lat[(int)(n * 0.99)] : 0, n ? t->lat[n - 1] : 0);
+    total += n;
+  }
+
+  fprintf(stderr, "%d threads, %ld ops in %.3f s: %.0f ops/sec\n", num_threads, total, elapsed_us / 1e6,
+          elapsed_us > 0 ? total / (elapsed_us / 1e6) : 0);
+}
+
+int run_workload_threaded(char *workload, int cache_size) {
+  char line[256], cmd[32];
+  uint64_t addr;
+  uint32_t len, ch;
+  double elapsed = 0;
+
+  FILE *f = fopen(workload, "r");
+  if (!f)
+    err(1, "Cannot open workload file %s", workload);
+
+  // The shared cache belongs to the main thread and is locked around every call
+  if (!private_caches) {
+    cache_set_locking(true);
+    open_cache(cache_size);
+  }
+
+  threads = calloc(num_threads, sizeof(replay_thread_t));
+  pthread_barrier_init(&phase_start, NULL, num_threads + 1);
+  pthread_barrier_init(&phase_end, NULL, num_threads + 1);
+  for (int k = 0; k < num_threads; k++) {
+    threads[k].id = k;
+    threads[k].cache_size = cache_size;
+    if (pthread_create(&threads[k].tid, NULL, replay_worker, &threads[k]) != 0)
+      errx(1, "Cannot start replay thread %d.", k);
+  }
+
+  int line_num = 0, seq = 0;
+  bool eof = false;
+  while (!eof) {
+    eof = fgets(line, 256, f) == NULL;
+    if (!eof) {
+      ++line_num;
+      line[strlen(line)-1] = '\0';
+    }
+
+    if (eof || is_control(line)) {
+      // Replay the phase collected so far, then run the command on its own
+      if (seq > 0) {
+        double start = now_us();
+        pthread_barrier_wait(&phase_start);
+        pthread_barrier_wait(&phase_end);
+        elapsed += now_us() - start;
+        for (int k = 0; k < num_threads; k++)
+          threads[k].num_ops = 0;
+        seq = 0;
+      }
+      if (!eof)
+        run_control(line);
+      continue;
+    }
+
+    if (sscanf(line, "%7s %" SCNu64 " %4u %3u", cmd, &addr, &len, &ch) != 4)
+      errx(1, "Failed to parse command: [%s\n], aborting.", line);
+    if (equals(cmd, "READ"))
+      assign_op(seq++, false, addr, len, ch);
+    else if (equals(cmd, "WRITE"))
+      assign_op(seq++, true, addr, len, ch);
+    else
+      errx(1, "Unknown command [%s] on line %d, aborting.", line, line_num);
+  }
+  fclose(f);
+
+  replay_done = true;
+  pthread_barrier_wait(&phase_start);
+  for (int k = 0; k < num_threads; k++)
+    pthread_join(threads[k].tid, NULL);
+
+  if (!private_caches) {
+    close_cache(cache_size);
+    if (cache_size)
+      cache_print_hit_rate();
+  }
+  mdadm_print_mirror_stats();
+  mdadm_print_fetch_stats();
+  print_replay_report(elapsed);
+
+  for (int k = 0; k < num_threads; k++) {
+    free(threads[k].ops);
+    free(threads[k].lat);
+  }
+  free(threads);
+  pthread_barrier_destroy(&phase_start);
+  pthread_barrier_destroy(&phase_end);
 
   return 0;
 }
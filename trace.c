@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+
+#ifdef MDADM_TRACE
+
+#define TRACE_MAX_DEPTH 32
+
+typedef struct {
+  const char *cat;
+  const char *name;
+  uint64_t start; // ns since the trace started
+  uint64_t dur;
+  int num_args;
+  const char *keys[TRACE_MAX_ARGS];
+  int64_t values[TRACE_MAX_ARGS];
+} trace_span_t;
+
+/* A thread's track: its spans in the order they began, and the ones still
+ * open. Only its thread touches it until the timeline is written. */
+typedef struct trace_track {
+  int tid;
+  char name[32];
+  trace_span_t *spans;
+  size_t num_spans;
+  size_t capacity;
+  size_t open[TRACE_MAX_DEPTH];
+  int depth;
+  struct trace_track *next;
+} trace_track_t;
+
+static const char *output_path = NULL;
+static uint64_t start_ns = 0;
+static trace_track_t *_Atomic tracks = NULL;
+static _Atomic int num_tracks = 0;
+static _Thread_local trace_track_t *this_track __attribute__((tls_model("initial-exec"))) = NULL;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Returns the calling thread's track, creating it on its first span */
+static trace_track_t *get_track(void)
+{
+  if (this_track != NULL)
+  {
+    return this_track;
+  }
+
+  trace_track_t *t = calloc(1, sizeof(trace_track_t));
+  if (t == NULL)
+  {
+    return NULL;
+  }
+  t->tid = atomic_fetch_add(&num_tracks, 1);
+  snprintf(t->name, sizeof(t->name), t->tid == 0 ? "main" : "thread %d", t->tid);
+  t->next = atomic_load(&tracks);
+  while (!atomic_compare_exchange_weak(&tracks, &t->next, t))
+    ;
+  this_track = t;
+  return t;
+}
+
+static void write_args(FILE *f, const trace_span_t *s)
+{
+  fprintf(f, ",\"args\":{");
+  for (int i = 0; i < s->num_args; i++)
+  {
+    fprintf(f, "%s\"%s\":%lld", i ? "," : "", s->keys[i], (long long)s->values[i]);
+  }
+  fprintf(f, "}");
+}
+
+/* Writes every track as Chrome trace-event JSON: a thread_name metadata
+ * event per track, then a complete ("X") event per span, in microseconds */
+static void write_trace(void)
+{
+  FILE *f = fopen(output_path, "w");
+  if (f == NULL)
+  {
+    perror(output_path);
+    return;
+  }
+
+  int pid = getpid();
+  bool first = true;
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for (trace_track_t *t = atomic_load(&tracks); t != NULL; t = t->next)
+  {
+    fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",\n", pid, t->tid, t->name);
+    first = false;
+
+    uint64_t now = now_ns() - start_ns;
+    for (size_t i = 0; i < t->num_spans; i++)
+    {
+      trace_span_t *s = &t->spans[i];
+      // Spans still open at exit end now
+      uint64_t dur = s->dur != UINT64_MAX ? s->dur : now - s->start;
+      fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+              s->name, s->cat, s->start / 1e3, dur / 1e3, pid, t->tid);
+      if (s->num_args > 0)
+      {
+        write_args(f, s);
+      }
+      fprintf(f, "}");
+    }
+  }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+}
+
+bool trace_set_output(const char *path)
+{
+  if (output_path == NULL)
+  {
+    atexit(write_trace);
+  }
+  output_path = path;
+  start_ns = now_ns();
+  return true;
+}
+
+void trace_set_thread_name(const char *name)
+{
+  if (output_path == NULL)
+  {
+    return;
+  }
+
+  trace_track_t *t = get_track();
+  if (t != NULL)
+  {
+    snprintf(t->name, sizeof(t->name), "%s", name);
+  }
+}
+
+void trace_begin(const char *cat, const char *name)
+{
+  if (output_path == NULL)
+  {
+    return;
+  }
+
+  trace_track_t *t = get_track();
+  if (t == NULL)
+  {
+    return;
+  }
+
+  // Spans too deep or beyond memory are not recorded, but still counted so
+  // that trace_end pairs up with the right span
+  if (t->depth < TRACE_MAX_DEPTH)
+  {
+    if (t->num_spans == t->capacity)
+    {
+      size_t capacity = t->capacity ? 2 * t->capacity : 4096;
+      trace_span_t *spans = realloc(t->spans, capacity * sizeof(trace_span_t));
+      if (spans != NULL)
+      {
+        t->spans = spans;
+        t->capacity = capacity;
+      }
+    }
+    if (t->num_spans < t->capacity)
+    {
+      trace_span_t *s = &t->spans[t->num_spans];
+      s->cat = cat;
+      s->name = name;
+      s->dur = UINT64_MAX;
+      s->num_args = 0;
+      s->start = now_ns() - start_ns;
+      t->open[t->depth] = t->num_spans++;
+    }
+    else
+    {
+      t->open[t->depth] = SIZE_MAX;
+    }
+  }
+  t->depth++;
+}
+
+void trace_end(void)
+{
+  trace_track_t *t = this_track;
+  if (output_path == NULL || t == NULL || t->depth == 0)
+  {
+    return;
+  }
+
+  t->depth--;
+  if (t->depth < TRACE_MAX_DEPTH && t->open[t->depth] != SIZE_MAX)
+  {
+    trace_span_t *s = &t->spans[t->open[t->depth]];
+    s->dur = now_ns() - start_ns - s->start;
+  }
+}
+
+void trace_arg(const char *key, int64_t value)
+{
+  trace_track_t *t = this_track;
+  if (output_path == NULL || t == NULL || t->depth == 0 || t->depth > TRACE_MAX_DEPTH ||
+      t->open[t->depth - 1] == SIZE_MAX)
+  {
+    return;
+  }
+
+  trace_span_t *s = &t->spans[t->open[t->depth - 1]];
+  if (s->num_args < TRACE_MAX_ARGS)
+  {
+    s->keys[s->num_args] = key;
+    s->values[s->num_args] = value;
+    s->num_args++;
+  }
+}
+
+void trace_end_scope(int *scope)
+{
+  (void)scope;
+  trace_end();
+}
+
+#else
+
+bool trace_set_output(const char *path)
+{
+  (void)path;
+  return false;
+}
+
+void trace_set_thread_name(const char *name)
+{
+  (void)name;
+}
+
+void trace_begin(const char *cat, const char *name)
+{
+  (void)cat;
+  (void)name;
+}
+
+void trace_end(void)
+{
+}
+
+void trace_arg(const char *key, int64_t value)
+{
+  (void)key;
+  (void)value;
+}
+
+void trace_end_scope(int *scope)
+{
+  (void)scope;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Span instrumentation, exported as a Chrome trace-event timeline that
+ * Perfetto (ui.perfetto.dev) and chrome://tracing load. Spans are timed
+ * intervals on the calling thread's track and nest by time. They are kept
+ * in memory and written out at exit.
+ *
+ * The TRACE_* macros only record anything when built with -DMDADM_TRACE
+ * (make TRACE=1); otherwise they compile to nothing. |cat| and |name| must
+ * be string literals, or strings that outlive the program. */
+
+/* Writes the timeline to |path| at exit. Returns false if tracing was not
+ * compiled in. */
+bool trace_set_output(const char *path);
+
+/* Names the calling thread's track */
+void trace_set_thread_name(const char *name);
+
+void trace_begin(const char *cat, const char *name);
+void trace_end(void);
+
+/* Attaches an integer argument to the innermost open span; the first
+ * TRACE_MAX_ARGS of a span are kept */
+void trace_arg(const char *key, int64_t value);
+#define TRACE_MAX_ARGS 3
+
+/* Ends the span of a TRACE_SCOPE when its variable goes out of scope */
+void trace_end_scope(int *scope);
+
+#ifdef MDADM_TRACE
+#define TRACE_BEGIN(cat, name) trace_begin(cat, name)
+#define TRACE_END() trace_end()
+#define TRACE_ARG(key, value) trace_arg(key, value)
+// A span from here to the end of the enclosing block, however it is left
+#define TRACE_SCOPE(cat, name) \
+  int trace_scope_ __attribute__((cleanup(trace_end_scope), unused)) = (trace_begin(cat, name), 0)
+#else
+#define TRACE_BEGIN(cat, name) ((void)0)
+#define TRACE_END() ((void)0)
+#define TRACE_ARG(key, value) ((void)0)
+#define TRACE_SCOPE(cat, name) ((void)0)
+#endif
+
+#endif
@@ -1,50 +1,578 @@
 #include <err.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <openssl/sha.h>
 #include <openssl/rand.h>
 
 #include "util.h"
 
+/* The debug log is asynchronous. debug_log only packs its arguments into a
+ * binary record on a ring owned by the calling thread; a drainer thread
+ * collects the records of every thread, formats them (or copies them, for a
+ * binary log) and writes them in batches. A full ring drops records rather
+ * than block the caller. */
+
+#define LOG_RING_BYTES (256 * 1024) /* per thread, a power of two */
+#define LOG_ARGS_SIZE 232   /* most bytes of packed arguments in a record */
+#define LOG_MAX_FORMATS 1024
+#define LOG_MAX_STRING 200  /* longest %s argument kept */
+#define LOG_BATCH_SIZE 65536
+#define LOG_SKIP 0xffff     /* fmt_id of the filler up to the end of a ring */
+
+/* Records are packed back to back in a ring, 8-byte aligned */
+typedef struct {
+  uint64_t ns;      /* CLOCK_MONOTONIC time of the call */
+  uint16_t fmt_id;  /* index in formats[], or LOG_SKIP */
+  uint16_t len;     /* bytes used in args */
+  uint8_t args[];
+} log_record_t;
+
+typedef struct log_ring {
+  _Atomic uint64_t head;    /* bytes ever written, by the owner */
+  _Atomic uint64_t tail;    /* bytes ever drained, by the drainer */
+  _Atomic uint64_t dropped; /* records lost to a full ring */
+  uint16_t thread;
+  uint64_t drain_to;        /* head as last seen by the drainer */
+  struct log_ring *next;
+  _Alignas(64) uint8_t data[LOG_RING_BYTES];
+} log_ring_t;
+
+/* What the arguments of a format are, so a call packs them without parsing */
+enum { LOG_ARG_INT, LOG_ARG_LONG, LOG_ARG_DOUBLE, LOG_ARG_LONG_DOUBLE, LOG_ARG_STRING };
+#define LOG_MAX_ARGS 16
+
+typedef struct {
+  const char *fmt;
+  uint8_t num_args;
+  uint8_t kinds[LOG_MAX_ARGS];
+  uint8_t after[LOG_MAX_ARGS]; /* bytes the arguments after each one need at least */
+  uint16_t max_len;            /* most bytes the arguments take */
+  bool oversized;              /* fixed-size arguments alone overflow a record */
+  bool written; /* definition already in the binary log (drainer only) */
+} log_format_t;
+
 static int debug_log_enabled = 0;
 static int debug_log_fd = 2;  /* by default write log to stderr */
+static bool debug_log_binary = false;
+
+/* Formats are identified by the address of their string; format_slots is an
+ * open-addressed table of formats[] index + 1, read without locking */
+static log_format_t formats[LOG_MAX_FORMATS];
+static _Atomic int format_slots[2 * LOG_MAX_FORMATS];
+static int num_formats = 0;
+static pthread_mutex_t formats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static log_ring_t *_Atomic rings = NULL;
+// initial-exec: util.o is built -fpic, and the default model would make
+// every access a call
+static _Thread_local log_ring_t *this_ring __attribute__((tls_model("initial-exec"))) = NULL;
+static _Atomic int num_rings = 0;
+static _Atomic uint64_t dropped_formats = 0;
+
+static pthread_once_t drainer_once = PTHREAD_ONCE_INIT;
+static pthread_t drainer;
+static _Atomic bool drainer_stopping = false;
 
 void enable_debug_log(void) {
   debug_log_enabled = 1;
 }
 
 void set_debug_logfile(const char *filename) {
-  debug_log_fd = open(filename, O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR);
+  debug_log_fd = open(filename, O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR|S_IWUSR);
   if (debug_log_fd == -1)
     err(1, "failed to open log file %s", filename);
 }
 
+void set_debug_log_binary(void) {
+  debug_log_binary = true;
+}
+
+/* Returns the kind of argument the conversion ending at |conv| takes, with
+ * length modifier |mod| ('l' for l, ll, q, z, j and t, 'L' for L), or -1 for
+ * none */
+static int arg_kind(char conv, char mod) {
+  switch (conv) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+      return mod != 0 ? LOG_ARG_LONG : LOG_ARG_INT;
+    case 'p':
+      return LOG_ARG_LONG;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+      return mod == 'L' ? LOG_ARG_LONG_DOUBLE : LOG_ARG_DOUBLE;
+    case 's':
+      return LOG_ARG_STRING;
+    default:
+      return -1;
+  }
+}
+
+/* Returns the bytes an argument of |kind| is packed in, a string's length
+ * byte only */
+static size_t arg_size(int kind) {
+  switch (kind) {
+    case LOG_ARG_INT:
+      return sizeof(int);
+    case LOG_ARG_LONG_DOUBLE:
+      return sizeof(long double);
+    case LOG_ARG_STRING:
+      return 1;
+    default:
+      return 8;
+  }
+}
+
+/* Splits the conversion starting at fmt[0] == '%' into |spec| (NUL
+ * terminated), the number of '*' in it, its length modifier and its
+ * conversion. Returns the length of the conversion in |fmt|. */
+static int parse_conversion(const char *fmt, char *spec, int size, int *stars, char *mod, char *conv) {
+  int i = 1;
+  *stars = 0;
+  *mod = 0;
+  while (fmt[i] && strchr("-+ #0123456789.*", fmt[i])) {
+    *stars += fmt[i] == '*';
+    i++;
+  }
+  while (fmt[i] && strchr("hlLqjzt", fmt[i])) {
+    if (fmt[i] != 'h')
+      *mod = fmt[i] == 'L' ? 'L' : 'l';
+    i++;
+  }
+  *conv = fmt[i];
+  if (fmt[i])
+    i++;
+  int n = i < size - 1 ? i : size - 1;
+  memcpy(spec, fmt, n);
+  spec[n] = '\0';
+  return i;
+}
+
+/* Returns the format of |fmt|, registering it on its first use, or NULL if
+ * there is no room for it */
+static const log_format_t *find_format(const char *fmt) {
+  uint32_t h = (uint32_t)(((uintptr_t)fmt * 0x9e3779b97f4a7c15ULL) >> 40);
+  int slot;
+  for (int probe = 0; probe < 2 * LOG_MAX_FORMATS; probe++) {
+    slot = (h + probe) & (2 * LOG_MAX_FORMATS - 1);
+    int id = atomic_load_explicit(&format_slots[slot], memory_order_acquire);
+    if (id == 0)
+      break;
+    if (formats[id - 1].fmt == fmt)
+      return &formats[id - 1];
+  }
+
+  pthread_mutex_lock(&formats_lock);
+  const log_format_t *found = NULL;
+  for (int probe = 0; probe < 2 * LOG_MAX_FORMATS; probe++) {
+    slot = (h + probe) & (2 * LOG_MAX_FORMATS - 1);
+    int id = atomic_load_explicit(&format_slots[slot], memory_order_relaxed);
+    if (id != 0 && formats[id - 1].fmt == fmt) {
+      found = &formats[id - 1];
+      break;
+    }
+    if (id == 0 && num_formats < LOG_MAX_FORMATS) {
+      log_format_t *f = &formats[num_formats];
+      f->fmt = fmt;
+      f->num_args = 0;
+      for (const char *p = fmt; *p; p++) {
+        if (*p != '%')
+          continue;
+        char spec[32], mod, conv;
+        int stars;
+        p += parse_conversion(p, spec, sizeof(spec), &stars, &mod, &conv) - 1;
+        int kind = arg_kind(conv, mod);
+        for (int s = 0; s < stars && f->num_args < LOG_MAX_ARGS; s++)
+          f->kinds[f->num_args++] = LOG_ARG_INT;
+        if (kind != -1 && f->num_args < LOG_MAX_ARGS)
+          f->kinds[f->num_args++] = kind;
+      }
+      int len = 0;
+      for (int i = f->num_args - 1; i >= 0; i--) {
+        f->after[i] = len;
+        len += arg_size(f->kinds[i]);
+      }
+      // Only strings are truncated to fit, so such a format is never logged
+      f->oversized = len > LOG_ARGS_SIZE;
+      for (int i = 0; i < f->num_args; i++)
+        len += f->kinds[i] == LOG_ARG_STRING ? LOG_MAX_STRING : 0;
+      f->max_len = len < LOG_ARGS_SIZE ? len : LOG_ARGS_SIZE;
+      num_formats++;
+      atomic_store_explicit(&format_slots[slot], num_formats, memory_order_release);
+      found = f;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&formats_lock);
+  return found;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool write_all(int fd, const uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+/* The drainer's output buffer */
+static uint8_t batch[LOG_BATCH_SIZE];
+static size_t batch_len = 0;
+
+static void batch_flush(void) {
+  write_all(debug_log_fd, batch, batch_len);
+  batch_len = 0;
+}
+
+static void batch_append(const void *data, size_t len) {
+  if (batch_len + len > sizeof(batch))
+    batch_flush();
+  memcpy(batch + batch_len, data, len);
+  batch_len += len;
+}
+
+/* Appends one record to the batch, as a line of text or in binary */
+static void batch_record(const log_record_t *rec, uint16_t thread) {
+  log_format_t *f = &formats[rec->fmt_id];
+
+  if (!debug_log_binary) {
+    char line[1024];
+    int n = debug_log_format(f->fmt, rec->args, rec->len, line, sizeof(line) - 1);
+    line[n++] = '\n';
+    batch_append(line, n);
+    return;
+  }
+
+  if (!f->written) {
+    uint8_t def[5];
+    uint16_t len = strlen(f->fmt);
+    def[0] = DEBUG_LOG_FORMAT;
+    memcpy(def + 1, &rec->fmt_id, 2);
+    memcpy(def + 3, &len, 2);
+    batch_append(def, sizeof(def));
+    batch_append(f->fmt, len);
+    f->written = true;
+  }
+  uint8_t head[15];
+  head[0] = DEBUG_LOG_RECORD;
+  memcpy(head + 1, &rec->ns, 8);
+  memcpy(head + 9, &rec->fmt_id, 2);
+  memcpy(head + 11, &thread, 2);
+  memcpy(head + 13, &rec->len, 2);
+  batch_append(head, sizeof(head));
+  batch_append(rec->args, rec->len);
+}
+
+typedef struct {
+  const log_record_t *rec;
+  uint16_t thread;
+} log_pending_t;
+
+static int compare_pending(const void *a, const void *b) {
+  uint64_t x = ((const log_pending_t *)a)->rec->ns, y = ((const log_pending_t *)b)->rec->ns;
+  return x < y ? -1 : x > y;
+}
+
+static uint32_t record_size(uint16_t len) {
+  return (sizeof(log_record_t) + len + 7) & ~7u;
+}
+
+/* Writes out the records on every ring, in time order. Returns how many. */
+static size_t drain_rings(void) {
+  static log_pending_t *pending = NULL;
+  static size_t capacity = 0;
+  size_t n = 0;
+
+  // Rings are only ever added at the front, so the list can be walked
+  // while other threads add theirs; each ring's head is read once
+  log_ring_t *first = atomic_load_explicit(&rings, memory_order_acquire);
+  for (log_ring_t *r = first; r != NULL; r = r->next) {
+    uint64_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    r->drain_to = atomic_load_explicit(&r->head, memory_order_acquire);
+    while (pos < r->drain_to) {
+      uint32_t off = pos & (LOG_RING_BYTES - 1);
+      const log_record_t *rec = (const log_record_t *)(r->data + off);
+      if (LOG_RING_BYTES - off < sizeof(log_record_t) || rec->fmt_id == LOG_SKIP) {
+        pos += LOG_RING_BYTES - off;
+        continue;
+      }
+      if (n == capacity) {
+        capacity = capacity ? 2 * capacity : 4096;
+        pending = realloc(pending, capacity * sizeof(log_pending_t));
+        if (pending == NULL)
+          err(1, "cannot allocate the debug log batch");
+      }
+      pending[n].rec = rec;
+      pending[n].thread = r->thread;
+      n++;
+      pos += record_size(rec->len);
+    }
+  }
+  if (n == 0)
+    return 0;
+
+  qsort(pending, n, sizeof(log_pending_t), compare_pending);
+  for (size_t i = 0; i < n; i++)
+    batch_record(pending[i].rec, pending[i].thread);
+  batch_flush();
+
+  // Only now can the owners reuse the slots
+  for (log_ring_t *r = first; r != NULL; r = r->next)
+    atomic_store_explicit(&r->tail, r->drain_to, memory_order_release);
+  return n;
+}
+
+static void *drain_log(void *arg) {
+  const struct timespec idle = {0, 1000000};
+  (void)arg;
+
+  if (debug_log_binary)
+    write_all(debug_log_fd, (const uint8_t *)DEBUG_LOG_MAGIC, 8);
+
+  while (drain_rings() > 0 || !atomic_load(&drainer_stopping)) {
+    nanosleep(&idle, NULL);
+  }
+  return NULL;
+}
+
+/* Stops the drainer once it has written out everything logged so far */
+static void stop_drainer(void) {
+  atomic_store(&drainer_stopping, true);
+  pthread_join(drainer, NULL);
+
+  uint64_t dropped = atomic_load(&dropped_formats);
+  for (log_ring_t *r = atomic_load(&rings); r != NULL; r = r->next)
+    dropped += atomic_load(&r->dropped);
+  if (dropped > 0)
+    fprintf(stderr, "debug log: dropped %lu messages\n", (unsigned long)dropped);
+}
+
+static void start_drainer(void) {
+  if (pthread_create(&drainer, NULL, drain_log, NULL) != 0)
+    err(1, "cannot start the debug log drainer");
+  atexit(stop_drainer);
+}
+
+/* Returns the calling thread's ring, creating it on its first message */
+static log_ring_t *get_ring(void) {
+  if (this_ring != NULL)
+    return this_ring;
+
+  pthread_once(&drainer_once, start_drainer);
+  log_ring_t *r = calloc(1, sizeof(log_ring_t));
+  if (r == NULL)
+    return NULL;
+  r->thread = atomic_fetch_add(&num_rings, 1);
+  r->next = atomic_load(&rings);
+  while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+    ;
+  this_ring = r;
+  return r;
+}
+
 void debug_log(const char *fmt, ...) {
   if (!debug_log_enabled)
     return;
 
+  log_ring_t *r = get_ring();
+  const log_format_t *f = find_format(fmt);
+  if (r == NULL || f == NULL || f->oversized) {
+    atomic_fetch_add_explicit(&dropped_formats, 1, memory_order_relaxed);
+    return;
+  }
+
+  // A record never wraps: if the largest this format can make does not fit
+  // before the end of the ring, the rest of the ring is skipped
+  uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  uint32_t off = head & (LOG_RING_BYTES - 1);
+  uint32_t need = record_size(f->max_len);
+  uint32_t skip = off + need > LOG_RING_BYTES ? LOG_RING_BYTES - off : 0;
+  if (head + skip + need - atomic_load_explicit(&r->tail, memory_order_acquire) > LOG_RING_BYTES) {
+    atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+    return;
+  }
+  if (skip > 0) {
+    if (skip >= sizeof(log_record_t))
+      ((log_record_t *)(r->data + off))->fmt_id = LOG_SKIP;
+    head += skip;
+    off = 0;
+  }
+
+  log_record_t *rec = (log_record_t *)(r->data + off);
+  rec->ns = now_ns();
+  rec->fmt_id = f - formats;
+
   va_list args;
   va_start(args, fmt);
-  vdprintf(debug_log_fd, fmt, args);
+  uint8_t *p = rec->args;
+  for (int i = 0; i < f->num_args; i++) {
+    switch (f->kinds[i]) {
+      case LOG_ARG_INT: {
+        int v = va_arg(args, int);
+        memcpy(p, &v, sizeof(v));
+        p += sizeof(v);
+        break;
+      }
+      case LOG_ARG_LONG: {
+        long v = va_arg(args, long);
+        memcpy(p, &v, sizeof(v));
+        p += sizeof(v);
+        break;
+      }
+      case LOG_ARG_DOUBLE: {
+        double v = va_arg(args, double);
+        memcpy(p, &v, sizeof(v));
+        p += sizeof(v);
+        break;
+      }
+      case LOG_ARG_LONG_DOUBLE: {
+        long double v = va_arg(args, long double);
+        memcpy(p, &v, sizeof(v));
+        p += sizeof(v);
+        break;
+      }
+      case LOG_ARG_STRING: {
+        // Strings are copied, truncated to what is left of the record
+        const char *v = va_arg(args, const char *);
+        ptrdiff_t left = rec->args + f->max_len - p - 1 - f->after[i];
+        size_t room = left > 0 ? left : 0;
+        size_t len = v ? strnlen(v, LOG_MAX_STRING) : 0;
+        len = len < room ? len : room;
+        *p++ = len;
+        memcpy(p, v, len);
+        p += len;
+        break;
+      }
+    }
+  }
   va_end(args);
-  dprintf(debug_log_fd, "\n");
+  rec->len = p - rec->args;
+
+  atomic_store_explicit(&r->head, head + record_size(rec->len), memory_order_release);
 }
 
-const char *sha1_sig(uint8_t *buf, uint32_t size) {
-  static char sig[80];
-  uint8_t obuf[20];
+/* Takes the next argument of kind |kind| out of |args|, failing if the
+ * record is too short */
+static bool unpack_arg(int kind, const uint8_t **args, const uint8_t *end, void *out, size_t size) {
+  if (kind == LOG_ARG_STRING) {
+    if (*args >= end || *args + 1 + **args > end)
+      return false;
+    size_t len = **args < size - 1 ? **args : size - 1;
+    memcpy(out, *args + 1, len);
+    ((char *)out)[len] = '\0';
+    *args += 1 + **args;
+    return true;
+  }
+
+  size_t len = arg_size(kind);
+  if (*args + len > end)
+    return false;
+  memcpy(out, *args, len);
+  *args += len;
+  return true;
+}
+
+int debug_log_format(const char *fmt, const uint8_t *args, uint32_t len, char *out, uint32_t size) {
+  const uint8_t *end = args + len;
+  uint32_t n = 0;
 
-  SHA1(buf, size, obuf);
+  for (const char *p = fmt; *p && n < size - 1; ) {
+    if (*p != '%' || p[1] == '%') {
+      out[n++] = *p;
+      p += *p == '%' ? 2 : 1;
+      continue;
+    }
+
+    char spec[32], mod, conv;
+    int stars, star[2] = {0, 0};
+    p += parse_conversion(p, spec, sizeof(spec), &stars, &mod, &conv);
+    int kind = arg_kind(conv, mod);
+    for (int s = 0; s < stars; s++)
+      if (s >= 2 || !unpack_arg(LOG_ARG_INT, &args, end, &star[s], sizeof(int)))
+        return n;
+    if (kind == -1)
+      continue;
+
+    // Each conversion is printed on its own, with the type it was packed as
+    union {
+      int i;
+      long l;
+      double d;
+      long double ld;
+      char s[LOG_MAX_STRING + 1];
+    } v;
+    if (!unpack_arg(kind, &args, end, &v, sizeof(v)))
+      return n;
+    char *o = out + n;
+    size_t room = size - n;
+    int w;
+#define FORMAT_ARG(x) (stars == 0 ? snprintf(o, room, spec, x) : \
+                       stars == 1 ? snprintf(o, room, spec, star[0], x) : \
+                                    snprintf(o, room, spec, star[0], star[1], x))
+    if (conv == 'p')
+      w = FORMAT_ARG((void *)v.l);
+    else if (kind == LOG_ARG_INT)
+      w = FORMAT_ARG(v.i);
+    else if (kind == LOG_ARG_LONG)
+      w = FORMAT_ARG(v.l);
+    else if (kind == LOG_ARG_DOUBLE)
+      w = FORMAT_ARG(v.d);
+    else if (kind == LOG_ARG_LONG_DOUBLE)
+      w = FORMAT_ARG(v.ld);
+    else
+      w = FORMAT_ARG(v.s);
+#undef FORMAT_ARG
+    if (w < 0)
+      return n;
+    n += (uint32_t)w < room ? (uint32_t)w : room - 1;
+  }
+  out[n] = '\0';
+  return n;
+}
+
+void sha1_digest(const uint8_t *buf, uint32_t size, uint8_t *digest) {
+  SHA1(buf, size, digest);
+}
+
+const char *sha1_sig_r(const uint8_t *buf, uint32_t size, char *sig) {
+  static const char hex[] = "0123456789abcdef";
+  uint8_t obuf[SHA1_DIGEST_LEN];
+
+  sha1_digest(buf, size, obuf);
   for (int i = 0; i < 15; ++i) {
-    char *p = (char *)sig + i * 5;
-    sprintf(p, "0x%02x ", obuf[i]);
+    char *p = sig + i * 5;
+    p[0] = '0';
+    p[1] = 'x';
+    p[2] = hex[obuf[i] >> 4];
+    p[3] = hex[obuf[i] & 0xf];
+    p[4] = ' ';
   }
+  sig[75] = '\0';
   return sig;
 }
 
+const char *sha1_sig(uint8_t *buf, uint32_t size) {
+  static char sig[SHA1_SIG_LEN];
+  return sha1_sig_r(buf, size, sig);
+}
+
 uint32_t get_rand(uint32_t min, uint32_t max) {
   uint32_t v;
   int rc = RAND_bytes((uint8_t *)&v, sizeof(v));
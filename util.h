@@ -7,7 +7,38 @@ void enable_debug_log(void);
 void set_debug_logfile(const char *filename);
 void debug_log(const char *fmt, ...);
 
+/* Writes the debug log as binary records instead of text, to be formatted
+ * later by logdecode. Must be called before the first debug_log. */
+void set_debug_log_binary(void);
+
+/* A binary debug log starts with DEBUG_LOG_MAGIC. Each entry after it is a
+ * type byte followed by native-endian fields:
+ *   DEBUG_LOG_FORMAT: u16 format id, u16 length, the format string
+ *   DEBUG_LOG_RECORD: u64 ns, u16 format id, u16 thread, u16 length, the
+ *                     packed arguments (see debug_log_format)
+ * A format is defined before the first record that uses it. */
+#define DEBUG_LOG_MAGIC "MDADMLG1"
+#define DEBUG_LOG_FORMAT 'F'
+#define DEBUG_LOG_RECORD 'R'
+
+/* Formats the |len| bytes of arguments a debug_log call with |fmt| packed:
+ * ints as 4 bytes, longs, pointers and doubles as 8, strings as a length
+ * byte and their characters. Writes at most |size| bytes, NUL included, to
+ * |out| and returns the length of the message. */
+int debug_log_format(const char *fmt, const uint8_t *args, uint32_t len, char *out, uint32_t size);
+
+/* Stores the SHA-1 digest of |buf|, SHA1_DIGEST_LEN bytes, in |digest|.
+ * Safe to call from several threads. */
+#define SHA1_DIGEST_LEN 20
+void sha1_digest(const uint8_t *buf, uint32_t size, uint8_t *digest);
+
+/* Formats the first 15 bytes of the SHA-1 digest of |buf| as "0x.. " groups.
+ * sha1_sig returns a static buffer, overwritten by the next call;
+ * sha1_sig_r writes to |sig|, SHA1_SIG_LEN bytes, and is safe to call from
+ * several threads. Both return the signature. */
+#define SHA1_SIG_LEN 80
 const char *sha1_sig(uint8_t *buf, uint32_t size);
+const char *sha1_sig_r(const uint8_t *buf, uint32_t size, char *sig);
 uint32_t get_rand(uint32_t min, uint32_t max);
 
 #endif